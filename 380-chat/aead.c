@@ -0,0 +1,118 @@
+#include "aead.h"
+#include "record.h"
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <endian.h>
+#include <string.h>
+
+int aeadByName(const char* name)
+{
+	if (strcmp(name,"aes-gcm") == 0) return AEAD_AES_GCM;
+	if (strcmp(name,"chacha20") == 0) return AEAD_CHACHA20;
+	return -1;
+}
+
+static int initDir(aeadDir* d, const EVP_CIPHER* cipher,
+		const unsigned char* key, const unsigned char* iv, int enc)
+{
+	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+	if (!ctx) return -1;
+	/* the key schedule happens here, once; records only set the nonce */
+	if (!EVP_CipherInit_ex(ctx,cipher,NULL,key,NULL,enc)) {
+		EVP_CIPHER_CTX_free(ctx);
+		return -1;
+	}
+	d->ctx = ctx;
+	memcpy(d->iv,iv,AEAD_IV_LEN);
+	d->seq = 0;
+	return 0;
+}
+
+int aeadInit(aeadChan* c, int alg, const unsigned char* km, int side)
+{
+	const EVP_CIPHER* cipher = (alg == AEAD_CHACHA20) ?
+		EVP_chacha20_poly1305() : EVP_aes_256_gcm();
+	/* km = key0 || key1 || iv0 || iv1; side s sends with key s */
+	const unsigned char* key[2] = {km, km + AEAD_KEY_LEN};
+	const unsigned char* iv[2] = {km + 2*AEAD_KEY_LEN,
+		km + 2*AEAD_KEY_LEN + AEAD_IV_LEN};
+	side = !!side;
+	memset(c,0,sizeof(*c));
+	if (initDir(&c->send,cipher,key[side],iv[side],1) != 0 ||
+			initDir(&c->recv,cipher,key[!side],iv[!side],0) != 0) {
+		aeadFree(c);
+		return -1;
+	}
+	return 0;
+}
+
+/* set the nonce for record d->seq and authenticate its header */
+static int start(aeadDir* d, const unsigned char* hdr)
+{
+	EVP_CIPHER_CTX* ctx = d->ctx;
+	unsigned char nonce[AEAD_IV_LEN];
+	uint64_t seqBE = htobe64(d->seq);
+	int n;
+	if (d->seq == UINT64_MAX) return -1; /* out of nonces */
+	memcpy(nonce,d->iv,AEAD_IV_LEN);
+	for (int i = 0; i < 8; i++)
+		nonce[AEAD_IV_LEN - 8 + i] ^= ((unsigned char*)&seqBE)[i];
+	if (!EVP_CipherInit_ex(ctx,NULL,NULL,NULL,nonce,-1) ||
+			!EVP_CipherUpdate(ctx,NULL,&n,hdr,REC_HDR))
+		return -1;
+	d->seq++;
+	return 0;
+}
+
+int aeadSealv(aeadChan* c, unsigned char* hdr, unsigned char* ct,
+		unsigned char* tag, const unsigned char* pt, size_t n, unsigned flags)
+{
+	EVP_CIPHER_CTX* ctx = c->send.ctx;
+	int len, fin;
+	if (n > REC_MAX_PLAIN) return -1;
+	recHeader(hdr,n + AEAD_TAG_LEN,flags);
+	/* NOTE: both ciphers are stream modes, so fin is 0 and the
+	 * ciphertext is exactly n bytes */
+	if (start(&c->send,hdr) != 0 ||
+			!EVP_CipherUpdate(ctx,ct,&len,pt,n) ||
+			!EVP_CipherFinal_ex(ctx,ct + len,&fin) ||
+			!EVP_CIPHER_CTX_ctrl(ctx,EVP_CTRL_AEAD_GET_TAG,AEAD_TAG_LEN,tag))
+		return -1;
+	return 0;
+}
+
+int aeadSeal(aeadChan* c, unsigned char* rec, const unsigned char* pt,
+		size_t n, unsigned flags)
+{
+	if (aeadSealv(c,rec,rec + REC_HDR,rec + REC_HDR + n,pt,n,flags) != 0)
+		return -1;
+	return REC_HDR + n + AEAD_TAG_LEN;
+}
+
+int aeadOpen(aeadChan* c, unsigned char* pt, const unsigned char* body,
+		size_t blen, unsigned flags)
+{
+	EVP_CIPHER_CTX* ctx = c->recv.ctx;
+	unsigned char hdr[REC_HDR];
+	int len, fin;
+	if (blen < AEAD_TAG_LEN) return -1;
+	size_t n = blen - AEAD_TAG_LEN;
+	recHeader(hdr,blen,flags);
+	if (start(&c->recv,hdr) != 0 ||
+			!EVP_CipherUpdate(ctx,pt,&len,body,n) ||
+			!EVP_CIPHER_CTX_ctrl(ctx,EVP_CTRL_AEAD_SET_TAG,AEAD_TAG_LEN,
+				(void*)(body + n)) ||
+			EVP_CipherFinal_ex(ctx,pt + len,&fin) <= 0) {
+		OPENSSL_cleanse(pt,n);
+		return -1;
+	}
+	return len + fin;
+}
+
+void aeadFree(aeadChan* c)
+{
+	/* freeing the contexts erases their key schedules */
+	EVP_CIPHER_CTX_free(c->send.ctx);
+	EVP_CIPHER_CTX_free(c->recv.ctx);
+	OPENSSL_cleanse(c,sizeof(*c));
+}
@@ -0,0 +1,61 @@
+/* Authenticated encryption of records (record.h) for one session.
+ *
+ * The key material from dh3Final is split into a key and a 12 byte IV for
+ * each direction.  Each direction keeps its cipher context, so the key
+ * schedule is done once per session; a record only sets its nonce, which
+ * is the direction's IV xor the record's sequence number (as in TLS 1.3).
+ * The record header is authenticated along with the body, so records can't
+ * be dropped, reordered, replayed or have their flag changed unnoticed. */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define AEAD_KEY_LEN 32
+#define AEAD_IV_LEN  12
+#define AEAD_TAG_LEN 16
+/** bytes of key material aeadInit takes */
+#define AEAD_KM_LEN  (2*(AEAD_KEY_LEN + AEAD_IV_LEN))
+
+enum { AEAD_AES_GCM, AEAD_CHACHA20 };
+
+typedef struct {
+	void* ctx;              /* EVP_CIPHER_CTX, keyed */
+	unsigned char iv[AEAD_IV_LEN];
+	uint64_t seq;           /* of the next record */
+} aeadDir;
+
+typedef struct {
+	aeadDir send, recv;
+} aeadChan;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** look up a cipher by name ("aes-gcm" or "chacha20"); -1 if there's no such */
+int aeadByName(const char* name);
+/** key c with AEAD_KM_LEN bytes of km.  The two ends must pass different
+ * values of side (0 or 1), since each one's send keys are the other's
+ * receive keys; comparing the ephemeral public keys settles it without
+ * regard to who connected.  @return 0 on success, -1 on failure */
+int aeadInit(aeadChan* c, int alg, const unsigned char* km, int side);
+/** encrypt pt[0..n) (n <= REC_MAX_PLAIN) into a whole record at rec,
+ * header included, with the given REC_... flags (which are authenticated
+ * too).  @return the record's length, or -1 */
+int aeadSeal(aeadChan* c, unsigned char* rec, const unsigned char* pt,
+		size_t n, unsigned flags);
+/** aeadSeal with the record's parts wherever the caller wants them: the
+ * REC_HDR byte header at hdr, n bytes of ciphertext at ct (which may be
+ * pt, to encrypt in place) and the AEAD_TAG_LEN byte tag at tag.
+ * @return 0, or -1 on failure */
+int aeadSealv(aeadChan* c, unsigned char* hdr, unsigned char* ct,
+		unsigned char* tag, const unsigned char* pt, size_t n, unsigned flags);
+/** check and decrypt a record's body (and flags, as from recParse) into
+ * pt, which has room for blen bytes.  @return the plaintext's length, or
+ * -1 if the record isn't authentic (and the session should be dropped) */
+int aeadOpen(aeadChan* c, unsigned char* pt, const unsigned char* body,
+		size_t blen, unsigned flags);
+/** free c's contexts and erase its keys */
+void aeadFree(aeadChan* c);
+#ifdef __cplusplus
+}
+#endif
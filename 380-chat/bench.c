@@ -0,0 +1,522 @@
+/* Rough timings for the DH primitives.  Also cross-checks the fast paths
+ * against plain mpz_powm, so it doubles as a sanity test. */
+#include "dh.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <gmp.h>
+#include "util.h"
+#include "rng.h"
+#include "mont.h"
+#include "hkdf.h"
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <endian.h>
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int nfail = 0;
+#define CHECK(cond, what) \
+	do { if (!(cond)) { fprintf(stderr, "FAIL: %s\n", what); nfail++; } } while (0)
+
+/* time n calls of dhGen, with the fixed-base table on or off */
+static double timeGen(int fixed, size_t n)
+{
+	NEWZ(sk);
+	NEWZ(pk);
+	dhFixedBase = fixed;
+	double t0 = now();
+	for (size_t i = 0; i < n; i++) dhGen(sk,pk);
+	double t = (now() - t0) / n;
+	dhFixedBase = 1;
+	mpz_clear(sk);
+	mpz_clear(pk);
+	return t;
+}
+
+static void benchGen()
+{
+	/* results must agree with mpz_powm: */
+	NEWZ(sk);
+	NEWZ(pk);
+	NEWZ(t);
+	for (size_t i = 0; i < 16; i++) {
+		dhGen(sk,pk);
+		mpz_powm(t,g,sk,p);
+		CHECK(mpz_cmp(t,pk) == 0, "dhGen (fixed base) != mpz_powm");
+	}
+	const size_t n = 50;
+	double slow = timeGen(0,n);
+	double fast = timeGen(1,n);
+	printf("dhGen: powm     %8.1f us   fixed-base %8.1f us   (%.1fx)\n",
+			slow*1e6, fast*1e6, slow/fast);
+	mpz_clear(sk);
+	mpz_clear(pk);
+	mpz_clear(t);
+}
+
+/* x = random number in [0,m) (close enough to uniform for testing) */
+static void randZ(mpz_t x, mpz_t m)
+{
+	size_t len = mpz_sizeinbase(m,256) + 16;
+	unsigned char buf[len];
+	randBytes(buf,len);
+	BYTES2Z(x,buf,len);
+	mpz_mod(x,x,m);
+}
+
+/* montPowm against mpz_powm, for each kernel we have */
+static void benchMont()
+{
+	NEWZ(b);
+	NEWZ(e);
+	NEWZ(r);
+	NEWZ(t);
+	NEWZ(sk);
+	char what[128];
+	for (int simd = 0; simd < 2; simd++) {
+		if (montUseSimd(simd) != simd) continue;
+		snprintf(what,sizeof(what),"montPowm (%s) != mpz_powm",montKernel());
+		for (size_t i = 0; i < 32; i++) {
+			/* some edge cases for the base, then random ones */
+			if (i == 0) mpz_set_ui(b,0);
+			else if (i == 1) mpz_sub_ui(b,p,1);
+			else if (i == 2) mpz_set(b,p);
+			else randZ(b,p);
+			/* short and full length exponents */
+			randZ(e,(i % 2) ? q : p);
+			montPowm(r,b,e);
+			mpz_powm(t,b,e,p);
+			CHECK(mpz_cmp(r,t) == 0, what);
+		}
+		/* and the comb table, which is rebuilt for each kernel */
+		snprintf(what,sizeof(what),"dhGen (%s) != mpz_powm",montKernel());
+		for (size_t i = 0; i < 8; i++) {
+			dhGen(sk,r);
+			mpz_powm(t,g,sk,p);
+			CHECK(mpz_cmp(r,t) == 0, what);
+		}
+		const size_t n = 50;
+		randZ(b,p);
+		randZ(e,q);
+		double t0 = now();
+		for (size_t i = 0; i < n; i++) mpz_powm(t,b,e,p);
+		double tZ = (now() - t0) / n;
+		t0 = now();
+		for (size_t i = 0; i < n; i++) montPowm(r,b,e);
+		double tM = (now() - t0) / n;
+		printf("powm (%zu bit e): mpz_powm %8.1f us   %-10s %8.1f us   (%.2fx)\n",
+				qBitlen, tZ*1e6, montKernel(), tM*1e6, tZ/tM);
+	}
+	montUseSimd(1);
+	mpz_clears(b,e,r,t,sk,NULL);
+}
+
+/* the KDF the way dhFinal used to do it: one-shot HMAC() calls over a
+ * buffer holding K(i) || CTX || i */
+static void oldKdf(unsigned char* out, size_t len, const char* salt,
+		const unsigned char* ikm, size_t ikmlen,
+		const unsigned char* ctx, size_t ctxlen)
+{
+	unsigned char PRK[HKDF_LEN], K[HKDF_LEN];
+	HMAC(EVP_sha512(),salt,strlen(salt),ikm,ikmlen,PRK,0);
+	size_t buflen = HKDF_LEN + ctxlen + 8;
+	unsigned char* buf = calloc(buflen,1);
+	memcpy(buf+HKDF_LEN,ctx,ctxlen);
+	for (uint64_t i = 0; len; i++) {
+		uint64_t iBE = htobe64(i);
+		memcpy(buf+HKDF_LEN+ctxlen,&iBE,8);
+		HMAC(EVP_sha512(),PRK,HKDF_LEN,buf,buflen,K,0);
+		memcpy(buf,K,HKDF_LEN);
+		size_t n = (len < HKDF_LEN) ? len : HKDF_LEN;
+		memcpy(out,K,n);
+		out += n;
+		len -= n;
+	}
+	free(buf);
+}
+
+static void benchKdf()
+{
+	const size_t ikmlen = 3*pLen, ctxlen = 2*pLen;
+	unsigned char ikm[ikmlen], ctx[ctxlen], a[200], b[200];
+	randBytes(ikm,ikmlen);
+	randBytes(ctx,ctxlen);
+	const char* salt = "some salt";
+	hkdfPiece vi = {ikm,ikmlen};
+	/* CTX in pieces, to check they're hashed as one string */
+	hkdfPiece vc[3] = {{ctx,10},{ctx+10,0},{ctx+10,ctxlen-10}};
+	size_t lens[4] = {1,64,65,200};
+	for (size_t i = 0; i < 4; i++) {
+		oldKdf(a,lens[i],salt,ikm,ikmlen,ctx,ctxlen);
+		hkdf(b,lens[i],salt,strlen(salt),&vi,1,vc,3);
+		CHECK(memcmp(a,b,lens[i]) == 0, "hkdf != old kdf");
+	}
+	/* streaming, in uneven steps */
+	unsigned char prk[HKDF_LEN];
+	hkdfState st;
+	hkdfExtract(prk,salt,strlen(salt),&vi,1);
+	hkdfInit(&st,prk,vc,3);
+	for (size_t off = 0, step = 1; off < 200; off += step, step += 7)
+		hkdfExpand(&st,b+off,(off + step > 200) ? 200 - off : step);
+	hkdfWipe(&st);
+	CHECK(memcmp(a,b,200) == 0, "hkdfExpand in pieces != old kdf");
+	const size_t n = 2000;
+	double t0 = now();
+	for (size_t i = 0; i < n; i++) oldKdf(a,64,salt,ikm,ikmlen,ctx,ctxlen);
+	double tOld = (now() - t0) / n;
+	t0 = now();
+	for (size_t i = 0; i < n; i++) hkdf(b,64,salt,strlen(salt),&vi,1,vc,3);
+	double tNew = (now() - t0) / n;
+	printf("kdf (64 bytes): HMAC() %8.2f us   hkdf %8.2f us   (%.2fx)\n",
+			tOld*1e6, tNew*1e6, tOld/tNew);
+}
+
+/* what dhGen used to do for each key */
+static void urandomBytes(unsigned char* buf, size_t len)
+{
+	FILE* f = fopen("/dev/urandom","rb");
+	if (!f) return;
+	if (fread(buf,1,len,f) != len) nfail++;
+	fclose(f);
+}
+
+static void benchRand()
+{
+	const size_t len = 96; /* qLen + 32 */
+	const size_t n = 2000;
+	unsigned char a[len], b[len];
+	randBytes(a,len);
+	randBytes(b,len);
+	CHECK(memcmp(a,b,len) != 0, "randBytes repeated itself");
+	double t0 = now();
+	for (size_t i = 0; i < n; i++) urandomBytes(a,len);
+	double t1 = now();
+	for (size_t i = 0; i < n; i++) randBytes(a,len);
+	double t2 = now();
+	double slow = (t1-t0)/n, fast = (t2-t1)/n;
+	printf("%zu random bytes: fopen(/dev/urandom) %6.2f us   randBytes %6.2f us   (%.0fx)\n",
+			len, slow*1e6, fast*1e6, slow/fast);
+}
+
+static void benchPool()
+{
+	const size_t n = 8;
+	if (dhPoolStart(n) != 0) {
+		CHECK(0, "dhPoolStart");
+		return;
+	}
+	/* let the pool fill up, then drain it (plus a few more, which have
+	 * to fall back to dhGen) and make sure nothing repeats: */
+	usleep(n * 20000);
+	mpz_t sk[2*n], pk[2*n];
+	double t0 = now();
+	for (size_t i = 0; i < 2*n; i++) {
+		mpz_init(sk[i]);
+		mpz_init(pk[i]);
+		dhGenEphemeral(sk[i],pk[i]);
+	}
+	double t = (now() - t0) / (2*n);
+	dhPoolStop();
+	NEWZ(t1);
+	for (size_t i = 0; i < 2*n; i++) {
+		mpz_powm(t1,g,sk[i],p);
+		CHECK(mpz_cmp(t1,pk[i]) == 0, "dhGenEphemeral: pk != g^sk");
+		for (size_t j = 0; j < i; j++)
+			CHECK(mpz_cmp(sk[i],sk[j]) != 0, "dhGenEphemeral: key reused");
+	}
+	printf("dhGenEphemeral: %8.1f us average over %zu calls (pool of %zu)\n",
+			t*1e6, 2*n, n);
+	for (size_t i = 0; i < 2*n; i++) {
+		mpz_clear(sk[i]);
+		mpz_clear(pk[i]);
+	}
+	mpz_clear(t1);
+}
+
+/* a generator that never works, for benchPoolFail */
+static int failGen(mpz_t sk, mpz_t pk)
+{
+	return -1;
+}
+
+/* failed generations must never reach the pool: dhGenEphemeral falls back
+ * to dhGen, and never hands out what a failed call left behind (0s) */
+static void benchPoolFail()
+{
+	dhPoolGen = failGen;
+	CHECK(dhPoolStart(4) == 0, "dhPoolStart");
+	usleep(3 * DH_POOL_RETRY_MS * 1000);
+	NEWZ(sk);
+	NEWZ(pk);
+	NEWZ(t);
+	for (size_t i = 0; i < 4; i++) {
+		CHECK(dhGenEphemeral(sk,pk) == 0, "dhGenEphemeral failed");
+		mpz_powm(t,g,sk,p);
+		CHECK(mpz_sgn(sk) != 0 && mpz_cmp(t,pk) == 0,
+				"dhGenEphemeral: handed out a pair from a failed dhGen");
+	}
+	dhPoolStop();
+	dhPoolGen = dhGen;
+	mpz_clears(sk,pk,t,NULL);
+}
+
+/* fresh long-term and ephemeral keys for both parties */
+typedef struct {
+	mpz_t a, A, x, X, b, B, y, Y;
+} hsKeys;
+
+static void hsKeysGen(hsKeys* k)
+{
+	mpz_inits(k->a,k->A,k->x,k->X,k->b,k->B,k->y,k->Y,NULL);
+	dhGen(k->a,k->A);
+	dhGen(k->x,k->X);
+	dhGen(k->b,k->B);
+	dhGen(k->y,k->Y);
+}
+
+static void hsKeysClear(hsKeys* k)
+{
+	mpz_clears(k->a,k->A,k->x,k->X,k->b,k->B,k->y,k->Y,NULL);
+}
+
+/* time n calls of dh3Final with the given option toggled on or off */
+static double time3DH(int* opt, int val, hsKeys* k, size_t n)
+{
+	unsigned char kbuf[64];
+	int old = *opt;
+	*opt = val;
+	double t0 = now();
+	for (size_t i = 0; i < n; i++)
+		dh3Final(k->a,k->A,k->x,k->X,k->B,k->Y,kbuf,sizeof(kbuf));
+	*opt = old;
+	return (now() - t0) / n;
+}
+
+/* compare keys from dh3Final with the option off (reference) and on,
+ * and check that both parties agree. */
+static void check3DH(int* opt, const char* name)
+{
+	char what[128];
+	for (size_t i = 0; i < 4; i++) {
+		hsKeys k;
+		hsKeysGen(&k);
+		unsigned char ref[96], kA[96], kB[96];
+		int old = *opt;
+		*opt = 0;
+		dh3Final(k.a,k.A,k.x,k.X,k.B,k.Y,ref,sizeof(ref));
+		*opt = 1;
+		dh3Final(k.a,k.A,k.x,k.X,k.B,k.Y,kA,sizeof(kA));
+		dh3Final(k.b,k.B,k.y,k.Y,k.A,k.X,kB,sizeof(kB));
+		*opt = old;
+		snprintf(what,sizeof(what),"dh3Final (%s) != reference",name);
+		CHECK(memcmp(ref,kA,sizeof(ref)) == 0, what);
+		snprintf(what,sizeof(what),"dh3Final (%s): parties disagree",name);
+		CHECK(memcmp(kA,kB,sizeof(kA)) == 0, what);
+		hsKeysClear(&k);
+	}
+}
+
+static void bench3DH(int* opt, const char* name)
+{
+	check3DH(opt,name);
+	hsKeys k;
+	hsKeysGen(&k);
+	const size_t n = 20;
+	double slow = time3DH(opt,0,&k,n);
+	double fast = time3DH(opt,1,&k,n);
+	printf("dh3Final: %-12s off %8.1f us   on %8.1f us   (%.2fx)\n",
+			name, slow*1e6, fast*1e6, slow/fast);
+	hsKeysClear(&k);
+}
+
+/* dh3FinalBatch against dh3Final in a loop: same keys, and handshakes/s */
+static void benchBatch()
+{
+	const size_t n = 16;
+	hsKeys k[n];
+	dh3Session s[n];
+	unsigned char ref[n][64], out[n][64];
+	for (size_t i = 0; i < n; i++) {
+		hsKeysGen(&k[i]);
+		s[i] = (dh3Session){k[i].a,k[i].A,k[i].x,k[i].X,k[i].B,k[i].Y,
+			out[i],sizeof(out[i])};
+	}
+	double t0 = now();
+	for (size_t i = 0; i < n; i++)
+		dh3Final(k[i].a,k[i].A,k[i].x,k[i].X,k[i].B,k[i].Y,ref[i],sizeof(ref[i]));
+	double tLoop = now() - t0;
+	t0 = now();
+	CHECK(dh3FinalBatch(s,n) == 0, "dh3FinalBatch failed");
+	double tBatch = now() - t0;
+	CHECK(memcmp(ref,out,sizeof(ref)) == 0, "dh3FinalBatch != dh3Final");
+	/* and a batch that isn't a multiple of the lane count */
+	memset(out,0,sizeof(out));
+	CHECK(dh3FinalBatch(s,5) == 0, "dh3FinalBatch failed");
+	CHECK(memcmp(ref,out,5*sizeof(ref[0])) == 0, "dh3FinalBatch(5) != dh3Final");
+	printf("dh3Final x%zu: loop %6.0f /s   batch %6.0f /s   (%.2fx, %zu lanes)\n",
+			n, n/tLoop, n/tBatch, tLoop/tBatch, montLanes());
+	for (size_t i = 0; i < n; i++) hsKeysClear(&k[i]);
+}
+
+/* the same handshake in each group: timings, and both sides must agree */
+static void benchGroups()
+{
+	const dhGroup* groups[2] = {&dhGroupFF,&dhGroupX25519};
+	char what[128];
+	for (size_t i = 0; i < 2; i++) {
+		const dhGroup* G = groups[i];
+		NEWZ(a); NEWZ(A); NEWZ(x); NEWZ(X);
+		NEWZ(b); NEWZ(B); NEWZ(y); NEWZ(Y);
+		const size_t n = 20;
+		double t0 = now();
+		for (size_t j = 0; j < n; j++) dhGenG(G,x,X);
+		double tGen = (now() - t0) / n;
+		dhGenG(G,a,A);
+		dhGenG(G,b,B);
+		dhGenG(G,y,Y);
+		unsigned char kA[64], kB[64];
+		t0 = now();
+		for (size_t j = 0; j < n; j++)
+			dh3FinalG(G,a,A,x,X,B,Y,kA,sizeof(kA));
+		double t3 = (now() - t0) / n;
+		CHECK(dh3FinalG(G,b,B,y,Y,A,X,kB,sizeof(kB)) == 0, "dh3FinalG failed");
+		snprintf(what,sizeof(what),"dh3FinalG (%s): parties disagree",G->name);
+		CHECK(memcmp(kA,kB,sizeof(kA)) == 0, what);
+		dhFinalG(G,a,A,B,kA,sizeof(kA));
+		dhFinalG(G,b,B,A,kB,sizeof(kB));
+		snprintf(what,sizeof(what),"dhFinalG (%s): parties disagree",G->name);
+		CHECK(memcmp(kA,kB,sizeof(kA)) == 0, what);
+		printf("group %-7s: %4zu byte keys   gen %8.1f us   dh3Final %8.1f us\n",
+				G->name, G->len(), tGen*1e6, t3*1e6);
+		mpz_clears(a,A,x,X,b,B,y,Y,NULL);
+	}
+}
+
+/* peer keys that G->check must turn away: out of range, and (ff) of small
+ * order, i.e. in a subgroup of p-1's other factors rather than q's */
+static void benchCheck()
+{
+	const dhGroup* G = &dhGroupFF;
+	NEWZ(x); NEWZ(X); NEWZ(v); NEWZ(h);
+	dhGenG(G,x,X);
+	CHECK(G->check(X) == 0, "check (ff): refused a good key");
+	const size_t n = 20;
+	double t0 = now();
+	for (size_t j = 0; j < n; j++) G->check(X);
+	double t = (now() - t0) / n;
+	long bad[] = {0, 1, -1, 0};
+	for (size_t i = 0; i < 4; i++) {
+		mpz_set_si(v,bad[i]);
+		if (i == 2) mpz_add(v,v,p);   /* p-1, of order 2 */
+		if (i == 3) mpz_add(v,X,p);   /* X, unreduced */
+		CHECK(G->check(v) != 0, "check (ff): took an out of range key");
+	}
+	/* h^q has order dividing (p-1)/q; not 1, it's not in q's subgroup */
+	size_t nSmall = 0;
+	for (size_t i = 0; i < 8; i++) {
+		randZ(h,p);
+		mpz_powm(v,h,q,p);
+		if (mpz_cmp_ui(v,1) == 0) continue;
+		nSmall++;
+		CHECK(G->check(v) != 0, "check (ff): took a small order key");
+		/* and one that's X times a small order element */
+		mpz_mul(v,v,X);
+		mpz_mod(v,v,p);
+		CHECK(G->check(v) != 0, "check (ff): took a key outside the subgroup");
+	}
+	CHECK(nSmall > 0, "check (ff): no small order elements to try");
+	/* x25519: small order points pass check, but no DH comes of them */
+	G = &dhGroupX25519;
+	unsigned char out[64];
+	dhGenG(G,x,X);
+	CHECK(G->check(X) == 0, "check (x25519): refused a good key");
+	for (unsigned long u = 0; u < 2; u++) {
+		mpz_set_ui(v,u);
+		CHECK(G->agree(out,NULL,x,v) != 0, "x25519: agreed with a small order key");
+	}
+	mpz_setbit(v,8*G->len());
+	CHECK(G->check(v) != 0, "check (x25519): took an oversized key");
+	printf("check (ff): %8.1f us\n", t*1e6);
+	mpz_clears(x,X,v,h,NULL);
+}
+
+/* readDH of the same key stored both ways; they must load the same */
+static void benchKeys()
+{
+	char tfile[] = "/tmp/dh-bench-key-XXXXXX", bfile[] = "/tmp/dh-bench-key-XXXXXX";
+	int tfd = mkstemp(tfile), bfd = mkstemp(bfile);
+	CHECK(tfd >= 0 && bfd >= 0, "mkstemp failed");
+	if (tfd < 0 || bfd < 0) return;
+	close(tfd);
+	close(bfd);
+	dhKey k, kt, kb;
+	dhGenk(&k);
+	strcpy(k.name,"bench key, with spaces");
+	CHECK(writeDHText(tfile,&k) == 0 && writeDH(bfile,&k) == 0, "writeDH failed");
+	const size_t n = 200;
+	double t[2];
+	for (int i = 0; i < 2; i++) {
+		char* f = i ? bfile : tfile;
+		dhKey* r = i ? &kb : &kt;
+		double t0 = now();
+		for (size_t j = 0; j < n; j++) {
+			if (j) shredKey(r);
+			readDH(f,r);
+		}
+		t[i] = (now() - t0) / n;
+		CHECK(mpz_cmp(r->PK,k.PK) == 0 && mpz_cmp(r->SK,k.SK) == 0 &&
+				strcmp(r->name,k.name) == 0, "readDH: key differs from the one written");
+	}
+	printf("readDH: text %8.1f us   binary %8.1f us   (%.1fx)\n",
+			t[0]*1e6, t[1]*1e6, t[0]/t[1]);
+	shredKey(&k);
+	shredKey(&kt);
+	shredKey(&kb);
+	char pub[sizeof(tfile) + 4];
+	for (int i = 0; i < 2; i++) {
+		char* f = i ? bfile : tfile;
+		snprintf(pub,sizeof(pub),"%s.pub",f);
+		unlink(f);
+		unlink(pub);
+	}
+}
+
+int main()
+{
+	const char* pfile = (access("params.bin",R_OK) == 0) ? "params.bin" : "params";
+	double t0 = now();
+	if (init(pfile) != 0) {
+		fprintf(stderr, "could not read DH params from file '%s'\n", pfile);
+		return 1;
+	}
+	printf("init(%s): %.2f ms\n", pfile, (now() - t0)*1e3);
+	benchRand();
+	benchMont();
+	benchKdf();
+	benchGen();
+	benchKeys();
+	benchPool();
+	benchPoolFail();
+	benchGroups();
+	benchCheck();
+	benchBatch();
+	bench3DH(&dhMont,"mont");
+	bench3DH(&dhMultiExp,"multiexp");
+	bench3DH(&dhParallel,"parallel");
+	dhMultiExp = 0;
+	bench3DH(&dhParallel,"parallel(3)");
+	dhMultiExp = 1;
+	if (nfail) {
+		printf("%i check(s) failed\n", nfail);
+		return 1;
+	}
+	return 0;
+}
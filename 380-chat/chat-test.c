@@ -0,0 +1,642 @@
+/* Checks for the chat modules that dh-bench doesn't cover: records and
+ * their AEAD, tickets, the key store, scrollback, the message log, and the
+ * server's relaying (run against a real server on a loopback port). */
+#include "dh.h"
+#include "util.h"
+#include "server.h"
+#include "handshake.h"
+#include "record.h"
+#include "aead.h"
+#include "ticket.h"
+#include "keystore.h"
+#include "history.h"
+#include "msglog.h"
+#include "rng.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int nfail = 0;
+#define CHECK(cond, what) \
+	do { if (!(cond)) { fprintf(stderr, "FAIL: %s\n", what); nfail++; } } while (0)
+
+/* a client of the server */
+typedef struct {
+	int fd;
+	xstream xs;
+	aeadChan ch;
+} client;
+
+static int port;
+
+static void stop(int sig)
+{
+	(void)sig;
+	serverStop();
+}
+
+/* connect and do the handshake (the ticket that follows is left to
+ * clientRecv, which skips it) */
+static int clientOpen(client* c)
+{
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	unsigned char km[AEAD_KM_LEN + HS_SECRET_LEN];
+	int side;
+	if ((c->fd = socket(AF_INET,SOCK_STREAM,0)) < 0) return -1;
+	if (connect(c->fd,(struct sockaddr*)&addr,sizeof(addr)) != 0) {
+		close(c->fd);
+		return -1;
+	}
+	xsInit(&c->xs,c->fd,HS_TIMEOUT);
+	if (hsRun(&c->xs,&dhGroupFF,NULL,NULL,NULL,km,sizeof(km),&side) != 0 ||
+			aeadInit(&c->ch,AEAD_AES_GCM,km,side) != 0) {
+		close(c->fd);
+		return -1;
+	}
+	memset(km,0,sizeof(km));
+	return 0;
+}
+
+static void clientClose(client* c)
+{
+	aeadFree(&c->ch);
+	close(c->fd);
+}
+
+/* send the records of a len byte message that cover msg[from..to), as
+ * sendMessage would (from and to on record boundaries) */
+static int clientSend(client* c, const char* msg, size_t from, size_t to,
+		size_t len)
+{
+	unsigned char rec[REC_HDR + REC_MAX];
+	size_t off = from;
+	do {
+		size_t n = len - off;
+		if (n > REC_MAX_PLAIN) n = REC_MAX_PLAIN;
+		int m = aeadSeal(&c->ch,rec,(const unsigned char*)msg + off,n,
+				off + n < len ? REC_MORE : 0);
+		if (m < 0 || xwrite(c->fd,rec,m) != 0) return -1;
+		off += n;
+	} while (off < to);
+	return 0;
+}
+
+/* the next message for the transcript (control records are skipped).
+ * @return it (malloc'd; *len bytes), or NULL on an error */
+static char* clientRecv(client* c, size_t* len)
+{
+	unsigned char rec[REC_HDR + REC_MAX];
+	char* msg = NULL;
+	*len = 0;
+	for (;;) {
+		uint32_t h;
+		const unsigned char* body;
+		size_t blen;
+		unsigned flags;
+		if (xsRead(&c->xs,rec,REC_HDR) != 0) break;
+		memcpy(&h,rec,4);
+		size_t n = le32toh(h) & ~(REC_MORE | REC_CTRL);
+		if (n > REC_MAX || xsRead(&c->xs,rec + REC_HDR,n) != 0 ||
+				recParse(rec,REC_HDR + n,&body,&blen,&flags) <= 0)
+			break;
+		char* m = realloc(msg,*len + blen);
+		if (!m) break;
+		msg = m;
+		int k = aeadOpen(&c->ch,(unsigned char*)msg + *len,body,blen,flags);
+		if (k < 0) break;
+		if (flags & REC_CTRL) continue;
+		*len += k;
+		if (!(flags & REC_MORE)) return msg;
+	}
+	free(msg);
+	return NULL;
+}
+
+/* is the next message for c msg[0..len)? */
+static int receives(client* c, const char* msg, size_t len)
+{
+	size_t n;
+	char* m = clientRecv(c,&n);
+	int rv = m && n == len && memcmp(m,msg,len) == 0;
+	free(m);
+	return rv;
+}
+
+/* remove a scratch directory (from mkdtemp) and what's in it */
+static void rmScratch(const char* dir)
+{
+	char path[4096];
+	DIR* d = opendir(dir);
+	struct dirent* e;
+	while (d && (e = readdir(d))) {
+		if (e->d_name[0] == '.') continue;
+		snprintf(path,sizeof(path),"%s/%s",dir,e->d_name);
+		unlink(path);
+	}
+	if (d) closedir(d);
+	rmdir(dir);
+}
+
+/* records sealed on one end open on the other, and nothing else does */
+static void checkRecords(int alg)
+{
+	unsigned char km[AEAD_KM_LEN];
+	unsigned char pt[REC_MAX_PLAIN], out[REC_MAX];
+	unsigned char rec[4][REC_HDR + REC_MAX];
+	int len[4];
+	const unsigned char* body;
+	size_t blen;
+	unsigned flags;
+	unsigned fl[4] = {0, REC_MORE, 0, REC_CTRL};
+	size_t n[4] = {0, REC_MAX_PLAIN, 1000, 33};
+	aeadChan a, b;
+	randBytes(km,sizeof(km));
+	randBytes(pt,sizeof(pt));
+	CHECK(aeadInit(&a,alg,km,0) == 0 && aeadInit(&b,alg,km,1) == 0,
+			"aead: init failed");
+	for (int i = 0; i < 4; i++) {
+		len[i] = aeadSeal(&a,rec[i],pt,n[i],fl[i]);
+		CHECK(len[i] == (int)(REC_HDR + n[i] + AEAD_TAG_LEN), "aead: bad length");
+	}
+	CHECK(aeadSeal(&a,rec[0],pt,REC_MAX_PLAIN + 1,0) < 0,
+			"aead: sealed an oversized record");
+	/* in order, they open, flags and all */
+	for (int i = 0; i < 4; i++) {
+		CHECK(recParse(rec[i],len[i],&body,&blen,&flags) == len[i] &&
+				flags == fl[i], "recParse: bad record or flags");
+		CHECK(recParse(rec[i],len[i] - 1,&body,&blen,&flags) == 0,
+				"recParse: took part of a record");
+		CHECK(aeadOpen(&b,out,body,blen,flags) == (int)n[i] &&
+				memcmp(out,pt,n[i]) == 0, "aead: round trip failed");
+	}
+	/* replayed: the sequence number has moved on */
+	recParse(rec[3],len[3],&body,&blen,&flags);
+	CHECK(aeadOpen(&b,out,body,blen,flags) < 0, "aead: opened a replay");
+	aeadFree(&b);
+	/* each kind of damage, on a fresh receiver that has opened records 0
+	 * and 1, so that record 2 is the one it expects next */
+	for (int k = 0; k < 4; k++) {
+		unsigned char r[REC_HDR + REC_MAX];
+		int i = (k == 3) ? 3 : 2;               /* 3: skips record 2 */
+		unsigned f = fl[i];
+		memcpy(r,rec[i],len[i]);
+		if (k == 0) r[REC_HDR + 10] ^= 1;       /* ciphertext */
+		if (k == 1) r[len[i] - 1] ^= 0x80;      /* tag */
+		if (k == 2) f |= REC_MORE;              /* flags */
+		CHECK(aeadInit(&b,alg,km,1) == 0, "aead: init failed");
+		for (int j = 0; j < 2; j++) {
+			recParse(rec[j],len[j],&body,&blen,&flags);
+			aeadOpen(&b,out,body,blen,flags);
+		}
+		recParse(r,len[i],&body,&blen,&flags);
+		CHECK(aeadOpen(&b,out,body,blen,f) < 0, "aead: opened a bad record");
+		aeadFree(&b);
+	}
+	/* headers recParse must refuse */
+	unsigned char hdr[REC_HDR + 8] = {0};
+	recHeader(hdr,0,0);
+	CHECK(recParse(hdr,sizeof(hdr),&body,&blen,&flags) < 0,
+			"recParse: took an empty record");
+	recHeader(hdr,REC_MAX + 1,0);
+	CHECK(recParse(hdr,sizeof(hdr),&body,&blen,&flags) < 0,
+			"recParse: took an oversized record");
+	aeadFree(&a);
+}
+
+static void checkTickets()
+{
+	unsigned char secret[TICKET_SECRET_LEN], fp[TICKET_FP_LEN];
+	unsigned char s2[TICKET_SECRET_LEN], f2[TICKET_FP_LEN];
+	unsigned char t1[TICKET_LEN], t2[TICKET_LEN], t3[TICKET_LEN];
+	ticketKeys tk, other;
+	randBytes(secret,sizeof(secret));
+	randBytes(fp,sizeof(fp));
+	CHECK(tkInit(&tk,60) == 0 && tkInit(&other,60) == 0, "ticket: init failed");
+	CHECK(tkIssue(&tk,t1,secret,fp) == 0 && tkOpen(&tk,t1,s2,f2) == 0 &&
+			memcmp(s2,secret,sizeof(s2)) == 0 && memcmp(f2,fp,sizeof(f2)) == 0,
+			"ticket: round trip failed");
+	CHECK(tkOpen(&other,t1,s2,f2) != 0, "ticket: opened someone else's");
+	for (size_t i = 0; i < TICKET_LEN; i += 7) {
+		memcpy(t2,t1,TICKET_LEN);
+		t2[i] ^= 1;                   /* the key id, nonce, ciphertext or tag */
+		CHECK(tkOpen(&tk,t2,s2,f2) != 0, "ticket: opened a damaged one");
+	}
+	/* a lifetime later the key is replaced; tickets under the old one are
+	 * still good, but not under the one before that */
+	tk.cur.born -= 60;
+	CHECK(tkIssue(&tk,t2,secret,fp) == 0 && tk.cur.id == tk.prev.id + 1,
+			"ticket: key wasn't replaced");
+	CHECK(tkOpen(&tk,t1,s2,f2) == 0 && tkOpen(&tk,t2,s2,f2) == 0,
+			"ticket: lost the previous key too soon");
+	tk.cur.born -= 60;
+	CHECK(tkIssue(&tk,t3,secret,fp) == 0, "ticket: issue failed");
+	CHECK(tkOpen(&tk,t1,s2,f2) != 0, "ticket: opened one under a dropped key");
+	CHECK(tkOpen(&tk,t2,s2,f2) == 0 && tkOpen(&tk,t3,s2,f2) == 0,
+			"ticket: lost a live key");
+	tkFree(&tk);
+	/* and with no lifetime at all, each ticket is stale when it's issued */
+	CHECK(tkInit(&tk,0) == 0 && tkIssue(&tk,t1,secret,fp) == 0 &&
+			tkOpen(&tk,t1,s2,f2) != 0, "ticket: opened an expired one");
+	tkFree(&tk);
+	tkFree(&other);
+}
+
+/* the store against a plain array of what it should hold, through random
+ * adds, renames and removes, a reload (which compacts the log) and a torn
+ * tail on the log */
+#define KS_KEYS 500
+#define KS_OPS  15000
+static int ksMatches(const keyStore* ks, mpz_t* pk, const int* in,
+		char (*name)[32])
+{
+	size_t n = 0;
+	for (size_t i = 0; i < KS_KEYS; i++) {
+		const ksEntry* e = ksFindPK(ks,pk[i]);
+		unsigned char fp[KS_FP_LEN];
+		fingerprintPK(pk[i],fp);
+		if (!e != !in[i] || ksFind(ks,fp) != e) return 0;
+		if (e && (strcmp(e->name,name[i]) != 0 || mpz_cmp(e->PK,pk[i]) != 0))
+			return 0;
+		n += in[i];
+	}
+	return ks->n == n;
+}
+
+static void checkKeyStore(const char* dir)
+{
+	char path[4096];
+	snprintf(path,sizeof(path),"%s/peers",dir);
+	gmp_randstate_t rs;
+	gmp_randinit_default(rs);
+	gmp_randseed_ui(rs,380);
+	srand(380);
+	mpz_t pk[KS_KEYS];
+	int in[KS_KEYS] = {0};
+	char name[KS_KEYS][32];
+	for (size_t i = 0; i < KS_KEYS; i++) {
+		mpz_init(pk[i]);
+		mpz_urandomb(pk[i],rs,pBitlen);
+		snprintf(name[i],sizeof(name[i]),"peer %zu",i);
+	}
+	keyStore ks;
+	CHECK(ksOpen(&ks,path) == 0, "keystore: open failed");
+	int bad = 0;
+	for (size_t op = 0; op < KS_OPS; op++) {
+		size_t i = rand() % KS_KEYS;
+		unsigned char fp[KS_FP_LEN];
+		if (rand() % 4 == 0) {
+			fingerprintPK(pk[i],fp);
+			bad += (ksRemove(&ks,fp) == 0) != in[i];
+			in[i] = 0;
+		} else {
+			if (in[i] && rand() % 3 == 0)
+				snprintf(name[i],sizeof(name[i]),"renamed %zu",op);
+			bad += ksAdd(&ks,name[i],pk[i]) != 0;
+			in[i] = 1;
+		}
+	}
+	CHECK(!bad, "keystore: an add or remove failed (or a remove didn't)");
+	CHECK(ksMatches(&ks,pk,in,name), "keystore: differs from the model");
+	CHECK(ksSync(&ks) == 0, "keystore: sync failed");
+	ksClose(&ks);
+	struct stat st[2];
+	stat(path,&st[0]);
+	CHECK(ksOpen(&ks,path) == 0 && ksMatches(&ks,pk,in,name),
+			"keystore: differs from the model after reloading");
+	stat(path,&st[1]);
+	CHECK(st[1].st_size < st[0].st_size, "keystore: log wasn't compacted");
+	/* the compacted log must be the one written to from here on */
+	snprintf(name[0],sizeof(name[0]),"after compacting");
+	in[0] = 1;
+	CHECK(ksAdd(&ks,name[0],pk[0]) == 0, "keystore: add after compacting failed");
+	/* a compaction that can't write its temporary keeps the old log */
+	char tmp[4096 + 8];
+	snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+	CHECK(mkdir(tmp,0700) == 0 && ksCompact(&ks) != 0,
+			"keystore: compacting onto a directory succeeded");
+	rmdir(tmp);
+	snprintf(name[1],sizeof(name[1]),"after failing to compact");
+	in[1] = 1;
+	CHECK(ksAdd(&ks,name[1],pk[1]) == 0,
+			"keystore: add after a failed compaction failed");
+	ksClose(&ks);
+	CHECK(ksOpen(&ks,path) == 0 && ksMatches(&ks,pk,in,name),
+			"keystore: changes after compacting were lost");
+	/* a store that loses its file must say so, not carry on in memory */
+	close(ks.fd);
+	ks.fd = -1;
+	CHECK(ksAdd(&ks,"lost",pk[2]) != 0, "keystore: add without a file succeeded");
+	ksClose(&ks);
+	/* half a record at the end, as from a crash mid-append */
+	int fd = open(path,O_WRONLY | O_APPEND);
+	CHECK(fd >= 0 && write(fd,"\x40\0\0\0+xx",7) == 7, "keystore: append failed");
+	if (fd >= 0) close(fd);
+	CHECK(ksOpen(&ks,path) == 0 && ksMatches(&ks,pk,in,name),
+			"keystore: a torn tail spoiled the rest");
+	ksClose(&ks);
+	for (size_t i = 0; i < KS_KEYS; i++) mpz_clear(pk[i]);
+	gmp_randclear(rs);
+}
+
+/* histRead's callback: compare with what was appended */
+typedef struct {
+	char** text;
+	size_t* len;
+	uint64_t next;          /* message we expect */
+	uint64_t stopAt;        /* return 1 here */
+	int bad;
+} histCheck;
+
+static int histCmp(void* arg, int who, const char* text, size_t len)
+{
+	histCheck* c = arg;
+	uint64_t i = c->next++;
+	if (who != (int)(i % 3) || len != c->len[i] || memcmp(text,c->text[i],len))
+		c->bad = 1;
+	return i + 1 == c->stopAt;
+}
+
+static void checkHistory(const char* dir)
+{
+	const size_t n = 3000;
+	history* h = malloc(sizeof(history));
+	char** text = malloc(n*sizeof(char*));
+	size_t* len = malloc(n*sizeof(size_t));
+	CHECK(h && text && len && histOpen(h,dir) == 0, "history: open failed");
+	if (!h || !text || !len) return;
+	for (size_t i = 0; i < n; i++) {
+		/* now and then one bigger than the write buffer */
+		len[i] = (i % 500 == 7) ? HIST_BUFSIZE + i : rand() % 300;
+		text[i] = malloc(len[i] + 1);
+		for (size_t j = 0; j < len[i]; j++) text[i][j] = 'a' + (i + j) % 26;
+		CHECK(histAppend(h,i % 3,text[i],len[i]) == 0, "history: append failed");
+	}
+	/* whole, random ranges, and ranges that run off the end */
+	size_t from[] = {0, 0, n - 1, n, n + 5, 10, 0};
+	size_t to[] = {n, 1, n, n, n + 10, 5, n + 100};
+	for (size_t k = 0; k < sizeof(from)/sizeof(from[0]) + 50; k++) {
+		size_t i, j;
+		if (k < sizeof(from)/sizeof(from[0])) {
+			i = from[k];
+			j = to[k];
+		} else {
+			i = rand() % n;
+			j = i + rand() % 400;
+		}
+		histCheck c = {text,len,i,UINT64_MAX,0};
+		CHECK(histRead(h,i,j,histCmp,&c) == 0 && !c.bad &&
+				c.next == (i < j && i < n ? (j < n ? j : n) : i),
+				"history: read the wrong messages");
+	}
+	/* fn's nonzero return stops the read */
+	histCheck c = {text,len,100,150,0};
+	CHECK(histRead(h,100,200,histCmp,&c) == 1 && c.next == 150 && !c.bad,
+			"history: didn't stop when asked");
+	histClose(h);
+	for (size_t i = 0; i < n; i++) free(text[i]);
+	free(text);
+	free(len);
+	free(h);
+}
+
+/* mlogSearch's callback: count matches */
+typedef struct {
+	size_t n, fromFriend;
+	uint64_t last;
+	int bad;
+} logCount;
+
+static int logCounted(void* arg, const mlogEntry* e, const char* text)
+{
+	logCount* c = arg;
+	c->n++;
+	c->fromFriend += e->sender == 1;
+	if (e->time < c->last || strlen(text) != e->len) c->bad = 1;
+	c->last = e->time;
+	return 0;
+}
+
+/* name (without .seg) of the only session log in dir */
+static int logName(const char* dir, char* name)
+{
+	DIR* d = opendir(dir);
+	struct dirent* e;
+	int n = 0;
+	while (d && (e = readdir(d))) {
+		size_t len = strlen(e->d_name);
+		if (len > 4 && len - 4 < MLOG_NAME_MAX &&
+				strcmp(e->d_name + len - 4,".seg") == 0) {
+			memcpy(name,e->d_name,len - 4);
+			name[len - 4] = 0;
+			n++;
+		}
+	}
+	if (d) closedir(d);
+	return n == 1 ? 0 : -1;
+}
+
+static void checkMsgLog(const char* dir)
+{
+	const size_t n = 2000;
+	unsigned char vault[MLOG_KEY_LEN], other[MLOG_KEY_LEN], key[MLOG_KEY_LEN];
+	NEWZ(sk);
+	mpz_set_ui(sk,380);
+	CHECK(mlogVaultKey(vault,sk) == 0, "msglog: no vault key");
+	mpz_set_ui(sk,381);
+	mlogVaultKey(other,sk);
+	mpz_clear(sk);
+	randBytes(key,sizeof(key));
+	msgLog l;
+	char m[64];
+	CHECK(mlogCreate(&l,dir,key,vault) == 0, "msglog: create failed");
+	for (size_t i = 0; i < n; i++) {
+		int k = snprintf(m,sizeof(m),"message %zu%s",i,i % 100 ? "" : " needle");
+		CHECK(mlogAppend(&l,i % 2,m,k) == 0, "msglog: append failed");
+	}
+	CHECK(mlogClose(&l) == 0, "msglog: close failed");
+	char name[MLOG_NAME_MAX];
+	mlogReader r;
+	CHECK(logName(dir,name) == 0 && mlogOpen(&r,dir,name,vault) == 0 &&
+			r.n == n, "msglog: didn't get back what went in");
+	if (r.n != n) return;
+	/* every message, and find by time */
+	int bad = 0;
+	for (size_t i = 0; i < n; i++) {
+		int k = snprintf(m,sizeof(m),"message %zu%s",i,i % 100 ? "" : " needle");
+		char out[64];
+		bad |= le32toh(r.ents[i].len) != (uint32_t)k ||
+			mlogRead(&r,i,out) != 0 || memcmp(out,m,k) != 0;
+		size_t f = mlogFind(&r,le64toh(r.ents[i].time));
+		bad |= f > i || le64toh(r.ents[f].time) != le64toh(r.ents[i].time);
+	}
+	CHECK(!bad, "msglog: a message or its time didn't read back");
+	CHECK(mlogFind(&r,UINT64_MAX) == n && mlogFind(&r,0) == 0,
+			"msglog: find out of range");
+	mlogCloseReader(&r);
+	/* search: by text, by sender, by time, and with the wrong vault */
+	logCount c = {0};
+	CHECK(mlogSearch(dir,vault,0,UINT64_MAX,MLOG_ANY,"needle",logCounted,&c)
+			== 0 && c.n == n / 100 && !c.bad, "msglog: search by text");
+	memset(&c,0,sizeof(c));
+	CHECK(mlogSearch(dir,vault,0,UINT64_MAX,1,NULL,logCounted,&c) == 0 &&
+			c.n == n / 2 && c.fromFriend == n / 2, "msglog: search by sender");
+	memset(&c,0,sizeof(c));
+	CHECK(mlogSearch(dir,vault,0,1,MLOG_ANY,NULL,logCounted,&c) == 0 &&
+			c.n == 0, "msglog: search by time");
+	memset(&c,0,sizeof(c));
+	CHECK(mlogSearch(dir,other,0,UINT64_MAX,MLOG_ANY,NULL,logCounted,&c) == 0 &&
+			c.n == 0, "msglog: another vault saw messages");
+	CHECK(mlogOpen(&r,dir,name,other) == -2, "msglog: opened with another vault");
+	/* a crash before the last group's message was all written: the index
+	 * runs past the segment, and its last entry is dropped */
+	char path[4096];
+	struct stat st;
+	snprintf(path,sizeof(path),"%s/%s.seg",dir,name);
+	CHECK(stat(path,&st) == 0 && truncate(path,st.st_size - 1) == 0,
+			"msglog: truncate failed");
+	CHECK(mlogOpen(&r,dir,name,vault) == 0 && r.n == n - 1,
+			"msglog: kept an entry past the end of the segment");
+	mlogCloseReader(&r);
+	/* an index entry that has been doctored doesn't read */
+	snprintf(path,sizeof(path),"%s/%s.idx",dir,name);
+	int fd = open(path,O_RDWR);
+	uint32_t sender = htole32(7);
+	CHECK(fd >= 0 && pwrite(fd,&sender,4,16 + 5*sizeof(mlogEntry) +
+				offsetof(mlogEntry,sender)) == 4, "msglog: write failed");
+	if (fd >= 0) close(fd);
+	char out[64];
+	CHECK(mlogOpen(&r,dir,name,vault) == 0 && mlogRead(&r,5,out) != 0 &&
+			mlogRead(&r,6,out) == 0, "msglog: read a doctored entry");
+	mlogCloseReader(&r);
+}
+
+/* two clients send long messages at the same time, and a third session
+ * opens while one of them is half sent.  Every message must arrive whole,
+ * to everyone open by the time it ends. */
+static void checkRelay()
+{
+	const size_t len = 5*REC_MAX_PLAIN + 123;
+	char* m1 = malloc(len);
+	char* m2 = malloc(len);
+	for (size_t i = 0; i < len; i++) {
+		m1[i] = 'a' + i % 26;
+		m2[i] = 'A' + i % 26;
+	}
+	client a, b, c, d;
+	if (clientOpen(&a) != 0 || clientOpen(&b) != 0 || clientOpen(&c) != 0) {
+		CHECK(0, "relay: couldn't connect");
+		return;
+	}
+	/* let the server finish all three handshakes */
+	usleep(100000);
+	/* a's records and b's alternate on the way in */
+	size_t half = 2*REC_MAX_PLAIN;
+	CHECK(clientSend(&a,m1,0,half,len) == 0, "relay: send failed");
+	usleep(50000);
+	CHECK(clientSend(&b,m2,0,half,len) == 0, "relay: send failed");
+	usleep(50000);
+	CHECK(clientOpen(&d) == 0, "relay: couldn't connect");
+	usleep(100000);
+	CHECK(clientSend(&a,m1,half,len,len) == 0, "relay: send failed");
+	usleep(50000);
+	CHECK(clientSend(&b,m2,half,len,len) == 0, "relay: send failed");
+	CHECK(receives(&c,m1,len) && receives(&c,m2,len),
+			"relay: a message was garbled on the way");
+	CHECK(receives(&d,m1,len) && receives(&d,m2,len),
+			"relay: a session that opened midway got part of a message");
+	CHECK(receives(&a,m2,len) && receives(&b,m1,len),
+			"relay: a sender didn't get the other's message");
+	/* and short ones still go straight through */
+	CHECK(clientSend(&c,"hi",0,2,2) == 0 && receives(&a,"hi",2) &&
+			receives(&b,"hi",2) && receives(&d,"hi",2), "relay: short message lost");
+	clientClose(&a);
+	clientClose(&b);
+	clientClose(&c);
+	clientClose(&d);
+	free(m1);
+	free(m2);
+}
+
+/* SERVER_MAX_MESSAGE is the longest message that gets through; sendMessage
+ * refuses longer ones, because the server drops whoever sends them */
+static void checkLimit()
+{
+	const size_t len = SERVER_MAX_MESSAGE + 1;
+	char* m = malloc(len);
+	for (size_t i = 0; i < len; i++) m[i] = 'a' + i % 26;
+	client a, b, c;
+	if (clientOpen(&a) != 0 || clientOpen(&b) != 0) {
+		CHECK(0, "limit: couldn't connect");
+		free(m);
+		return;
+	}
+	usleep(100000);
+	CHECK(clientSend(&a,m,0,len - 1,len - 1) == 0 && receives(&b,m,len - 1),
+			"limit: a message of SERVER_MAX_MESSAGE bytes didn't get through");
+	/* the server may hang up before it has all of this */
+	clientSend(&a,m,0,len,len);
+	size_t n;
+	char* got = clientRecv(&a,&n);
+	CHECK(!got, "limit: a sender over the limit wasn't dropped");
+	free(got);
+	CHECK(clientOpen(&c) == 0, "limit: couldn't connect");
+	CHECK(clientSend(&c,"hi",0,2,2) == 0 && receives(&b,"hi",2),
+			"limit: part of a message over the limit was relayed");
+	clientClose(&a);
+	clientClose(&b);
+	clientClose(&c);
+	free(m);
+}
+
+int main()
+{
+	const char* pfile = (access("params.bin",R_OK) == 0) ? "params.bin" : "params";
+	if (init(pfile) != 0) {
+		fprintf(stderr, "could not read DH params from file '%s'\n", pfile);
+		return 1;
+	}
+	checkRecords(AEAD_AES_GCM);
+	checkRecords(AEAD_CHACHA20);
+	checkTickets();
+	char dir[] = "/tmp/chat-test-XXXXXX";
+	if (mkdtemp(dir)) {
+		checkKeyStore(dir);
+		checkHistory(dir);
+		checkMsgLog(dir);
+		rmScratch(dir);
+	} else {
+		CHECK(0, "couldn't make a scratch directory");
+	}
+	port = 20000 + getpid() % 20000;
+	pid_t srv = fork();
+	if (srv == 0) {
+		signal(SIGTERM,stop);
+		_exit(serverRun(port,&dhGroupFF,AEAD_AES_GCM,NULL,NULL) != 0);
+	}
+	usleep(200000);
+	/* checkLimit's sender is hung up on mid-message */
+	signal(SIGPIPE,SIG_IGN);
+	checkRelay();
+	checkLimit();
+	kill(srv,SIGTERM);
+	int status;
+	waitpid(srv,&status,0);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, "server failed");
+	if (nfail) {
+		printf("%i check(s) failed\n", nfail);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
@@ -9,11 +9,25 @@
 #include <getopt.h>
 #include "dh.h"
 #include "keys.h"
+#include "server.h"
+#include "keystore.h"
+#include "handshake.h"
+#include "record.h"
+#include "aead.h"
+#include "sendq.h"
+#include "history.h"
+#include "msglog.h"
 #include <gmp.h>
 #include "util.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+
+/** messages kept in the transcript's buffer (see tsShow) by default */
+#define TS_WINDOW 1000
 
 #ifndef PATH_MAX
 #define PATH_MAX 1024
@@ -119,88 +133,326 @@ static const char* usage =
 "Secure chat (CCNY computer security project).\n\n"
 "   -c, --connect HOST  Attempt a connection to HOST.\n"
 "   -l, --listen        Listen for new connections.\n"
+"   -s, --serve         Run a multi-client server (no GUI): messages from\n"
+"                       each client are relayed to all the others.\n"
 "   -p, --port    PORT  Listen or connect on PORT (defaults to 1337).\n"
+"   -g, --group   NAME  Key exchange group: ff or x25519 (defaults to ff).\n"
+"                       Both sides must use the same group.\n"
+"   -a, --aead    NAME  Message cipher: aes-gcm or chacha20 (defaults to\n"
+"                       aes-gcm).  Both sides must use the same one.\n"
+"   -i, --identity FILE Long term key (made on first use; FILE.pub is the\n"
+"                       part to give to peers).  Without it, each run\n"
+"                       uses a fresh one.\n"
+"   -k, --known   FILE  Store of peers' public keys: only talk to (or, with\n"
+"                       -s, let in) peers whose key is there.\n"
+"   -t, --trust   FILE  Add the public key in FILE to the -k store and exit.\n"
+"   -r, --resume  FILE  Keep the server's session ticket in FILE, and use\n"
+"                       it to skip most of the key exchange next time.\n"
+"   -d, --resume-dh     With -r, still do one DH when resuming, so that the\n"
+"                       session keys don't depend on the ticket alone.\n"
+"   -w, --window  N     Keep the last N messages on screen; older ones are\n"
+"                       paged in from disk as you scroll (defaults to 1000).\n"
+"   -L, --log     DIR   Keep an encrypted log of each session in DIR.  Needs\n"
+"                       -i: only that key can open the logs.\n"
+"   -S, --search  TEXT  With -L and -i, print the logged messages that\n"
+"                       contain TEXT (all of them, if it's empty) and exit.\n"
 "   -h, --help          show this message and exit.\n";
 
-/* Append message to transcript with optional styling.  NOTE: tagnames, if not
- * NULL, must have it's last pointer be NULL to denote its end.  We also require
- * that messsage is a NULL terminated string.  If ensurenewline is non-zero, then
- * a newline may be added at the end of the string (possibly overwriting the \0
- * char!) and the view will be scrolled to ensure the added line is visible.  */
-static void tsappend(char* message, char** tagnames, int ensurenewline)
+static aeadChan chan; /* keys for this session, from the handshake */
+static sendq sendQ;   /* for sockfd */
+static xstream net;   /* reads from sockfd (and the handshake's write) */
+static char* ticketfile;                 /* -r */
+static unsigned char tsecret[HS_SECRET_LEN]; /* for this session's ticket */
+
+/* The transcript.  tbuf holds a window of about tsWindow messages, and
+ * every message also goes to hist (see history.h).  While the window
+ * reaches the newest message, new ones go on the end and the oldest drop
+ * off the top; scrolling near either end of tbuf pages messages back in
+ * from hist, dropping as many from the other end.  So tbuf, and the
+ * layout GTK keeps for it, stay the same size however long we chat. */
+/* WHO_STATUS lines are ours, about the chat; they're not sent or logged */
+enum { WHO_SELF, WHO_FRIEND, WHO_STATUS };
+static const char* const whoName[] = {"me: ", "mr. friend: ", "* "};
+static const char* const whoTag[] = {"self", "friend", "status"};
+
+static history hist;
+static msgLog mlog;       /* if logdir */
+static char* logdir;      /* -L */
+static guint tsWindow = TS_WINDOW;
+static struct {
+    uint64_t first; /* hist index of tbuf's first message */
+    GQueue chars;   /* length of each message in tbuf, in chars */
+    int paging;     /* we're moving tbuf about; ignore the scrolling */
+} live = {0, G_QUEUE_INIT};
+
+/* messages as they go in tbuf (name, text, newline), to insert together */
+typedef struct {
+    gsize at;       /* where it starts in text */
+    glong chars;    /* and its length there */
+    int who;
+} tsMsg;
+
+typedef struct {
+    GString* text;
+    GArray* msgs;   /* of tsMsg */
+} tsBatch;
+
+static void tsBatchAdd(tsBatch* b, int who, const char* msg, size_t len)
 {
-	GtkTextIter t0;
-	gtk_text_buffer_get_end_iter(tbuf,&t0);
-	size_t len = g_utf8_strlen(message,-1);
-	if (ensurenewline && message[len-1] != '\n')
-		message[len++] = '\n';
-	gtk_text_buffer_insert(tbuf,&t0,message,len);
-	GtkTextIter t1;
-	gtk_text_buffer_get_end_iter(tbuf,&t1);
-	/* Insertion of text may have invalidated t0, so recompute: */
-	t0 = t1;
-	gtk_text_iter_backward_chars(&t0,len);
-	if (tagnames) {
-		char** tag = tagnames;
-		while (*tag) {
-			gtk_text_buffer_apply_tag_by_name(tbuf,*tag,&t0,&t1);
-			tag++;
-		}
-	}
-	if (!ensurenewline) return;
-	gtk_text_buffer_add_mark(tbuf,mark,&t1);
-	gtk_text_view_scroll_to_mark(tview,mark,0.0,0,0.0,0.0);
-	gtk_text_buffer_delete_mark(tbuf,mark);
+    if (!b->text) {
+        b->text = g_string_new(NULL);
+        b->msgs = g_array_new(FALSE, FALSE, sizeof(tsMsg));
+    }
+    tsMsg m = {b->text->len, 0, who};
+    g_string_append(b->text, whoName[who]);
+    g_string_append_len(b->text, msg, len);
+    if (!len || msg[len-1] != '\n')
+        g_string_append_c(b->text, '\n');
+    m.chars = g_utf8_strlen(b->text->str + m.at, b->text->len - m.at);
+    g_array_append_val(b->msgs, m);
 }
 
-#include <openssl/evp.h>
-#include <openssl/err.h>
+static void tsBatchFree(tsBatch* b)
+{
+    if (!b->text) return;
+    g_string_free(b->text, TRUE);
+    g_array_free(b->msgs, TRUE);
+    b->text = NULL;
+    b->msgs = NULL;
+}
+
+/* put b's messages from on in tbuf, at the top or the bottom, with one
+ * insert and one pass of tagging */
+static void tsInsert(tsBatch* b, guint from, int top)
+{
+    const tsMsg* m = &g_array_index(b->msgs, tsMsg, 0);
+    const guint n = b->msgs->len;
+    GtkTextIter t0, t1;
+    if (top) gtk_text_buffer_get_start_iter(tbuf, &t0);
+    else gtk_text_buffer_get_end_iter(tbuf, &t0);
+    gint off = gtk_text_iter_get_offset(&t0);
+    gtk_text_buffer_insert(tbuf, &t0, b->text->str + m[from].at,
+            b->text->len - m[from].at);
+    for (guint i = from; i < n; i++) {
+        gtk_text_buffer_get_iter_at_offset(tbuf, &t0, off);
+        t1 = t0;
+        /* status lines are tagged whole, messages just by name */
+        gtk_text_iter_forward_chars(&t1, m[i].who == WHO_STATUS ?
+                m[i].chars - 1 : (glong)strlen(whoName[m[i].who]));
+        gtk_text_buffer_apply_tag_by_name(tbuf, whoTag[m[i].who], &t0, &t1);
+        off += m[i].chars;
+    }
+    for (guint i = from; i < n; i++) {
+        if (top) g_queue_push_head(&live.chars,
+                GSIZE_TO_POINTER(m[n - 1 - i + from].chars));
+        else g_queue_push_tail(&live.chars, GSIZE_TO_POINTER(m[i].chars));
+    }
+}
+
+/* drop n messages from the top of tbuf (or the bottom) */
+static void tsDrop(guint n, int top)
+{
+    glong chars = 0;
+    for (guint i = 0; i < n; i++)
+        chars += GPOINTER_TO_SIZE(top ? g_queue_pop_head(&live.chars) :
+                g_queue_pop_tail(&live.chars));
+    GtkTextIter t0, t1;
+    if (top) {
+        gtk_text_buffer_get_start_iter(tbuf, &t0);
+        gtk_text_buffer_get_iter_at_offset(tbuf, &t1, chars);
+        live.first += n;
+    } else {
+        gtk_text_buffer_get_end_iter(tbuf, &t1);
+        gtk_text_buffer_get_iter_at_offset(tbuf, &t0,
+                gtk_text_buffer_get_char_count(tbuf) - chars);
+    }
+    gtk_text_buffer_delete(tbuf, &t0, &t1);
+}
+
+static int tsCollect(void* b, int who, const char* text, size_t len)
+{
+    tsBatchAdd(b, who, text, len);
+    return 0;
+}
+
+/* (main thread) scrolled near the top of tbuf (older) or the bottom:
+ * page in up to a quarter window of messages there from hist */
+static void tsPage(int older)
+{
+    const guint count = g_queue_get_length(&live.chars);
+    const guint chunk = tsWindow / 4 ? tsWindow / 4 : 1;
+    uint64_t i, j;
+    if (older) {
+        j = live.first;
+        i = j > chunk ? j - chunk : 0;
+    } else {
+        i = live.first + count;
+        j = hist.n - i > chunk ? i + chunk : hist.n;
+    }
+    tsBatch b = {0};
+    if (i >= j || histRead(&hist, i, j, tsCollect, &b) != 0) {
+        tsBatchFree(&b);
+        return;
+    }
+    /* keep the text on screen where it is */
+    GdkRectangle r;
+    GtkTextIter it;
+    gtk_text_view_get_visible_rect(tview, &r);
+    gtk_text_view_get_iter_at_location(tview, &it, r.x, r.y);
+    GtkTextMark* anchor = gtk_text_buffer_create_mark(tbuf, NULL, &it, FALSE);
+    live.paging = 1;
+    tsInsert(&b, 0, older);
+    if (older) live.first = i;
+    if (count + (j - i) > tsWindow) tsDrop(count + (j - i) - tsWindow, !older);
+    gtk_text_view_scroll_to_mark(tview, anchor, 0.0, TRUE, 0.0, 0.0);
+    gtk_text_buffer_delete_mark(tbuf, anchor);
+    live.paging = 0;
+    tsBatchFree(&b);
+}
+
+static void onScroll(GtkAdjustment* adj, gpointer data)
+{
+    if (live.paging) return;
+    gdouble v = gtk_adjustment_get_value(adj);
+    gdouble page = gtk_adjustment_get_page_size(adj);
+    if (v < page / 2)
+        tsPage(1);
+    else if (v + page > gtk_adjustment_get_upper(adj) - page / 2)
+        tsPage(0);
+}
+
+/* (main thread) new messages: into hist, and onto the end of tbuf if it
+ * shows the newest ones (or jump is set: our own message takes us there) */
+static void tsShow(tsBatch* b, int jump)
+{
+    const tsMsg* m = &g_array_index(b->msgs, tsMsg, 0);
+    const guint n = b->msgs->len;
+    guint count = g_queue_get_length(&live.chars);
+    int following = (live.first + count == hist.n);
+    for (guint i = 0; i < n; i++) {
+        /* the name is ours; keep what was said */
+        gsize at = m[i].at + strlen(whoName[m[i].who]);
+        gsize end = (i + 1 < n) ? m[i+1].at : b->text->len;
+        if (histAppend(&hist, m[i].who, b->text->str + at, end - at) != 0)
+            error("could not write scrollback");
+    }
+    if (!following && !jump) return;
+    live.paging = 1;
+    /* no sense inserting more than fits */
+    guint from = (n > tsWindow) ? n - tsWindow : 0;
+    if (!following || from) {
+        tsDrop(count, 1);
+        live.first = hist.n - (n - from);
+        count = 0;
+    }
+    tsInsert(b, from, 0);
+    count += n - from;
+    if (count > tsWindow) tsDrop(count - tsWindow, 1);
+    live.paging = 0;
+    if (!following) tsPage(1); /* some context above the jump */
+    GtkTextIter t1;
+    gtk_text_buffer_get_end_iter(tbuf, &t1);
+    gtk_text_buffer_add_mark(tbuf, mark, &t1);
+    gtk_text_view_scroll_to_mark(tview, mark, 0.0, 0, 0.0, 0.0);
+    gtk_text_buffer_delete_mark(tbuf, mark);
+}
+
+/* Received messages are shown once per frame, however fast they come:
+ * recvMsg adds each one to the inbox, and the first one since the last
+ * frame asks for a tick callback, which puts the whole lot in the
+ * transcript with one insert, one pass of tagging and one scroll.  There
+ * are no frames while the window is hidden (minimized, say), so a timeout
+ * of INBOX_WAIT_MS does the same if the tick doesn't come first. */
+#define INBOX_WAIT_MS 100
+static struct {
+    pthread_mutex_t lock;
+    tsBatch b;
+    int armed;      /* a tick callback (or the timeout) is coming */
+    guint tick;     /* (main thread) their ids, while they're pending */
+    guint timer;
+} inbox = {PTHREAD_MUTEX_INITIALIZER};
+
+/* (main thread) move the inbox to the transcript; tick says it's the
+ * frame's callback, rather than sendMessage catching up */
+static void showInbox(int tick)
+{
+    pthread_mutex_lock(&inbox.lock);
+    tsBatch b = inbox.b;
+    inbox.b = (tsBatch){NULL, NULL};
+    if (tick) inbox.armed = 0;
+    pthread_mutex_unlock(&inbox.lock);
+    if (!b.text) return;
+    tsShow(&b, 0);
+    tsBatchFree(&b);
+}
+
+static gboolean inboxTick(GtkWidget* w, GdkFrameClock* clock, gpointer data)
+{
+    inbox.tick = 0;
+    if (inbox.timer) g_source_remove(inbox.timer);
+    inbox.timer = 0;
+    showInbox(1);
+    return G_SOURCE_REMOVE; /* the next message asks again */
+}
 
-static unsigned char *final_key = NULL; // Define final_key as a global variable
+static gboolean inboxTimeout(gpointer data)
+{
+    inbox.timer = 0;
+    if (inbox.tick) gtk_widget_remove_tick_callback(GTK_WIDGET(tview), inbox.tick);
+    inbox.tick = 0;
+    showInbox(1);
+    return G_SOURCE_REMOVE;
+}
 
-void handleErrors(void) {
-    ERR_print_errors_fp(stderr);
-    abort();
+static gboolean armInbox(gpointer data)
+{
+    inbox.tick = gtk_widget_add_tick_callback(GTK_WIDGET(tview), inboxTick,
+            NULL, NULL);
+    inbox.timer = g_timeout_add(INBOX_WAIT_MS, inboxTimeout, NULL);
+    return G_SOURCE_REMOVE;
 }
 
-int encrypt(unsigned char *plaintext, int plaintext_len, unsigned char *key,
-            unsigned char *iv, unsigned char *ciphertext) {
-    EVP_CIPHER_CTX *ctx;
-    int len;
-    int ciphertext_len;
-
-    if(!(ctx = EVP_CIPHER_CTX_new())) handleErrors();
-    if(1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv)) handleErrors();
-    if(1 != EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len)) handleErrors();
-    ciphertext_len = len;
-    if(1 != EVP_EncryptFinal_ex(ctx, ciphertext + len, &len)) handleErrors();
-    ciphertext_len += len;
-    EVP_CIPHER_CTX_free(ctx);
-
-    return ciphertext_len;
+/* the window is going away: what's still in the inbox goes to the
+ * transcript (and hist) while there is one */
+static void onDestroy(GtkWidget* w, gpointer data)
+{
+    showInbox(0);
+    gtk_main_quit();
 }
 
-int decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned char *key,
-            unsigned char *iv, unsigned char *plaintext) {
-    EVP_CIPHER_CTX *ctx;
-    int len;
-    int plaintext_len;
-
-    if(!(ctx = EVP_CIPHER_CTX_new())) handleErrors();
-    if(1 != EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv)) handleErrors();
-    if(1 != EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len)) handleErrors();
-    plaintext_len = len;
-    if(1 != EVP_DecryptFinal_ex(ctx, plaintext + len, &len)) handleErrors();
-    plaintext_len += len;
-    EVP_CIPHER_CTX_free(ctx);
-
-    return plaintext_len;
+/* into the message log (if there is one) as soon as it's sent or
+ * received, whether or not it's ever shown.  Thread safe (mlogAppend is). */
+static void logMessage(int who, const char* msg, size_t len)
+{
+    if (logdir && mlogAppend(&mlog, who, msg, len) != 0)
+        error("could not write the message log");
+}
+
+/* (receiving thread) log msg[0..len), and queue it for the next frame */
+static void postMessage(const char* msg, size_t len)
+{
+    logMessage(WHO_FRIEND, msg, len);
+    /* the text buffer takes only UTF-8, and one bad message mustn't
+     * cost us the rest of the batch */
+    gchar* valid = g_utf8_validate(msg, len, NULL) ? NULL :
+        g_utf8_make_valid(msg, len);
+    if (valid) {
+        msg = valid;
+        len = strlen(valid);
+    }
+    pthread_mutex_lock(&inbox.lock);
+    tsBatchAdd(&inbox.b, WHO_FRIEND, msg, len);
+    int arm = !inbox.armed;
+    inbox.armed = 1;
+    pthread_mutex_unlock(&inbox.lock);
+    /* tick callbacks belong to the main thread, so ask it to add one */
+    if (arm) g_main_context_invoke(NULL, armInbox, NULL);
+    g_free(valid);
 }
 
 static void sendMessage(GtkWidget* w, gpointer data)
 {
-    char* tags[2] = {"self", NULL};
-    tsappend("me: ", tags, 0);
+    showInbox(0); /* keep the transcript in order */
 
     GtkTextIter mstart;
     GtkTextIter mend;
@@ -209,97 +461,147 @@ static void sendMessage(GtkWidget* w, gpointer data)
     char* message = gtk_text_buffer_get_text(mbuf, &mstart, &mend, 1);
 
     size_t len = strlen(message);
-    unsigned char ciphertext[1024];
-    unsigned char iv[EVP_MAX_IV_LENGTH] = {0}; // Initialization vector (should be random in production)
-
-    int ciphertext_len = encrypt((unsigned char*)message, len, final_key, iv, ciphertext);
-    
-    ssize_t nbytes;
-    if ((nbytes = send(sockfd, ciphertext, ciphertext_len, 0)) == -1)
+    tsBatch b = {0};
+    /* a server drops a client that sends more than this; leave the text
+     * where it is and say why instead */
+    if (len > SERVER_MAX_MESSAGE) {
+        char why[128];
+        int n = snprintf(why, sizeof(why), "not sent: %zu bytes is over "
+                "the %d byte limit", len, SERVER_MAX_MESSAGE);
+        tsBatchAdd(&b, WHO_STATUS, why, n);
+        tsShow(&b, 1);
+        tsBatchFree(&b);
+        free(message);
+        return;
+    }
+    logMessage(WHO_SELF, message, len);
+    /* show it now: below, it is encrypted where it is */
+    tsBatchAdd(&b, WHO_SELF, message, len);
+    tsShow(&b, 1);
+    tsBatchFree(&b);
+
+    /* long messages go out as several records (see record.h).  Each is
+     * sent as header, ciphertext (in message) and tag, without copying
+     * them together; see sendq.h. */
+    size_t nrec = len ? (len + REC_MAX_PLAIN - 1) / REC_MAX_PLAIN : 1;
+    unsigned char (*ht)[REC_HDR + AEAD_TAG_LEN] = malloc(nrec * sizeof(*ht));
+    if (!ht)
+        error("malloc failed");
+    size_t off = 0;
+    for (size_t i = 0; i < nrec; i++) {
+        size_t n = len - off;
+        if (n > REC_MAX_PLAIN) n = REC_MAX_PLAIN;
+        unsigned char* p = (unsigned char*)message + off;
+        if (aeadSealv(&chan, ht[i], p, ht[i] + REC_HDR, p, n,
+                    off + n < len ? REC_MORE : 0) != 0) {
+            fprintf(stderr, "encryption failed\n");
+            exit(EXIT_FAILURE);
+        }
+        if (sqRef(&sendQ, ht[i], REC_HDR) != 0 ||
+                sqRef(&sendQ, p, n) != 0 ||
+                sqRef(&sendQ, ht[i] + REC_HDR, AEAD_TAG_LEN) != 0)
+            error("malloc failed");
+        off += n;
+    }
+    /* the queue points into message and ht until it is idle */
+    if (sqDrain(&sendQ, sockfd, -1) != 0)
         error("send failed");
 
-    tsappend(message, NULL, 1);
+    free(ht);
     free(message);
     gtk_text_buffer_delete(mbuf, &mstart, &mend);
     gtk_widget_grab_focus(w);
 }
 
-static gboolean shownewmessage(gpointer msg)
+/* our long term key from fname, made (and saved) on first use */
+static int loadIdentity(char* fname, const dhGroup* G, dhKey* id)
 {
-    char* tags[2] = {"friend", NULL};
-    char* friendname = "mr. friend: ";
-    tsappend(friendname, tags, 0);
-    char* message = (char*)msg;
-    tsappend(message, NULL, 1);
-    free(message);
+    if (access(fname, F_OK) == 0)
+        return (readDH(fname, id) == 0 && mpz_sgn(id->SK)) ? 0 : -1;
+    initKey(id);
+    if (dhGenG(G, id->SK, id->PK) != 0 || writeDH(fname, id) != 0)
+        return -1;
+    fprintf(stderr, "made a new identity key in %s (and %s.pub)\n", fname, fname);
     return 0;
 }
 
-// Function to write data to a file
-void writeFile(const char *filename, const char *data) {
-    FILE *file;
-    // Open the file for writing (overwrite mode)
-    file = fopen(filename, "w");
-    if (file == NULL) {
-        perror("Error opening file for writing");
-        return;
-    }
-    // Write data to the file
-    fprintf(file, "%s\n", data);
-    // Close the file
-    fclose(file);
+/* the ticket saved by saveTicket, if there is one */
+static int loadTicket(const char* fname, hsTicket* t)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return -1;
+    int rv = (xread(fd, t->ticket, TICKET_LEN) == 0 &&
+            xread(fd, t->secret, HS_SECRET_LEN) == 0) ? 0 : -1;
+    close(fd);
+    t->valid = (rv == 0);
+    return rv;
 }
 
-// Function to read data from a file and return as a string
-char* readFile(const char *filename) {
-    FILE *file;
-    char *buffer = NULL; // Buffer to store read data
-    long length;
-    size_t result;
-    // Open the file for reading
-    file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("Error opening file for reading");
-        return NULL;
-    }
-    // Get file length
-    fseek(file, 0, SEEK_END);
-    length = ftell(file);
-    rewind(file);
-    // Allocate memory for the buffer
-    buffer = (char*) malloc(length + 1);
-    if (buffer == NULL) {
-        perror("Memory error");
-        fclose(file);
-        return NULL;
-    }
-    // Read data from the file
-    result = fread(buffer, 1, length, file);
-    if (result != length) {
-        perror("Reading error");
-        fclose(file);
-        free(buffer);
-        return NULL;
-    }
-    // Null-terminate the string
-    buffer[length] = '\0';
-    // Close the file
-    fclose(file);
-    return buffer;
+/* ticket || secret, readable by us alone (the secret is as good as the
+ * session key).  Written aside and renamed, so a crash can't tear it. */
+static int saveTicket(const char* fname, const unsigned char* ticket)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", fname) >= (int)sizeof(tmp))
+        return -1;
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0) return -1;
+    unsigned char buf[TICKET_LEN + HS_SECRET_LEN];
+    memcpy(buf, ticket, TICKET_LEN);
+    memcpy(buf + TICKET_LEN, tsecret, HS_SECRET_LEN);
+    int rv = xwrite(fd, buf, sizeof(buf));
+    memset(buf, 0, sizeof(buf));
+    if (close(fd) != 0) rv = -1;
+    if (rv == 0) rv = rename(tmp, fname);
+    if (rv != 0) unlink(tmp);
+    return rv;
+}
+
+/* for -S */
+static int printLogged(void* arg, const mlogEntry* e, const char* text)
+{
+    char when[32];
+    time_t t = e->time / 1000000000u;
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+    const char* who = e->sender < 2 ? whoName[e->sender] : "?: ";
+    size_t n = strlen(text);
+    printf("%s  %s%s%s", when, who, text, n && text[n-1] == '\n' ? "" : "\n");
+    return 0;
+}
+
+static void onSigint(int sig)
+{
+    serverStop();
 }
 
 int main(int argc, char *argv[])
 {
-    if (init("params") != 0) { //read p q and g from /params
-        fprintf(stderr, "could not read DH params from file 'params'\n");
+    /* prefer the binary copy made by `make params.bin` (see dh-params) */
+    const char* pfile = (access("params.bin",R_OK) == 0) ? "params.bin" : "params";
+    if (init(pfile) != 0) { //read p q and g from /params
+        fprintf(stderr, "could not read DH params from file '%s'\n", pfile);
         return 1;
     }
+    /* handshake latency: spread dh3Final over cores when we have them */
+    dhParallel = (sysconf(_SC_NPROCESSORS_ONLN) > 1);
 
     // define long options
     static struct option long_opts[] = {
         {"connect",  required_argument, 0, 'c'},
         {"listen",   no_argument,       0, 'l'},
+        {"serve",    no_argument,       0, 's'},
         {"port",     required_argument, 0, 'p'},
+        {"group",    required_argument, 0, 'g'},
+        {"aead",     required_argument, 0, 'a'},
+        {"identity", required_argument, 0, 'i'},
+        {"known",    required_argument, 0, 'k'},
+        {"trust",    required_argument, 0, 't'},
+        {"resume",   required_argument, 0, 'r'},
+        {"resume-dh",no_argument,       0, 'd'},
+        {"window",   required_argument, 0, 'w'},
+        {"log",      required_argument, 0, 'L'},
+        {"search",   required_argument, 0, 'S'},
         {"help",     no_argument,       0, 'h'},
         {0,0,0,0}
     };
@@ -310,7 +612,16 @@ int main(int argc, char *argv[])
     char hostname[HOST_NAME_MAX+1] = "localhost";
     hostname[HOST_NAME_MAX] = 0;
 
-    while ((c = getopt_long(argc, argv, "c:lp:h", long_opts, &opt_index)) != -1) {
+    const dhGroup* group = &dhGroupFF;
+    int aead = AEAD_AES_GCM;
+    int serve = 0;
+    char* idfile = NULL;
+    char* knownfile = NULL;
+    char* trustfile = NULL;
+    hsTicket ticket = {.valid = 0};
+    char* needle = NULL;
+
+    while ((c = getopt_long(argc, argv, "c:lsp:g:a:i:k:t:r:dw:L:S:h", long_opts, &opt_index)) != -1) {
         switch (c) {
             case 'c':
                 if (strnlen(optarg,HOST_NAME_MAX))
@@ -319,146 +630,103 @@ int main(int argc, char *argv[])
             case 'l':
                 isclient = 0;
                 break;
+            case 's':
+                serve = 1;
+                break;
             case 'p':
                 port = atoi(optarg);
                 break;
+            case 'g':
+                if (!(group = dhGroupByName(optarg))) {
+                    fprintf(stderr, "unknown group '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'a':
+                if ((aead = aeadByName(optarg)) < 0) {
+                    fprintf(stderr, "unknown cipher '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                idfile = optarg;
+                break;
+            case 'k':
+                knownfile = optarg;
+                break;
+            case 't':
+                trustfile = optarg;
+                break;
+            case 'r':
+                ticketfile = optarg;
+                break;
+            case 'd':
+                ticket.dh = 1;
+                break;
+            case 'w':
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "bad window size '%s'\n", optarg);
+                    return 1;
+                }
+                tsWindow = atoi(optarg);
+                break;
             case 'h':
                 printf(usage,argv[0]);
                 return 0;
+            case 'L':
+                logdir = optarg;
+                break;
+            case 'S':
+                needle = optarg;
+                break;
             case '?':
                 printf(usage,argv[0]);
                 return 1;
         }
     }
 
-    int is_listener = 0; // Flag to indicate if this instance is the listener
-
-    // Check if this instance is the listener
-    if (argc > 1 && strcmp(argv[1], "-l") == 0) {
-        is_listener = 1;
-    };
-
-    // Track the client based on the instance
-    if (is_listener) {
-        // Perform actions specific to the listener instance
-        printf("Listener instance accepted a new client.\n");
-        NEWZ(b);//private
-        NEWZ(B);
-        dhGen(b, B);
-
-        // Convert B to a string
-        char* B_str = mpz_get_str(NULL, 10, B);
-        writeFile("B.txt",B_str); //send B
-
-        //ephemeral keys
-        NEWZ(y);
-        NEWZ(Y);
-        dhGen(y,Y);
-        
-        // Convert Y to a string
-        char* Y_str = mpz_get_str(NULL, 10, Y);
-        writeFile("Y.txt",Y_str); //send Y
-        
-        //receive A from connector instance
-        char* A_recv= readFile("A.txt");
-        //printf("We received: %s\n",A_recv); //<- test to see if read and then clear worked
-        mpz_t A; 
-        mpz_init(A);
-        
-        if (mpz_set_str(A, A_recv, 10) != 0) {
-            printf("Error: Invalid string for conversion to mpz_t\n");
-            return 1;
-        }
-        
-        free(A_recv); //free memory
-
-        //receive X from connector instance
-        char* X_recv= readFile("X.txt");
-        //printf("We received: %s\n",X_recv); //<- test to see if read and then clear worked
-        mpz_t X; 
-        mpz_init(X);
-        
-        if (mpz_set_str(X, X_recv, 10) != 0) {
-            printf("Error: Invalid string for conversion to mpz_t\n");
-            return 1;
-        }
-        
-        free(X_recv); //free memory
-
-        //calculate 3dh value
-        unsigned char keyBuf[32]; // Adjusted to 32 bytes for AES-256
-        size_t bufLen = 32;
-
-        //gmp_printf("b = %Zd, B = %Zd, y = %Zd, Y = %Zd, A = %Zd, X = %Zd\n", b,B,y,Y,A,X); //<-- testing in case any variable wasnt read correctly
-
-        dh3Final(b, B, y, Y, A, X, keyBuf, bufLen); //<--- this call should work, but can run into segmentation faults. 
-
-        // Assign final_key
-        final_key = malloc(bufLen);
-        memcpy(final_key, keyBuf, bufLen);
-
-        //printf("Our k1 value is %s\n",keyBuf);
-    } else { // Perform actions specific to the connector instance
-        printf("Connector instance accepted a new client.\n");
-
-        NEWZ(a); //private
-        NEWZ(A);
-        dhGen(a, A);
-
-        //now we'll set up ephemeral keys
-        NEWZ(x);
-        NEWZ(X);
-        dhGen(x,X);
-        
-        //receive B from listener instance
-        char* B_recv= readFile("B.txt");
-        //printf("We received for B: %s\n",B_recv); //<- test to see if read and then clear worked
-        mpz_t B; 
-        mpz_init(B);
-        
-        if (mpz_set_str(B, B_recv, 10) != 0) {
-            printf("Error: Invalid string for conversion to mpz_t\n");
-            return 1;
-        }
-        
-        free(B_recv); //free memory
-
-        // Convert A to a string
-        char* A_str = mpz_get_str(NULL, 10, A);
-        writeFile("A.txt",A_str); //send A
-
-        // Convert X to a string
-        char* X_str = mpz_get_str(NULL, 10, X);
-        writeFile("X.txt",X_str); //send X
-
-        //receive Y from connector instance
-        char* Y_recv= readFile("Y.txt");
-        //printf("We received for Y: %s\n",Y_recv); //<- test to see if read and then clear worked
-        mpz_t Y; 
-        mpz_init(Y);
-        
-        if (mpz_set_str(Y, Y_recv, 10) != 0) {
-            printf("Error: Invalid string for conversion to mpz_t\n");
+    dhKey id;
+    keyStore known;
+    char fp[65] = {0};
+    if (idfile && loadIdentity(idfile, group, &id) != 0) {
+        fprintf(stderr, "could not load or make identity key '%s'\n", idfile);
+        return 1;
+    }
+    if ((knownfile || trustfile) && ksOpen(&known, knownfile) != 0) {
+        fprintf(stderr, "could not open key store '%s'\n", knownfile);
+        return 1;
+    }
+    unsigned char vault[MLOG_KEY_LEN];
+    if ((logdir || needle) && (!logdir || !idfile ||
+                mlogVaultKey(vault, id.SK) != 0)) {
+        fprintf(stderr, "-L and -S need a log directory and -i\n");
+        return 1;
+    }
+    if (needle) {
+        int rv = mlogSearch(logdir, vault, 0, UINT64_MAX, MLOG_ANY, needle,
+                printLogged, NULL);
+        if (rv < 0) fprintf(stderr, "could not search the logs in %s\n", logdir);
+        return rv < 0 ? 1 : 0;
+    }
+    if (trustfile) {
+        dhKey peer;
+        if (!knownfile || readDH(trustfile, &peer) != 0 ||
+                ksAdd(&known, peer.name, peer.PK) != 0 || ksSync(&known) != 0) {
+            fprintf(stderr, "could not add '%s' to the key store\n", trustfile);
             return 1;
         }
-        
-        free(Y_recv); //free memory
-
-        //calculate k1
-        unsigned char keyBuf[32]; // Adjusted to 32 bytes for AES-256
-        size_t bufLen = 32;
-
-        //gmp_printf("a = %Zd, A = %Zd, x = %Zd, X = %Zd, B = %Zd, Y = %Zd\n", a,A,x,X,B,Y); <-- testing in case any variable wasnt read correctly
-
-        dh3Final(a, A, x, X, B, Y, keyBuf, bufLen); //<--- this call should work, but can run into segmentation faults. 
-
-        // Assign final_key
-        final_key = malloc(bufLen);
-        memcpy(final_key, keyBuf, bufLen);
+        printf("trusting %s (%s)\n", peer.name, hashPK(&peer, fp));
+        shredKey(&peer);
+        ksClose(&known);
+        return 0;
+    }
 
-        //printf("Our k2 value is %s\n",keyBuf);
-        //for the sake of time, i will use keybuff in connector instance as the overall final key after 3DH.
-    }    
+    if (serve) {
+        signal(SIGINT,onSigint);
+        signal(SIGTERM,onSigint);
+        return serverRun(port, group, aead, idfile ? &id : NULL,
+                knownfile ? &known : NULL) ? 1 : 0;
+    }
 
     /* NOTE: might want to start this after gtk is initialized so you can
      * show the messages in the main window instead of stderr/stdout.  If
@@ -470,6 +738,48 @@ int main(int argc, char *argv[])
         initServerNet(port);
     }
 
+    /* key exchange, in band: one hello each way (see handshake.h).  Only
+     * the -s server issues tickets, so only a client offers one. */
+    unsigned char km[AEAD_KM_LEN + HS_SECRET_LEN + MLOG_KEY_LEN];
+    int side;
+    xsInit(&net, sockfd, HS_TIMEOUT);
+    dhKey peer;
+    initKey(&peer);
+    if (isclient && ticketfile) loadTicket(ticketfile, &ticket);
+    if (hsRun(&net, group, idfile ? &id : NULL, peer.PK,
+                isclient ? &ticket : NULL, km, sizeof(km), &side) != 0 ||
+            aeadInit(&chan, aead, km, side) != 0) {
+        fprintf(stderr, "key exchange failed\n");
+        return 1;
+    }
+    if (ticket.resumed)
+        fprintf(stderr, "resumed the session from %s\n", ticketfile);
+    if (knownfile) {
+        const ksEntry* e = ksFindPK(&known, peer.PK);
+        if (!e) {
+            fprintf(stderr, "peer's key %s is not in %s\n",
+                    hashPK(&peer, fp), knownfile);
+            return 1;
+        }
+        fprintf(stderr, "talking to %s\n", e->name);
+    }
+    shredKey(&peer);
+    memcpy(tsecret, km + AEAD_KM_LEN, HS_SECRET_LEN);
+    memset(&ticket, 0, sizeof(ticket));
+    net.timeout = -1; /* a chat can be quiet for as long as it likes */
+    sqInit(&sendQ, sockfd);
+    if (histOpen(&hist, NULL) != 0) {
+        fprintf(stderr, "could not make the scrollback file\n");
+        return 1;
+    }
+    if (logdir && mlogCreate(&mlog, logdir,
+                km + AEAD_KM_LEN + HS_SECRET_LEN, vault) != 0) {
+        fprintf(stderr, "could not start a log in %s\n", logdir);
+        return 1;
+    }
+    memset(km, 0, sizeof(km));
+    memset(vault, 0, sizeof(vault));
+
     /* setup GTK... */
     GtkBuilder* builder;
     GObject* window;
@@ -486,12 +796,14 @@ int main(int argc, char *argv[])
     }
     mark  = gtk_text_mark_new(NULL,TRUE);
     window = gtk_builder_get_object(builder,"window");
-    g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
+    g_signal_connect(window, "destroy", G_CALLBACK(onDestroy), NULL);
     transcript = gtk_builder_get_object(builder, "transcript");
     tview = GTK_TEXT_VIEW(transcript);
     message = gtk_builder_get_object(builder, "message");
     tbuf = gtk_text_view_get_buffer(tview);
     mbuf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(message));
+    g_signal_connect(gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(tview)),
+            "value-changed", G_CALLBACK(onScroll), NULL);
     button = gtk_builder_get_object(builder, "send");
     g_signal_connect_swapped(button, "clicked", G_CALLBACK(sendMessage), GTK_WIDGET(message));
     gtk_widget_grab_focus(GTK_WIDGET(message));
@@ -507,13 +819,19 @@ int main(int argc, char *argv[])
     gtk_text_buffer_create_tag(tbuf,"self","foreground","#268bd2","font","bold",NULL);
 
     /* start receiver thread: */
-    if (pthread_create(&trecv,0,recvMsg,0)) {
+    int receiving = (pthread_create(&trecv,0,recvMsg,0) == 0);
+    if (!receiving) {
         fprintf(stderr, "Failed to create update thread.\n");
     }
 
     gtk_main();
 
     shutdownNetwork();
+    /* recvMsg sees the end of the stream; once it's done, nothing more
+     * can be logged */
+    if (receiving) pthread_join(trecv, NULL);
+    if (logdir && mlogClose(&mlog) != 0)
+        fprintf(stderr, "some of the log may not have been saved\n");
     return 0;
 }
 
@@ -521,28 +839,72 @@ int main(int argc, char *argv[])
  * main loop for processing: */
 void* recvMsg(void*)
 {
-    size_t maxlen = 1024;
-    unsigned char ciphertext[maxlen];
+    /* records can arrive split across reads, or several in one read.  in
+     * holds the part of the stream we haven't used yet, which is never
+     * more than one record. */
+    static unsigned char in[REC_HDR + REC_MAX];
+    size_t inlen = 0;
+    char* msg = NULL; /* the message being put back together (reused) */
+    size_t msglen = 0, msgcap = 0;
     ssize_t nbytes;
-    unsigned char iv[EVP_MAX_IV_LENGTH] = {0}; // Initialization vector (should match encryption IV)
-    
+
     while (1) {
-        if ((nbytes = recv(sockfd, ciphertext, maxlen, 0)) == -1)
+        /* NOTE: starts with whatever the handshake read past the hello */
+        if ((nbytes = xsReadSome(&net, in + inlen, sizeof(in) - inlen)) == -1)
             error("recv failed");
         if (nbytes == 0) {
+            free(msg);
             return 0;
         }
-
-        unsigned char plaintext[maxlen];
-        int plaintext_len = decrypt(ciphertext, nbytes, final_key, iv, plaintext);
-        plaintext[plaintext_len] = 0;
-
-        char* msg = malloc(plaintext_len + 1);
-        memcpy(msg, plaintext, plaintext_len + 1);
-
-        g_main_context_invoke(NULL, shownewmessage, (gpointer)msg);
+        inlen += nbytes;
+
+        size_t off = 0;
+        const unsigned char* body;
+        size_t blen;
+        unsigned flags;
+        int r;
+        while ((r = recParse(in + off, inlen - off, &body, &blen, &flags)) > 0) {
+            if (flags & REC_CTRL) {
+                /* for us, not the transcript; the ticket is all there is */
+                unsigned char ctl[REC_MAX];
+                int n = aeadOpen(&chan, ctl, body, blen, flags);
+                if (n < 0) {
+                    r = -1;
+                    break;
+                }
+                if (n == 1 + TICKET_LEN && ctl[0] == REC_CTRL_TICKET &&
+                        ticketfile && saveTicket(ticketfile, ctl + 1) != 0)
+                    fprintf(stderr, "could not save ticket to %s\n", ticketfile);
+                memset(ctl, 0, sizeof(ctl));
+                off += r;
+                continue;
+            }
+            /* plaintext is no longer than ciphertext */
+            if (msglen + blen > msgcap) {
+                msgcap = max(2*msgcap, msglen + blen);
+                if (!(msg = realloc(msg, msgcap)))
+                    error("realloc failed");
+            }
+            int n = aeadOpen(&chan, (unsigned char*)msg + msglen, body, blen, flags);
+            if (n < 0) {
+                r = -1;
+                break;
+            }
+            msglen += n;
+            off += r;
+            if (!(flags & REC_MORE)) {
+                postMessage(msg, msglen);
+                msglen = 0;
+            }
+        }
+        if (r < 0) {
+            fprintf(stderr, "bad or forged record from peer\n");
+            free(msg);
+            return 0;
+        }
+        memmove(in, in + off, inlen - off);
+        inlen -= off;
     }
 
     return 0;
 }
-
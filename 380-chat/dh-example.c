@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <gmp.h>
 #include <string.h>
+#include <unistd.h>
 #include "util.h"
 
 void testDH()
@@ -92,7 +93,8 @@ int main()
 {
 	/* NOTE: if for some reason you wanted to make new DH parameters,
 	 * you would call initFromScratch(...) here instead */
-	if (init("params") == 0) {
+	const char* pfile = (access("params.bin",R_OK) == 0) ? "params.bin" : "params";
+	if (init(pfile) == 0) {
 		// gmp_printf("Successfully read DH params:\nq = %Zd\np = %Zd\ng = %Zd\n",q,p,g);
 		printf("Successfully read DH params.\n");
 	}
@@ -0,0 +1,88 @@
+/* Generate fresh Diffie Hellman parameters and save them for init(). */
+#include "dh.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+static const char* usage =
+"Usage: %s [OPTIONS]...\n"
+"Generate Diffie Hellman parameters (q,p,g) for the chat program.\n\n"
+"   -q, --qbits   BITS  Size of the subgroup order q (defaults to 512).\n"
+"   -p, --pbits   BITS  Size of the modulus p (defaults to 4096).\n"
+"   -j, --threads N     Search with N threads (defaults to one per CPU).\n"
+"   -o, --output  FILE  Write parameters to FILE (defaults to params).\n"
+"   -b, --binary        Write the binary format (see writeParamsBin).\n"
+"   -i, --input   FILE  Don't generate; convert parameters from FILE.\n"
+"   -h, --help          show this message and exit.\n";
+
+int main(int argc, char *argv[])
+{
+	static struct option long_opts[] = {
+		{"qbits",   required_argument, 0, 'q'},
+		{"pbits",   required_argument, 0, 'p'},
+		{"threads", required_argument, 0, 'j'},
+		{"output",  required_argument, 0, 'o'},
+		{"binary",  no_argument,       0, 'b'},
+		{"input",   required_argument, 0, 'i'},
+		{"help",    no_argument,       0, 'h'},
+		{0,0,0,0}
+	};
+	int c;
+	int opt_index = 0;
+	size_t qbits = 512, pbits = 4096, nThreads = 0;
+	const char* fname = "params";
+	const char* input = NULL;
+	int binary = 0;
+	while ((c = getopt_long(argc, argv, "q:p:j:o:bi:h", long_opts, &opt_index)) != -1) {
+		switch (c) {
+			case 'q':
+				qbits = strtoul(optarg,NULL,10);
+				break;
+			case 'p':
+				pbits = strtoul(optarg,NULL,10);
+				break;
+			case 'j':
+				nThreads = strtoul(optarg,NULL,10);
+				break;
+			case 'o':
+				fname = optarg;
+				break;
+			case 'b':
+				binary = 1;
+				break;
+			case 'i':
+				input = optarg;
+				break;
+			case 'h':
+				printf(usage,argv[0]);
+				return 0;
+			default:
+				printf(usage,argv[0]);
+				return 1;
+		}
+	}
+	if (qbits < 160 || pbits < qbits + 64) {
+		fprintf(stderr, "need qbits >= 160 and pbits >= qbits + 64\n");
+		return 1;
+	}
+	if (input) {
+		if (init(input) != 0) {
+			fprintf(stderr, "could not read parameters from %s\n", input);
+			return 1;
+		}
+	} else if (initFromScratchMT(qbits,pbits,nThreads) != 0) {
+		fprintf(stderr, "parameter generation failed\n");
+		return 1;
+	}
+	if ((binary ? writeParamsBin(fname) : writeParams(fname)) != 0) {
+		perror(fname);
+		return 1;
+	}
+	/* make sure what we wrote reads back and validates: */
+	if (init(fname) != 0) {
+		fprintf(stderr, "generated parameters did not validate!\n");
+		return 1;
+	}
+	fprintf(stderr, "wrote %s\n", fname);
+	return 0;
+}
@@ -2,7 +2,6 @@
 #include <openssl/evp.h>
 #include <openssl/err.h>
 #include <openssl/sha.h>
-#include <openssl/hmac.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <gmp.h>
@@ -10,7 +9,14 @@
 #include <string.h>
 #include <endian.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include "util.h"
+#include "rng.h"
+#include "paramfile.h"
+#include "mont.h"
+#include "hkdf.h"
 
 mpz_t q; /* "small" prime; should be 256 bits or more */
 mpz_t p; /* "large" prime; should be 2048 bits or more, with q|(p-1) */
@@ -24,26 +30,197 @@ size_t pLen; /* length of p in bytes */
 /* NOTE: this constant is arbitrary and does not need to be secret. */
 const char* hmacsalt = "z3Dow}^Z]8Uu5>pr#;{QUs!133";
 
-int init(const char* fname)
+int dhFixedBase = 1; /* use the comb table for g in dhGen */
+int dhMultiExp = 1;  /* share the table for Y between Y^a and Y^x in dh3Final */
+int dhParallel = 0;  /* run the exponentiations of dh3Final on separate threads */
+int dhMont = 1;      /* use mont.c rather than mpz_powm / mpz_mul+mpz_mod */
+
+/* montSetup(p) succeeded and the caller hasn't turned it off */
+static int useMont(void)
 {
-	mpz_init(q);
-	mpz_init(p);
-	mpz_init(g);
-	FILE* f = fopen(fname,"rb");
-	if (!f) {
-		fprintf(stderr, "Could not open file 'params'\n");
-		return -1;
+	return dhMont && montReady();
+}
+
+/* r = b^e mod p */
+static void powm(mpz_ptr r, mpz_srcptr b, mpz_srcptr e)
+{
+	if (useMont()) montPowm(r,b,e);
+	else mpz_powm(r,b,e,p);
+}
+
+/* Fixed-base comb (Lim-Lee) for g.  An exponent of at most COMB_H*a bits is
+ * cut into COMB_H rows of a bits, and each row into COMB_V blocks of b bits:
+ *
+ *        +-----------+-----------+
+ * row 0  | blk 1 (b) | blk 0 (b) |   e = sum_r E_r * 2^(r*a)
+ *        +-----------+-----------+
+ *  ...   |    ...    |    ...    |
+ *        +-----------+-----------+
+ * row h-1|           |           |
+ *        +-----------+-----------+
+ *
+ * gComb[k][s] = prod_{r : bit r of s set} g^(2^(r*a + k*b)), so each column
+ * of bits costs one multiplication per block, and we only need b squarings
+ * in total (instead of ~qBitlen for mpz_powm). */
+#define COMB_H 8
+#define COMB_V 2
+static mpz_t gComb[COMB_V][1 << COMB_H];
+static size_t combA; /* bits per row */
+static size_t combB; /* bits per block (combA / COMB_V) */
+static int combReady = 0;
+static int combMapped = 0; /* entries are read-only views of a params file */
+/* gComb in Montgomery form, entry (k,s) at gCombM + ((k<<COMB_H)+s)*words.
+ * Built on first use, and again if mont.c changes kernel (see montEpoch). */
+static uint64_t* gCombM;
+static unsigned gCombMEpoch;
+static pthread_mutex_t gCombMLock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t combBlock(void)
+{
+	return (qBitlen + COMB_H*COMB_V - 1) / (COMB_H*COMB_V);
+}
+
+/* (re)build gComb for the current g,p.  Called by init/initFromScratch. */
+static void initComb(void)
+{
+	if (!combReady || combMapped) {
+		/* NOTE: read-only views must not be cleared, just forgotten */
+		for (size_t k = 0; k < COMB_V; k++)
+			for (size_t s = 0; s < (1 << COMB_H); s++)
+				mpz_init(gComb[k][s]);
+		combMapped = 0;
 	}
-	/* p is a 4096 bit prime, and g generates a subgroup of order q,
-	 * which is a 512 bit prime. */
-	int nvalues = gmp_fscanf(f,"q = %Zd\np = %Zd\ng = %Zd",q,p,g);
-	fclose(f);
-	if (nvalues != 3) {
-		printf("couldn't parse parameter file\n");
-		return -1;
+	combB = combBlock();
+	combA = combB * COMB_V;
+	/* single-bit entries first: gComb[k][1<<r] = g^(2^(r*a + k*b)).  Since
+	 * r*a + k*b == (r*COMB_V + k)*b, these are just g^(2^(j*b)) for
+	 * j = 0,1,...,COMB_H*COMB_V-1, which we get by repeated squaring. */
+	NEWZ(t);
+	mpz_set(t,g);
+	for (size_t j = 0; j < COMB_H*COMB_V; j++) {
+		if (j) {
+			for (size_t i = 0; i < combB; i++) {
+				mpz_mul(t,t,t);
+				mpz_mod(t,t,p);
+			}
+		}
+		mpz_set(gComb[j % COMB_V][1 << (j / COMB_V)],t);
+	}
+	mpz_clear(t);
+	/* fill in the rest from the lowest set bit + remainder */
+	for (size_t k = 0; k < COMB_V; k++) {
+		mpz_set_ui(gComb[k][0],1);
+		for (size_t s = 3; s < (1 << COMB_H); s++) {
+			size_t lo = s & -s;
+			if (lo == s) continue;
+			mpz_mul(gComb[k][s],gComb[k][lo],gComb[k][s^lo]);
+			mpz_mod(gComb[k][s],gComb[k][s],p);
+		}
+	}
+	combReady = 1;
+}
+
+/* use a table loaded from a binary params file instead of building one */
+static int mapComb(const paramsTable* t)
+{
+	if (t->h != COMB_H || t->v != COMB_V || t->b != combBlock()) return -1;
+	for (size_t k = 0; k < COMB_V; k++) {
+		for (size_t s = 0; s < (1 << COMB_H); s++) {
+			if (combReady && !combMapped) mpz_clear(gComb[k][s]);
+			mpz_roinit_n(gComb[k][s],
+					t->limbs + ((k << COMB_H) + s)*t->entryLimbs, t->entryLimbs);
+		}
+	}
+	combB = t->b;
+	combA = combB * COMB_V;
+	combReady = combMapped = 1;
+	return 0;
+}
+
+/* does t hold exactly what initComb computed? */
+static int combMatches(const paramsTable* t)
+{
+	if (t->h != COMB_H || t->v != COMB_V || t->b != combB) return 0;
+	for (size_t k = 0; k < COMB_V; k++) {
+		for (size_t s = 0; s < (1 << COMB_H); s++) {
+			mpz_t ro;
+			mpz_roinit_n(ro,t->limbs + ((k << COMB_H) + s)*t->entryLimbs,
+					t->entryLimbs);
+			if (mpz_cmp(ro,gComb[k][s]) != 0) return 0;
+		}
 	}
+	return 1;
+}
 
-	/* now a sanity check on what we read: */
+/* the Montgomery form table, or NULL if we can't have one */
+static const uint64_t* combMont(void)
+{
+	pthread_mutex_lock(&gCombMLock);
+	if (!gCombM || gCombMEpoch != montEpoch()) {
+		size_t w = montWords();
+		free(gCombM);
+		gCombM = malloc((COMB_V << COMB_H)*w*sizeof(uint64_t));
+		if (gCombM) {
+			for (size_t k = 0; k < COMB_V; k++)
+				for (size_t s = 0; s < (1 << COMB_H); s++)
+					montFromZ(gCombM + ((k << COMB_H) + s)*w,gComb[k][s]);
+			gCombMEpoch = montEpoch();
+		}
+	}
+	pthread_mutex_unlock(&gCombMLock);
+	return gCombM;
+}
+
+/* s for column i of block k: bit row of s is bit row*a + k*b + i of e */
+static size_t combIndex(mpz_t e, size_t k, size_t i)
+{
+	size_t s = 0;
+	for (size_t row = 0; row < COMB_H; row++)
+		s |= (size_t)mpz_tstbit(e,row*combA + k*combB + i) << row;
+	return s;
+}
+
+/* r = g^e mod p using the comb table.  e must be nonnegative and fit in
+ * COMB_H*combA bits (true for anything reduced mod q). */
+static void combPowm(mpz_t r, mpz_t e)
+{
+	/* NOTE: below, we multiply even when s == 0 (the entry is 1), so the
+	 * number of multiplications doesn't depend on e.  This is NOT constant
+	 * time though: the table entry each one reads is picked by bits of e
+	 * (a secret dependent memory access), and the mpz path's arithmetic
+	 * is variable time as well. */
+	const uint64_t* T = useMont() ? combMont() : NULL;
+	if (T) {
+		size_t w = montWords();
+		uint64_t t[MONT_MAX_WORDS];
+		montOne(t);
+		for (size_t i = combB; i-- > 0;) {
+			montSqr(t,t);
+			for (size_t k = COMB_V; k-- > 0;)
+				montMul(t,t,T + ((k << COMB_H) + combIndex(e,k,i))*w);
+		}
+		montToZ(r,t);
+		memset(t,0,w*sizeof(uint64_t));
+		return;
+	}
+	NEWZ(t);
+	mpz_set_ui(t,1);
+	for (size_t i = combB; i-- > 0;) {
+		mpz_mul(t,t,t);
+		mpz_mod(t,t,p);
+		for (size_t k = COMB_V; k-- > 0;) {
+			mpz_mul(t,t,gComb[k][combIndex(e,k,i)]);
+			mpz_mod(t,t,p);
+		}
+	}
+	mpz_swap(r,t);
+	mpz_clear(t);
+}
+
+/* full sanity check of q,p,g.  Expensive (two primality tests at 4096 and
+ * 512 bits), so init skips it for parameters found in the trusted cache. */
+static int checkParams(void)
+{
 	if (!ISPRIME(q)) {
 		printf("q not prime!\n");
 		return -1;
@@ -56,80 +233,400 @@ int init(const char* fname)
 	/* temporaries to hold results */
 	NEWZ(t);
 	NEWZ(r);
+	int rv = -1;
 	mpz_sub_ui(r,p,1); /* r = p-1 */
 	if (!mpz_divisible_p(r,q)) {
 		printf("q does not divide (p-1)!\n");
-		return -1;
+		goto end;
 	}
 	mpz_divexact(t,r,q); /* t = (p-1)/q */
 	if (mpz_divisible_p(t,q)) {
 		printf("q^2 divides (p-1)!\n");
-		return -1;
+		goto end;
 	}
 	/* make sure g is a generator (which almost surely will be the case) */
-	mpz_powm(r,g,t,p); /* if r != 1, g is a generator since q is prime */
+	powm(r,g,t); /* if r != 1, g is a generator since q is prime */
 	if (mpz_cmp_ui(r,1) == 0) {
 		printf("g does not generate subroup of order q!\n");
-		return -1;
+		goto end;
 	}
+	rv = 0;
+end:
+	mpz_clears(t,r,NULL);
+	return rv;
+}
+
+int init(const char* fname)
+{
+	mpz_init(q);
+	mpz_init(p);
+	mpz_init(g);
+	unsigned char digest[PARAMS_DIGEST_LEN];
+	paramsTable tab = {.limbs = NULL};
+	if (paramsIsBin(fname)) {
+		if (paramsReadBin(fname,q,p,g,&tab,digest) != 0) {
+			printf("couldn't read binary parameter file\n");
+			return -1;
+		}
+	} else {
+		FILE* f = fopen(fname,"rb");
+		if (!f) {
+			fprintf(stderr, "Could not open file '%s'\n", fname);
+			return -1;
+		}
+		/* p is a 4096 bit prime, and g generates a subgroup of order q,
+		 * which is a 512 bit prime. */
+		int nvalues = gmp_fscanf(f,"q = %Zd\np = %Zd\ng = %Zd",q,p,g);
+		fclose(f);
+		if (nvalues != 3) {
+			printf("couldn't parse parameter file\n");
+			return -1;
+		}
+		paramsDigest(digest,q,p,g);
+	}
+
+	montSetup(p); /* if this fails (p even, say), we just use mpz_powm */
+	/* now a sanity check on what we read, unless we've done it before: */
+	int trusted = paramsTrusted(digest);
+	if (!trusted && checkParams() != 0) return -1;
 	qBitlen = mpz_sizeinbase(q,2);
 	pBitlen = mpz_sizeinbase(p,2);
 	qLen = qBitlen / 8 + (qBitlen % 8 != 0);
 	pLen = pBitlen / 8 + (pBitlen % 8 != 0);
+	/* a stored table is only used once we've checked it against our own: */
+	if (!(trusted && tab.limbs && mapComb(&tab) == 0)) {
+		initComb();
+		if (tab.limbs && !combMatches(&tab)) {
+			fprintf(stderr, "ignoring bad table in %s\n", fname);
+			return 0;
+		}
+	}
+	if (!trusted) paramsTrust(digest); /* not fatal if this fails */
 	return 0;
 }
 
+/* Parameter generation.  Candidates come in arithmetic progressions
+ * c_k = c0 + step*k from a random c0, and a window of k's is sieved against
+ * small primes before any Miller-Rabin test: s | c_k exactly when
+ * k == -c0 * step^-1 (mod s).  Several threads search from independent
+ * starting points, and the first to find a prime stops the others. */
+#define SIEVE_BOUND  (1 << 15) /* sieve by the odd primes below this */
+#define SIEVE_WINDOW 4096      /* candidates per sieve window */
+static unsigned* smallPrimes;
+static size_t nSmallPrimes;
+
+static void initSmallPrimes(void)
+{
+	if (smallPrimes) return;
+	unsigned char* composite = calloc(SIEVE_BOUND,1);
+	smallPrimes = malloc(SIEVE_BOUND/2*sizeof(unsigned));
+	for (unsigned i = 3; i < SIEVE_BOUND; i += 2) {
+		if (composite[i]) continue;
+		smallPrimes[nSmallPrimes++] = i;
+		for (unsigned j = i*i; j < SIEVE_BOUND; j += 2*i) composite[j] = 1;
+	}
+	free(composite);
+}
+
+/* inverse of a mod m (gcd(a,m) == 1) */
+static unsigned long invmod(unsigned long a, unsigned long m)
+{
+	long t = 0, newt = 1;
+	long r = m, newr = a % m;
+	while (newr) {
+		long quot = r / newr, tmp;
+		tmp = t - quot*newt; t = newt; newt = tmp;
+		tmp = r - quot*newr; r = newr; newr = tmp;
+	}
+	return (t < 0) ? t + m : t;
+}
+
+typedef struct {
+	size_t qbits;          /* bits of q */
+	size_t rbits;          /* bits of r = (p-1)/q, when looking for p */
+	mpz_srcptr Q;          /* NULL if we're looking for q itself */
+	pthread_mutex_t lock;
+	volatile int found;    /* polled by every thread; set under lock */
+	mpz_t result;          /* q, or r such that q*r+1 is prime */
+} primeSearch;
+
+/* random integer with exactly bits bits */
+static int randBits(mpz_t x, size_t bits)
+{
+	size_t len = bits/8 + 1;
+	unsigned char buf[len];
+	if (randBytes(buf,len) != 0) return -1;
+	BYTES2Z(x,buf,len);
+	memset(buf,0,len);
+	mpz_fdiv_r_2exp(x,x,bits);
+	mpz_setbit(x,bits-1);
+	return 0;
+}
+
+static void* searchThread(void* arg)
+{
+	primeSearch* ps = arg;
+	unsigned char mark[SIEVE_WINDOW];
+	NEWZ(c0);   /* start of the progression */
+	NEWZ(step);
+	NEWZ(base); /* q: c0 itself.  p: r0, with c0 = Q*r0 + 1 */
+	NEWZ(c);
+	NEWZ(t);
+	if (ps->Q) mpz_mul_2exp(step,ps->Q,1); /* p = Q*(r0 + 2k) + 1 */
+	else mpz_set_ui(step,2);               /* q = q0 + 2k */
+	while (!ps->found) {
+		if (randBits(base,ps->Q ? ps->rbits : ps->qbits) != 0) break;
+		if (ps->Q) {
+			mpz_clrbit(base,0);            /* r even */
+			mpz_mul(c0,ps->Q,base);
+			mpz_add_ui(c0,c0,1);
+		} else {
+			mpz_setbit(base,0);            /* q odd */
+			mpz_set(c0,base);
+		}
+		memset(mark,0,SIEVE_WINDOW);
+		for (size_t i = 0; i < nSmallPrimes; i++) {
+			unsigned long sp = smallPrimes[i];
+			unsigned long cm = mpz_fdiv_ui(c0,sp);
+			unsigned long sm = mpz_fdiv_ui(step,sp);
+			if (!sm) continue;
+			unsigned long k = (sp - cm) % sp * invmod(sm,sp) % sp;
+			for (; k < SIEVE_WINDOW; k += sp) mark[k] = 1;
+		}
+		for (size_t k = 0; k < SIEVE_WINDOW && !ps->found; k++) {
+			if (mark[k]) continue;
+			mpz_set(c,c0);
+			mpz_addmul_ui(c,step,k);
+			if (ps->Q) {
+				/* make sure q^2 doesn't divide p-1, i.e. q doesn't divide r */
+				mpz_set(t,base);
+				mpz_add_ui(t,t,2*k);
+				if (mpz_divisible_p(t,ps->Q)) continue;
+			}
+			if (!ISPRIME(c)) continue;
+			pthread_mutex_lock(&ps->lock);
+			if (!ps->found) {
+				ps->found = 1;
+				if (ps->Q) {
+					mpz_set(ps->result,base);
+					mpz_add_ui(ps->result,ps->result,2*k);
+				} else {
+					mpz_set(ps->result,c);
+				}
+			}
+			pthread_mutex_unlock(&ps->lock);
+		}
+	}
+	mpz_clears(c0,step,base,c,t,NULL);
+	return 0;
+}
+
+/* run nThreads copies of searchThread on ps (at least one, on this thread) */
+static int searchPrime(primeSearch* ps, size_t nThreads)
+{
+	pthread_t tids[nThreads];
+	size_t nStarted = 0;
+	ps->found = 0;
+	for (; nStarted + 1 < nThreads; nStarted++) {
+		if (pthread_create(&tids[nStarted],0,searchThread,ps)) break;
+	}
+	searchThread(ps);
+	for (size_t i = 0; i < nStarted; i++) pthread_join(tids[i],0);
+	return ps->found ? 0 : -1;
+}
+
 int initFromScratch(size_t qbits, size_t pbits)
+{
+	return initFromScratchMT(qbits,pbits,0);
+}
+
+int initFromScratchMT(size_t qbits, size_t pbits, size_t nThreads)
 {
 	/* select random prime q of the right number of bits, then multiply
-	 * by a random even integer, add 1, check if that is prime.  If so,
+	 * by a random even integer r, add 1, check if that is prime.  If so,
 	 * we've found q and p respectively. */
-	/* lengths in BYTES: */
-	qBitlen = qbits;
-	pBitlen = pbits;
-	qLen = qBitlen / 8 + (qBitlen % 8 != 0);
-	pLen = pBitlen / 8 + (pBitlen % 8 != 0);
-	size_t rLen = pLen - qLen;
-	unsigned char* qCand = malloc(qLen);
-	unsigned char* rCand = malloc(rLen);
+	if (!nThreads) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nThreads = (n > 0) ? n : 1;
+	}
+	initSmallPrimes();
 	mpz_init(q);
 	mpz_init(p);
 	mpz_init(g);
 	NEWZ(r); /* holds (p-1)/q */
 	NEWZ(t); /* scratch space */
-	FILE* f = fopen("/dev/urandom","rb");
-	do {
-		do {
-			fread(qCand,1,qLen,f);
-			BYTES2Z(q,qCand,qLen);
-		} while (!ISPRIME(q));
-		/* now try to get p */
-		fread(rCand,1,rLen,f);
-		rCand[0] &= 0xfe; /* set least significant bit to 0 (make r even) */
-		BYTES2Z(r,rCand,rLen);
-		mpz_mul(p,q,r);     /* p = q*r */
-		mpz_add_ui(p,p,1);  /* p = p+1 */
-		/* should make sure q^2 doesn't divide p-1.
-		 * suffices to check if q|r */
-		mpz_mod(t,r,q);     /* t = r%q */
-		/* now check if t is 0: */
-		if (mpz_cmp_ui(t,0) == 0) continue; /* really unlucky! */
-	} while (!ISPRIME(p));
+	primeSearch ps = {.qbits = qbits, .rbits = pbits - qbits,
+		.lock = PTHREAD_MUTEX_INITIALIZER};
+	mpz_init(ps.result);
+	if (searchPrime(&ps,nThreads) != 0) return -1;
+	mpz_set(q,ps.result);
+	/* now try to get p */
+	ps.Q = q;
+	if (searchPrime(&ps,nThreads) != 0) return -1;
+	mpz_set(r,ps.result);
+	mpz_clear(ps.result);
+	mpz_mul(p,q,r);     /* p = q*r */
+	mpz_add_ui(p,p,1);  /* p = p+1 */
 	gmp_printf("q = %Zd\np = %Zd\n",q,p);
 	/* now find a generator of the subgroup of order q.
 	 * Turns out just about anything to the r power will work: */
-	size_t tLen = qLen; /* qLen somewhat arbitrary. */
-	unsigned char* tCand = malloc(tLen);
 	do {
-		fread(tCand,1,tLen,f);
-		BYTES2Z(t,tCand,tLen);
-		if (mpz_cmp_ui(t,0) == 0) continue; /* really unlucky! */
+		if (randBits(t,qbits) != 0) return -1;
 		mpz_powm(g,t,r,p); /* efficiently do g = t**r % p */
 	} while (mpz_cmp_ui(g,1) == 0); /* since q prime, any such g /= 1
 									   will actually be a generator of
 									   the subgroup. */
-	fclose(f);
 	gmp_printf("g = %Zd\n",g);
+	mpz_clears(r,t,NULL);
+	qBitlen = mpz_sizeinbase(q,2);
+	pBitlen = mpz_sizeinbase(p,2);
+	qLen = qBitlen / 8 + (qBitlen % 8 != 0);
+	pLen = pBitlen / 8 + (pBitlen % 8 != 0);
+	montSetup(p);
+	initComb();
+	return 0;
+}
+
+int writeParams(const char* fname)
+{
+	FILE* f = fopen(fname,"wb");
+	if (!f) return -1;
+	/* same layout init expects: */
+	gmp_fprintf(f,"q = %Zd\np = %Zd\ng = %Zd\n",q,p,g);
+	return fclose(f) ? -1 : 0;
+}
+
+int writeParamsBin(const char* fname)
+{
+	if (!combReady) return paramsWriteBin(fname,q,p,g,NULL);
+	/* include the comb table, so init doesn't have to rebuild it */
+	size_t entryLimbs = mpz_size(p);
+	size_t nEntries = COMB_V << COMB_H;
+	mp_limb_t* limbs = calloc(nEntries*entryLimbs,sizeof(mp_limb_t));
+	if (!limbs) return -1;
+	for (size_t k = 0; k < COMB_V; k++) {
+		for (size_t s = 0; s < (1 << COMB_H); s++) {
+			mpz_srcptr e = gComb[k][s];
+			memcpy(limbs + ((k << COMB_H) + s)*entryLimbs,mpz_limbs_read(e),
+					mpz_size(e)*sizeof(mp_limb_t));
+		}
+	}
+	paramsTable tab = {COMB_H, COMB_V, combB, entryLimbs, limbs};
+	int rv = paramsWriteBin(fname,q,p,g,&tab);
+	free(limbs);
+	return rv;
+}
+
+/* Shared-base exponentiation (Yao's method): r[j] = base^e[j] mod p for
+ * j < n.  The expensive part, base^(2^(w*i)) for every window i, only depends
+ * on base and is computed once for all n exponents.  Each exponent then costs
+ * one multiplication per nonzero window plus 2*(2^w-1) to combine:
+ *   r = prod_d (prod_{i : digit_i == d} base^(2^(w*i)))^d
+ * where the outer product is done by a running product from d = 2^w-1 down. */
+#define MULTIEXP_W 5
+/* digits[i] = window i of e */
+static void multiDigits(unsigned char* digits, mpz_srcptr e, size_t nWin)
+{
+	for (size_t i = 0; i < nWin; i++) {
+		digits[i] = 0;
+		for (size_t b = 0; b < MULTIEXP_W; b++)
+			digits[i] |= mpz_tstbit(e,i*MULTIEXP_W + b) << b;
+	}
+}
+
+/* multiPowm with Montgomery elements */
+static void multiPowmMont(mpz_ptr* r, mpz_srcptr base, mpz_srcptr* e, size_t n,
+		size_t nWin, unsigned char* digits)
+{
+	const size_t w = montWords();
+	uint64_t* P = malloc(nWin*w*sizeof(uint64_t)); /* P[i] at P + i*w */
+	uint64_t A[MONT_MAX_WORDS], R[MONT_MAX_WORDS];
+	montFromZ(P,base);
+	for (size_t i = 1; i < nWin; i++) {
+		montSqr(P + i*w,P + (i-1)*w);
+		for (size_t k = 1; k < MULTIEXP_W; k++)
+			montSqr(P + i*w,P + i*w);
+	}
+	for (size_t j = 0; j < n; j++) {
+		multiDigits(digits,e[j],nWin);
+		montOne(A);
+		montOne(R);
+		for (unsigned d = (1 << MULTIEXP_W) - 1; d > 0; d--) {
+			for (size_t i = 0; i < nWin; i++)
+				if (digits[i] == d) montMul(A,A,P + i*w);
+			montMul(R,R,A);
+		}
+		montToZ(r[j],R);
+	}
+	memset(A,0,w*sizeof(uint64_t));
+	memset(R,0,w*sizeof(uint64_t));
+	memset(P,0,nWin*w*sizeof(uint64_t));
+	free(P);
+}
+
+/* multiPowm with mpz_mul+mpz_mod */
+static void multiPowmZ(mpz_ptr* r, mpz_srcptr base, mpz_srcptr* e, size_t n,
+		size_t nWin, unsigned char* digits)
+{
+	mpz_t* P = malloc(nWin*sizeof(mpz_t)); /* P[i] = base^(2^(w*i)) */
+	mpz_init_set(P[0],base);
+	for (size_t i = 1; i < nWin; i++) {
+		mpz_init_set(P[i],P[i-1]);
+		for (size_t k = 0; k < MULTIEXP_W; k++) {
+			mpz_mul(P[i],P[i],P[i]);
+			mpz_mod(P[i],P[i],p);
+		}
+	}
+	NEWZ(A);
+	NEWZ(R);
+	for (size_t j = 0; j < n; j++) {
+		multiDigits(digits,e[j],nWin);
+		mpz_set_ui(A,1);
+		mpz_set_ui(R,1);
+		for (unsigned d = (1 << MULTIEXP_W) - 1; d > 0; d--) {
+			for (size_t i = 0; i < nWin; i++) {
+				if (digits[i] != d) continue;
+				mpz_mul(A,A,P[i]);
+				mpz_mod(A,A,p);
+			}
+			mpz_mul(R,R,A);
+			mpz_mod(R,R,p);
+		}
+		mpz_set(r[j],R);
+	}
+	for (size_t i = 0; i < nWin; i++) mpz_clear(P[i]);
+	free(P);
+	mpz_clear(A);
+	mpz_clear(R);
+}
+
+static void multiPowm(mpz_ptr* r, mpz_srcptr base, mpz_srcptr* e, size_t n)
+{
+	size_t bits = 1;
+	for (size_t j = 0; j < n; j++)
+		if (mpz_sizeinbase(e[j],2) > bits) bits = mpz_sizeinbase(e[j],2);
+	size_t nWin = (bits + MULTIEXP_W - 1) / MULTIEXP_W;
+	unsigned char* digits = malloc(nWin);
+	if (useMont())
+		multiPowmMont(r,base,e,n,nWin,digits);
+	else
+		multiPowmZ(r,base,e,n,nWin,digits);
+	/* these are as sensitive as the exponents: */
+	memset(digits,0,nWin);
+	free(digits);
+}
+
+/* r = b^e mod p; signature fits pthread_create for dhParallel */
+typedef struct {
+	mpz_ptr r;
+	mpz_srcptr b;
+	mpz_srcptr e;
+} powmJob;
+
+static void* powmThread(void* arg)
+{
+	powmJob* j = arg;
+	powm(j->r,j->b,j->e);
 	return 0;
 }
 
@@ -137,19 +634,144 @@ int initFromScratch(size_t qbits, size_t pbits)
  * NOTE: init or initFromScratch must have been called first. */
 int dhGen(mpz_t sk, mpz_t pk)
 {
-	FILE* f = fopen("/dev/urandom","rb");
-	if (!f) {
-		fprintf(stderr, "Failed to open /dev/urandom\n");
+	size_t buflen = qLen + 32; /* read extra to get closer to uniform distribution */
+	unsigned char buf[buflen];
+	if (randBytes(buf,buflen) != 0) {
+		fprintf(stderr, "Failed to get random bytes\n");
 		return -1;
 	}
-	size_t buflen = qLen + 32; /* read extra to get closer to uniform distribution */
-	unsigned char* buf = malloc(buflen);
-	fread(buf,1,buflen,f);
-	fclose(f);
 	NEWZ(a);
 	BYTES2Z(a,buf,buflen);
+	memset(buf,0,buflen);
 	mpz_mod(sk,a,q);
-	mpz_powm(pk,g,sk,p);
+	shredZ(a);
+	mpz_clear(a);
+	if (dhFixedBase && combReady && mpz_sizeinbase(sk,2) <= COMB_H*combA)
+		combPowm(pk,sk);
+	else
+		powm(pk,g,sk);
+	return 0;
+}
+
+/* Pool of pre-generated ephemeral keys.  A background thread keeps up to
+ * poolCap pairs in a ring buffer; dhGenEphemeral takes the oldest one.  Each
+ * pair leaves the pool by mpz_swap, so it is handed out exactly once, and
+ * whatever the caller's integers held before is wiped in place. */
+static struct {
+	mpz_t* sk;
+	mpz_t* pk;
+	size_t cap;
+	size_t head;    /* index of oldest pair */
+	size_t count;   /* number of pairs ready */
+	int running;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t notFull;
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .notFull = PTHREAD_COND_INITIALIZER};
+
+int (*dhPoolGen)(mpz_t sk, mpz_t pk) = dhGen;
+
+static void* poolFill(void* arg)
+{
+	NEWZ(sk);
+	NEWZ(pk);
+	pthread_mutex_lock(&pool.lock);
+	while (pool.running) {
+		if (pool.count == pool.cap) {
+			pthread_cond_wait(&pool.notFull,&pool.lock);
+			continue;
+		}
+		/* don't hold the lock for the expensive part: */
+		pthread_mutex_unlock(&pool.lock);
+		int rv = dhPoolGen(sk,pk);
+		pthread_mutex_lock(&pool.lock);
+		if (rv != 0) {
+			/* sk,pk are whatever was left in them, not a pair: don't
+			 * pool them, and give the rng a moment (dhPoolStop still
+			 * wakes us) */
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME,&until);
+			until.tv_nsec += DH_POOL_RETRY_MS * 1000000L;
+			until.tv_sec += until.tv_nsec / 1000000000L;
+			until.tv_nsec %= 1000000000L;
+			if (pool.running)
+				pthread_cond_timedwait(&pool.notFull,&pool.lock,&until);
+			continue;
+		}
+		size_t i = (pool.head + pool.count) % pool.cap;
+		mpz_swap(pool.sk[i],sk);
+		mpz_swap(pool.pk[i],pk);
+		pool.count++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	shredZ(sk);
+	mpz_clear(sk);
+	mpz_clear(pk);
+	return 0;
+}
+
+int dhPoolStart(size_t n)
+{
+	assert(n > 0);
+	if (pool.running) return 0;
+	pool.sk = malloc(n*sizeof(mpz_t));
+	pool.pk = malloc(n*sizeof(mpz_t));
+	if (!pool.sk || !pool.pk) {
+		free(pool.sk);
+		free(pool.pk);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		mpz_init(pool.sk[i]);
+		mpz_init(pool.pk[i]);
+	}
+	pool.cap = n;
+	pool.head = pool.count = 0;
+	pool.running = 1;
+	if (pthread_create(&pool.tid,0,poolFill,0)) {
+		pool.running = 0;
+		dhPoolStop();
+		return -1;
+	}
+	return 0;
+}
+
+void dhPoolStop(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	int wasRunning = pool.running;
+	pool.running = 0;
+	pthread_cond_signal(&pool.notFull);
+	pthread_mutex_unlock(&pool.lock);
+	if (wasRunning) pthread_join(pool.tid,0);
+	for (size_t i = 0; i < pool.cap; i++) {
+		shredZ(pool.sk[i]);
+		mpz_clear(pool.sk[i]);
+		mpz_clear(pool.pk[i]);
+	}
+	free(pool.sk);
+	free(pool.pk);
+	pool.sk = pool.pk = NULL;
+	pool.cap = pool.count = 0;
+}
+
+int dhGenEphemeral(mpz_t sk, mpz_t pk)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (!pool.count) {
+		/* empty (or no pool); no sense waiting on the thread */
+		pthread_mutex_unlock(&pool.lock);
+		return dhGen(sk,pk);
+	}
+	mpz_swap(pool.sk[pool.head],sk);
+	mpz_swap(pool.pk[pool.head],pk);
+	/* the slot now holds the caller's old integers: */
+	shredZ(pool.sk[pool.head]);
+	shredZ(pool.pk[pool.head]);
+	pool.head = (pool.head + 1) % pool.cap;
+	pool.count--;
+	pthread_cond_signal(&pool.notFull);
+	pthread_mutex_unlock(&pool.lock);
 	return 0;
 }
 
@@ -160,159 +782,343 @@ int dhGenk(dhKey* k)
 	return dhGen(k->SK,k->PK);
 }
 
+/* finite field backend: elements are integers mod p, written as pLen
+ * bytes (little endian, zero padded). */
+static size_t ffLen(void)
+{
+	return pLen;
+}
+
+static int ffAgree(unsigned char* out, size_t* outlen, mpz_t sk, mpz_t pk)
+{
+	NEWZ(x);
+	powm(x,pk,sk);
+	memset(out,0,pLen);
+	Z2BYTES(out,outlen,x);
+	shredZ(x);
+	mpz_clear(x);
+	return 0;
+}
+
+static int ffAgree3(unsigned char* km, mpz_t a, mpz_t x, mpz_t B, mpz_t Y)
+{
+	NEWZ(AY);
+	NEWZ(XY);
+	NEWZ(XB);
+	/* none of the three depend on each other, so with dhParallel set, the
+	 * ones that aren't done on this thread go to helper threads. */
+	powmJob jobs[3] = {{XB,B,x},{AY,Y,a},{XY,Y,x}};
+	size_t nJobs = dhMultiExp ? 1 : 3; /* with dhMultiExp, we do AY,XY here */
+	size_t nHelpers = dhParallel ? (dhMultiExp ? 1 : 2) : 0;
+	pthread_t tids[2];
+	size_t nThreads = 0;
+	for (; nThreads < nHelpers; nThreads++) {
+		if (pthread_create(&tids[nThreads],0,powmThread,&jobs[nThreads]))
+			break; /* fine; we'll just do the rest ourselves. */
+	}
+	if (dhMultiExp) {
+		/* AY and XY share the base Y, so only build its table once: */
+		mpz_ptr r[2] = {AY,XY};
+		mpz_srcptr e[2] = {a,x};
+		multiPowm(r,Y,e,2);
+	}
+	for (size_t i = nThreads; i < nJobs; i++)
+		powmThread(&jobs[i]);
+	for (size_t i = 0; i < nThreads; i++)
+		pthread_join(tids[i],0);
+	/* NOTE: we discard number of bytes actually written by Z2BYTES and always
+	 * use 3*pLen, so it is important that we 0 the buffer first. */
+	memset(km,0,3*pLen);
+	Z2BYTES(km,NULL,AY);
+	Z2BYTES(km+pLen,NULL,XY);
+	Z2BYTES(km+2*pLen,NULL,XB);
+	mpz_ptr v[3] = {AY,XY,XB};
+	for (size_t i = 0; i < 3; i++) {
+		shredZ(v[i]);
+		mpz_clear(v[i]);
+	}
+	return 0;
+}
+
+/* agree3 for a batch.  The 3n exponentiations are independent, so we
+ * just hand them all to montPowmN, which runs them side by side in SIMD
+ * lanes if it can.  Sessions go in groups of FF_BATCH to bound the stack. */
+#define FF_BATCH 8
+static int ffAgree3N(unsigned char** km, const dh3Session* s, size_t n)
+{
+	if (!useMont() || montLanes() == 1) {
+		for (size_t i = 0; i < n; i++)
+			ffAgree3(km[i],s[i].a,s[i].x,s[i].B,s[i].Y);
+		return 0;
+	}
+	mpz_t v[3*FF_BATCH];
+	mpz_ptr r[3*FF_BATCH];
+	mpz_srcptr b[3*FF_BATCH], e[3*FF_BATCH];
+	for (size_t j = 0; j < 3*FF_BATCH; j++) {
+		mpz_init(v[j]);
+		r[j] = v[j];
+	}
+	for (size_t i0 = 0; i0 < n; i0 += FF_BATCH) {
+		size_t m = (n - i0 < FF_BATCH) ? n - i0 : FF_BATCH;
+		/* same order as ffAgree3's km: AY, XY, XB */
+		for (size_t i = 0; i < m; i++) {
+			const dh3Session* si = &s[i0+i];
+			b[3*i] = si->Y;   e[3*i] = si->a;
+			b[3*i+1] = si->Y; e[3*i+1] = si->x;
+			b[3*i+2] = si->B; e[3*i+2] = si->x;
+		}
+		montPowmN(r,b,e,3*m);
+		for (size_t i = 0; i < m; i++) {
+			memset(km[i0+i],0,3*pLen);
+			for (size_t j = 0; j < 3; j++)
+				Z2BYTES(km[i0+i]+j*pLen,NULL,v[3*i+j]);
+		}
+	}
+	for (size_t j = 0; j < 3*FF_BATCH; j++) {
+		shredZ(v[j]);
+		mpz_clear(v[j]);
+	}
+	return 0;
+}
+
+/* 1 < pk < p-1 and pk^q == 1.  (Not secret, so variable time is fine.) */
+static int ffCheck(mpz_t pk)
+{
+	NEWZ(t);
+	mpz_sub_ui(t,p,1);
+	int rv = -1;
+	if (mpz_cmp_ui(pk,1) > 0 && mpz_cmp(pk,t) < 0) {
+		powm(t,pk,q);
+		if (mpz_cmp_ui(t,1) == 0) rv = 0;
+	}
+	mpz_clear(t);
+	return rv;
+}
+
+const dhGroup dhGroupFF = {"ff", ffLen, dhGen, ffAgree, ffAgree3, ffAgree3N,
+	ffCheck};
+
+/* X25519 backend (RFC 7748, via OpenSSL).  Secret and public keys are the
+ * 32 byte strings from the RFC, stored as little endian integers so that
+ * they fit the same mpz_t interface (and serialize_mpz) as the FF keys. */
+#define X25519_LEN 32
+
+static size_t x25519Len(void)
+{
+	return X25519_LEN;
+}
+
+static void zToKey(unsigned char* buf, mpz_t x)
+{
+	memset(buf,0,X25519_LEN);
+	if (mpz_sizeinbase(x,256) <= X25519_LEN) Z2BYTES(buf,NULL,x);
+}
+
+static int x25519Gen(mpz_t sk, mpz_t pk)
+{
+	unsigned char skb[X25519_LEN], pkb[X25519_LEN];
+	size_t n = X25519_LEN;
+	if (randBytes(skb,X25519_LEN) != 0) return -1;
+	EVP_PKEY* k = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519,NULL,skb,X25519_LEN);
+	int rv = (k && EVP_PKEY_get_raw_public_key(k,pkb,&n) == 1) ? 0 : -1;
+	if (rv == 0) {
+		BYTES2Z(sk,skb,X25519_LEN);
+		BYTES2Z(pk,pkb,X25519_LEN);
+	}
+	EVP_PKEY_free(k);
+	OPENSSL_cleanse(skb,X25519_LEN);
+	return rv;
+}
+
+static int x25519Agree(unsigned char* out, size_t* outlen, mpz_t sk, mpz_t pk)
+{
+	unsigned char skb[X25519_LEN], pkb[X25519_LEN];
+	zToKey(skb,sk);
+	zToKey(pkb,pk);
+	EVP_PKEY* mine = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519,NULL,skb,X25519_LEN);
+	EVP_PKEY* yours = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519,NULL,pkb,X25519_LEN);
+	OPENSSL_cleanse(skb,X25519_LEN);
+	EVP_PKEY_CTX* ctx = mine ? EVP_PKEY_CTX_new(mine,NULL) : NULL;
+	size_t n = X25519_LEN;
+	/* NOTE: derive fails if the result is all zero (small order pk) */
+	int rv = (ctx && yours && EVP_PKEY_derive_init(ctx) == 1 &&
+			EVP_PKEY_derive_set_peer(ctx,yours) == 1 &&
+			EVP_PKEY_derive(ctx,out,&n) == 1 && n == X25519_LEN) ? 0 : -1;
+	if (outlen) *outlen = X25519_LEN;
+	EVP_PKEY_CTX_free(ctx);
+	EVP_PKEY_free(mine);
+	EVP_PKEY_free(yours);
+	return rv;
+}
+
+static int x25519Agree3(unsigned char* km, mpz_t a, mpz_t x, mpz_t B, mpz_t Y)
+{
+	if (x25519Agree(km,NULL,a,Y) != 0 ||
+			x25519Agree(km+X25519_LEN,NULL,x,Y) != 0 ||
+			x25519Agree(km+2*X25519_LEN,NULL,x,B) != 0) return -1;
+	return 0;
+}
+
+/* any 32 byte string will do (RFC 7748 ignores the top bit); small order
+ * points are caught by derive, which fails on an all zero result */
+static int x25519Check(mpz_t pk)
+{
+	return (mpz_sgn(pk) >= 0 && mpz_sizeinbase(pk,256) <= X25519_LEN) ? 0 : -1;
+}
+
+const dhGroup dhGroupX25519 = {"x25519", x25519Len, x25519Gen, x25519Agree,
+	x25519Agree3, NULL, x25519Check};
+
+const dhGroup* dhGroupByName(const char* name)
+{
+	if (strcmp(name,dhGroupFF.name) == 0) return &dhGroupFF;
+	if (strcmp(name,dhGroupX25519.name) == 0) return &dhGroupX25519;
+	return NULL;
+}
+
+int dhGenG(const dhGroup* G, mpz_t sk, mpz_t pk)
+{
+	return G->gen(sk,pk);
+}
+
 /* see "Cryptographic Extraction and Key Derivation: The HKDF Scheme"
  * by H. Krawczyk, 2010 for details on the key derivation used here. */
+/* Key derivation for dhFinal and dh3Final: PRK = HMAC_{hmacsalt}(IKM), and
+ * the output is K(0) || K(1) || ..., where K(0) = HMAC_{PRK}(0^64 || CTX || 0)
+ * and K(i+1) = HMAC_{PRK}(K(i) || CTX || i+1), with i as 8 bytes big endian.
+ * CTX is the two public keys; see hkdf.h.
+ *         +---------------------+
+ *  input: | K(i) | CTX (PK) | i |
+ *         +---------------------+ */
+static int kdf(unsigned char* keybuf, size_t buflen, const unsigned char* IKM,
+		size_t ikmlen, const unsigned char* PK, size_t pklen)
+{
+	hkdfPiece ikm = {IKM,ikmlen};
+	hkdfPiece ctx = {PK,pklen};
+	return hkdf(keybuf,buflen,hmacsalt,strlen(hmacsalt),&ikm,1,&ctx,1);
+}
+
 int dhFinal(mpz_t sk_mine, mpz_t pk_mine, mpz_t pk_yours, unsigned char* keybuf, size_t buflen)
 {
-	NEWZ(x);
-	mpz_powm(x,pk_yours,sk_mine,p);
-	/* now apply key derivation to get the desired number of bytes: */
-	unsigned char* SK = malloc(pLen);
-	memset(SK,0,pLen);
-	size_t nWritten; /* saves number of bytes written by Z2BYTES */
-	Z2BYTES(SK,&nWritten,x);
-	const size_t maclen = 64; /* output len of sha512 */
-	unsigned char PRK[maclen];
-	memset(PRK,0,maclen);
-	HMAC(EVP_sha512(),hmacsalt,strlen(hmacsalt),SK,nWritten,PRK,0);
-	/* Henceforth, use PRK as the HMAC key.  The initial chunk of derived key
-	 * is computed as HMAC_{PRK}(CTX || 0), where CTX = pk_A || pk_B, where
-	 * (pk_A,pk_B) is {pk_mine,pk_yours}, sorted ascending.
-	 * To generate further chunks K(i+1), proceed as follows:
-	 * K(i+1) = HMAC_{PRK}(K(i) || CTX || i). */
-	/* For convenience (?) we'll use a buffer named CTX that will contain
-	 * the previous key as well as the index i:
-	 *         +------------------------+
-	 *  CTX == | K(i) | PK_A | PK_B | i |
-	 *         +------------------------+
-	 * */
-	const size_t ctxlen = maclen + 2*pLen + 8;
-	/* NOTE: the extra 8 bytes are to concatenate the key chunk index */
-	unsigned char* CTX = malloc(ctxlen);
-	uint64_t index = 0;       /* key index */
-	uint64_t indexBE = index; /* key index, but always big endian */
-	memset(CTX,0,ctxlen);
+	return dhFinalG(&dhGroupFF,sk_mine,pk_mine,pk_yours,keybuf,buflen);
+}
+
+int dhFinalG(const dhGroup* G, mpz_t sk_mine, mpz_t pk_mine, mpz_t pk_yours,
+		unsigned char* keybuf, size_t buflen)
+{
+	const size_t eLen = G->len(); /* bytes per group element */
+	/* SK is the DH value; PK holds the public keys for CTX (see kdf) */
+	unsigned char SK[eLen], PK[2*eLen];
+	size_t nWritten; /* number of significant bytes of the DH value */
+	int rv = -1;
+	if (G->agree(SK,&nWritten,sk_mine,pk_yours) != 0) goto end;
+	/* CTX = pk_A || pk_B, where (pk_A,pk_B) is {pk_mine,pk_yours}, sorted
+	 * ascending. */
+	memset(PK,0,2*eLen);
 	if (mpz_cmp(pk_mine,pk_yours) < 0) {
-		Z2BYTES(CTX+maclen,NULL,pk_mine);
-		Z2BYTES(CTX+maclen+pLen,NULL,pk_yours);
+		Z2BYTES(PK,NULL,pk_mine);
+		Z2BYTES(PK+eLen,NULL,pk_yours);
 	} else {
-		Z2BYTES(CTX+maclen,NULL,pk_yours);
-		Z2BYTES(CTX+maclen+pLen,NULL,pk_mine);
-	}
-	memcpy(CTX+maclen+2*pLen,&indexBE,sizeof(indexBE));
-	unsigned char K[maclen];
-	memset(K,0,maclen);
-	/* compute initial key chunk: */
-	HMAC(EVP_sha512(),PRK,maclen,CTX,ctxlen,K,0);
-	/* and write to the output key buffer: */
-	size_t copylen = (buflen < maclen)?buflen:maclen;
-	memcpy(keybuf,K,copylen);
-	size_t bytesLeft = buflen - copylen;
-	while (bytesLeft) {
-		/* compute next chunk and copy */
-		index++;
-		indexBE = htobe64(index);
-		memcpy(CTX+maclen+2*pLen,&indexBE,sizeof(indexBE));
-		memcpy(CTX,K,maclen);
-		HMAC(EVP_sha512(),PRK,maclen,CTX,ctxlen,K,0);
-		copylen = (bytesLeft < maclen)?bytesLeft:maclen;
-		/* move to next chunk of key buffer */
-		keybuf += maclen;
-		memcpy(keybuf,K,copylen);
-		bytesLeft -= copylen;
-	}
-	/* erase sensitive data: */
-	memset(CTX,0,ctxlen);
-	memset(K,0,maclen);
-	memset(SK,0,pLen);
-	memset(PRK,0,maclen);
-	return 0;
+		Z2BYTES(PK,NULL,pk_yours);
+		Z2BYTES(PK+eLen,NULL,pk_mine);
+	}
+	rv = kdf(keybuf,buflen,SK,nWritten,PK,2*eLen);
+end:
+	memset(SK,0,eLen);
+	return rv;
 }
 
 int dh3Final(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
 		unsigned char* keybuf, size_t buflen)
 {
-	/* the 3 DH values will be stored in
-	 * AY == Y^a
-	 * XY == Y^x
-	 * XB == B^x
-	 * NOTE: so that both parties derive the same key, we'll swap(AY,XB)
+	return dh3FinalG(&dhGroupFF,a,A,x,X,B,Y,keybuf,buflen);
+}
+
+/* the rest of dh3FinalG, once the 3 DH values are in KM (3*eLen bytes) */
+static int dh3Kdf(size_t eLen, unsigned char* KM, mpz_t A, mpz_t X, mpz_t B,
+		mpz_t Y, unsigned char* keybuf, size_t buflen)
+{
+	/* NOTE: so that both parties derive the same key, we'll swap(AY,XB)
 	 * if necessary, based on whether or not A < B. */
-	NEWZ(AY);
-	mpz_powm(AY,Y,a,p);
-	NEWZ(XY);
-	mpz_powm(XY,Y,x,p);
-	NEWZ(XB);
-	mpz_powm(XB,B,x,p);
 	if (mpz_cmp(A,B) > 0) {
-		mpz_swap(AY,XB);
+		for (size_t i = 0; i < eLen; i++) {
+			unsigned char t = KM[i];
+			KM[i] = KM[2*eLen+i];
+			KM[2*eLen+i] = t;
+		}
 	}
-	/* now apply key derivation to get the desired number of bytes: */
-	size_t kmlen = 3*pLen; /* length of raw key material (AY || XY || XB) */
-	unsigned char* KM = malloc(kmlen);
-	memset(KM,0,kmlen);
-	/* NOTE: we discard number of bytes actually written by Z2BYTES and always
-	 * use kmlen, so it is important that we 0 the buffer first. */
-	Z2BYTES(KM,NULL,AY);
-	Z2BYTES(KM+pLen,NULL,XY);
-	Z2BYTES(KM+2*pLen,NULL,XB);
-	const size_t maclen = 64; /* output len of sha512 */
-	unsigned char PRK[maclen];
-	memset(PRK,0,maclen);
-	HMAC(EVP_sha512(),hmacsalt,strlen(hmacsalt),KM,kmlen,PRK,0);
-	/* Henceforth, use PRK as the HMAC key.  The initial chunk of derived key
-	 * is computed as HMAC_{PRK}(CTX || 0), where CTX = X || Y, the concatenation
-	 * of the ephemeral public keys, sorted ascending.
-	 * To generate further chunks K(i+1), proceed as follows:
-	 * K(i+1) = HMAC_{PRK}(K(i) || CTX || i). */
-	/* For convenience (?) we'll use a buffer named CTX that will contain
-	 * the previous key as well as the index i:
-	 *         +------------------+
-	 *  CTX == | K(i) | X | Y | i |
-	 *         +------------------+
-	 * */
-	const size_t ctxlen = maclen + 2*pLen + 8;
-	/* NOTE: the extra 8 bytes are to concatenate the key chunk index */
-	unsigned char* CTX = malloc(ctxlen);
-	uint64_t index = 0;       /* key index */
-	uint64_t indexBE = index; /* key index, but always big endian */
-	memset(CTX,0,ctxlen);
-	/* NOTE: shouldn't swap X,Y since mpz_t params are effectively by-reference */
+	/* CTX = X || Y, the concatenation of the ephemeral public keys, sorted
+	 * ascending.
+	 * NOTE: shouldn't swap X,Y since mpz_t params are effectively by-reference */
+	unsigned char PK[2*eLen];
+	memset(PK,0,2*eLen);
 	if (mpz_cmp(X,Y) < 0) {
-		Z2BYTES(CTX+maclen,NULL,X);
-		Z2BYTES(CTX+maclen+pLen,NULL,Y);
+		Z2BYTES(PK,NULL,X);
+		Z2BYTES(PK+eLen,NULL,Y);
 	} else {
-		Z2BYTES(CTX+maclen,NULL,Y);
-		Z2BYTES(CTX+maclen+pLen,NULL,X);
-	}
-	memcpy(CTX+maclen+2*pLen,&indexBE,sizeof(indexBE));
-	unsigned char K[maclen];
-	memset(K,0,maclen);
-	/* compute initial key chunk: */
-	HMAC(EVP_sha512(),PRK,maclen,CTX,ctxlen,K,0);
-	/* and write to the output key buffer: */
-	size_t copylen = (buflen < maclen)?buflen:maclen;
-	memcpy(keybuf,K,copylen);
-	size_t bytesLeft = buflen - copylen;
-	while (bytesLeft) {
-		/* compute next chunk and copy */
-		index++;
-		indexBE = htobe64(index);
-		memcpy(CTX+maclen+2*pLen,&indexBE,sizeof(indexBE));
-		memcpy(CTX,K,maclen);
-		HMAC(EVP_sha512(),PRK,maclen,CTX,ctxlen,K,0);
-		copylen = (bytesLeft < maclen)?bytesLeft:maclen;
-		/* move to next chunk of key buffer */
-		keybuf += maclen;
-		memcpy(keybuf,K,copylen);
-		bytesLeft -= copylen;
-	}
-	/* erase sensitive data: */
-	memset(CTX,0,ctxlen);
-	memset(K,0,maclen);
-	memset(KM,0,pLen);
-	memset(PRK,0,maclen);
-	return 0;
+		Z2BYTES(PK,NULL,Y);
+		Z2BYTES(PK+eLen,NULL,X);
+	}
+	return kdf(keybuf,buflen,KM,3*eLen,PK,2*eLen);
+}
+
+int dh3FinalG(const dhGroup* G, mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B,
+		mpz_t Y, unsigned char* keybuf, size_t buflen)
+{
+	const size_t eLen = G->len(); /* bytes per group element */
+	/* the 3 DH values will be stored in
+	 * AY == Y^a
+	 * XY == Y^x
+	 * XB == B^x */
+	size_t kmlen = 3*eLen; /* length of raw key material (AY || XY || XB) */
+	unsigned char KM[kmlen];
+	int rv = -1;
+	if (G->agree3(KM,a,x,B,Y) == 0)
+		rv = dh3Kdf(eLen,KM,A,X,B,Y,keybuf,buflen);
+	memset(KM,0,kmlen);
+	return rv;
+}
+
+int dh3FinalBatch(dh3Session* s, size_t n)
+{
+	return dh3FinalBatchG(&dhGroupFF,s,n);
+}
+
+int dh3FinalBatchG(const dhGroup* G, dh3Session* s, size_t n)
+{
+	int rv = 0;
+	if (!G->agree3N) {
+		for (size_t i = 0; i < n; i++) {
+			if (dh3FinalG(G,s[i].a,s[i].A,s[i].x,s[i].X,s[i].B,s[i].Y,
+						s[i].keybuf,s[i].buflen) != 0) {
+				memset(s[i].keybuf,0,s[i].buflen);
+				rv = -1;
+			}
+		}
+		return rv;
+	}
+	const size_t eLen = G->len();
+	/* raw key material for all sessions, in one block */
+	unsigned char* KM = malloc(n*3*eLen);
+	unsigned char** km = malloc(n*sizeof(unsigned char*));
+	if (!KM || !km) {
+		free(KM);
+		free(km);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) km[i] = KM + i*3*eLen;
+	int agreed = (G->agree3N(km,s,n) == 0);
+	for (size_t i = 0; i < n; i++) {
+		if (agreed && dh3Kdf(eLen,km[i],s[i].A,s[i].X,s[i].B,s[i].Y,
+					s[i].keybuf,s[i].buflen) == 0)
+			continue;
+		memset(s[i].keybuf,0,s[i].buflen);
+		rv = -1;
+	}
+	memset(KM,0,n*3*eLen);
+	free(KM);
+	free(km);
+	return rv;
 }
 
 int dh3Finalk(dhKey* skA, dhKey* skX, dhKey* pkB, dhKey* pkY,
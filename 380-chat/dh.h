@@ -10,20 +10,98 @@ extern size_t qBitlen; /** length of q in bits */
 extern size_t pBitlen; /** length of p in bits */
 extern size_t qLen; /** length of q in bytes */
 extern size_t pLen; /** length of p in bytes */
+/** if nonzero (the default), dhGen computes g^sk from a table built by
+ * init/initFromScratch instead of calling mpz_powm.  Set to 0 to check
+ * results against plain mpz_powm. */
+extern int dhFixedBase;
+/** if nonzero (the default), dh3Final computes Y^a and Y^x together with
+ * one shared table for Y.  Set to 0 to use two calls to mpz_powm. */
+extern int dhMultiExp;
+/** if nonzero, dh3Final runs its independent exponentiations on separate
+ * threads and joins them before the KDF.  Off by default; the output is
+ * the same either way. */
+extern int dhParallel;
+/** if nonzero (the default), exponentiations mod p use the Montgomery
+ * kernels of mont.c (AVX-512 IFMA when the build and CPU have it) instead of
+ * mpz_powm.  The results are the same either way. */
+extern int dhMont;
+
+/** the arguments of one dh3Final call, for dh3FinalBatch */
+typedef struct {
+	mpz_ptr a, A, x, X, B, Y;
+	unsigned char* keybuf;
+	size_t buflen;
+} dh3Session;
+
+/** A Diffie Hellman group.  Keys are mpz_t regardless of the group; for
+ * byte-string groups like X25519, the bytes are stored little endian (as
+ * with BYTES2Z), so serialize_mpz etc. work unchanged.  NOTE: the ff group
+ * needs init/initFromScratch first; x25519 needs nothing. */
+typedef struct {
+	const char* name;
+	/** bytes per group element / raw DH value */
+	size_t (*len)(void);
+	/** fresh secret key and matching public key */
+	int (*gen)(mpz_t sk, mpz_t pk);
+	/** raw DH value of sk and pk into out (len() bytes).  *outlen (if not
+	 * NULL) gets the number of significant bytes. */
+	int (*agree)(unsigned char* out, size_t* outlen, mpz_t sk, mpz_t pk);
+	/** the three 3DH values a*Y || x*Y || x*B into km (3*len() bytes) */
+	int (*agree3)(unsigned char* km, mpz_t a, mpz_t x, mpz_t B, mpz_t Y);
+	/** agree3 for n sessions at once (km[i] for s[i]), or NULL if the group
+	 * has nothing better than calling agree3 n times */
+	int (*agree3N)(unsigned char** km, const dh3Session* s, size_t n);
+	/** 0 if pk, a public key from a peer, is one we can use, -1 if not.
+	 * Call it on every key that comes off the wire before agree/agree3:
+	 * for ff, it must be in the subgroup of order q (not 0, 1 or p-1, nor
+	 * of small order; p-1 has other factors besides q), since raising a
+	 * small order pk to our secret leaks the secret mod that order. */
+	int (*check)(mpz_t pk);
+} dhGroup;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
+extern const dhGroup dhGroupFF;     /** finite field group from q,p,g */
+extern const dhGroup dhGroupX25519; /** Curve25519 (RFC 7748) */
+/** look up a group by name ("ff" or "x25519"); NULL if there's no such */
+const dhGroup* dhGroupByName(const char* name);
 /* NOTE: you must call init or initFromScratch before doing anything else. */
-/** Try to read q,p,g from a file: */
+/** Try to read q,p,g from a file, either text (see writeParams) or binary
+ * (see writeParamsBin).  Parameters are fully validated the first time they
+ * are seen; after that, a digest in the user's trusted cache lets us skip
+ * the primality tests. */
 int init(const char* fname);
 /** Generate fresh Diffie Hellman parameters.  This is a somewhat
  * expensive computation, so it's best to save and reuse params.
  * Prints generated parameters to stdout. */
 int initFromScratch(size_t qBitlen, size_t pBitlen);
+/** same as initFromScratch, but spreads the prime search over nThreads
+ * threads (0 means one per online CPU). */
+int initFromScratchMT(size_t qBitlen, size_t pBitlen, size_t nThreads);
+/** write the current q,p,g to fname in the format init reads */
+int writeParams(const char* fname);
+/** write the current q,p,g to fname in a binary format that init can load
+ * without any base conversion, along with the precomputed table for g.
+ * Not portable across architectures, so keep the text file around too. */
+int writeParamsBin(const char* fname);
 /** set sk to a random exponent (this part is secret) and set
  * pk to g^(sk) mod p */
 int dhGen(mpz_t sk, mpz_t pk);
+/** start a background thread that keeps up to n fresh key pairs ready
+ * for dhGenEphemeral.  Returns 0 on success (or if already running). */
+int dhPoolStart(size_t n);
+/** what the pool thread makes pairs with (dhGen by default).  A pair is
+ * only pooled if this returns 0; after a failure the thread waits
+ * DH_POOL_RETRY_MS before trying again.  Only change it while the pool is
+ * stopped (dh-bench swaps in one that fails). */
+extern int (*dhPoolGen)(mpz_t sk, mpz_t pk);
+#define DH_POOL_RETRY_MS 100
+/** stop the pool thread and wipe any pairs that weren't used */
+void dhPoolStop(void);
+/** same as dhGen, but takes a pre-generated pair from the pool if one is
+ * ready (falls back to dhGen otherwise).  Each pair is handed out once. */
+int dhGenEphemeral(mpz_t sk, mpz_t pk);
 /** same as dhGen, but accepts key struct */
 int dhGenk(dhKey* k);
 /** given a secret (sk_mine say from dhGen above) and your friend's
@@ -43,6 +121,21 @@ int dhFinal(mpz_t sk_mine, mpz_t pk_mine, mpz_t pk_yours, unsigned char* keybuf,
  * */
 int dh3Final(mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B, mpz_t Y,
 		unsigned char* keybuf, size_t buflen);
+/** dhGen, dhFinal and dh3Final for an arbitrary group G.  The versions
+ * without G use dhGroupFF, and the KDF is the same for every group. */
+int dhGenG(const dhGroup* G, mpz_t sk, mpz_t pk);
+int dhFinalG(const dhGroup* G, mpz_t sk_mine, mpz_t pk_mine, mpz_t pk_yours,
+		unsigned char* keybuf, size_t buflen);
+int dh3FinalG(const dhGroup* G, mpz_t a, mpz_t A, mpz_t x, mpz_t X, mpz_t B,
+		mpz_t Y, unsigned char* keybuf, size_t buflen);
+/** dh3Final for each of the n sessions in s.  The keys are the same as from
+ * n dh3Final calls, but the exponentiations of all the sessions are done
+ * together, several at a time in SIMD lanes when mont.c has a lane-parallel
+ * kernel.  Meant for a server handling many handshakes at once.
+ * @return 0 if every session succeeded; otherwise -1, and the keybuf of
+ * each failed session is zeroed. */
+int dh3FinalBatch(dh3Session* s, size_t n);
+int dh3FinalBatchG(const dhGroup* G, dh3Session* s, size_t n);
 /** same as dh3Final, but accepts keys instead */
 int dh3Finalk(dhKey* skA, dhKey* skX, dhKey* pkB, dhKey* pkY,
 		unsigned char* keybuf, size_t buflen);
@@ -0,0 +1,197 @@
+#include "handshake.h"
+#include "util.h"
+#include "hkdf.h"
+#include "rng.h"
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+int hsEncode(unsigned char* out, size_t cap, mpz_t K, mpz_t E)
+{
+	mpz_ptr v[2] = {K,E};
+	if (mpz_sizeinbase(K,256) > HS_MAX_MPZ || mpz_sizeinbase(E,256) > HS_MAX_MPZ)
+		return -1;
+	size_t n = serialize_mpzv(out,cap,v,2);
+	return n ? (int)n : -1;
+}
+
+int hsDecode(const dhGroup* G, mpz_t K, mpz_t E, const unsigned char* in,
+		size_t len)
+{
+	mpz_ptr v[2] = {K,E};
+	ssize_t n = deserialize_mpzv(v,2,in,len,HS_MAX_MPZ);
+	if (n > 0 && (G->check(K) != 0 || G->check(E) != 0)) return -1;
+	return (int)n;
+}
+
+int hsIsResume(const unsigned char* in, size_t len)
+{
+	uint32_t w;
+	if (len < 4) return 0;
+	memcpy(&w,in,4);
+	return !!(le32toh(w) & HS_RESUME);
+}
+
+int hsEncodeResume(unsigned char* out, size_t cap, const unsigned char* ticket,
+		const unsigned char* nonce, mpz_ptr X)
+{
+	const size_t n = 4 + TICKET_LEN + HS_NONCE_LEN;
+	uint32_t w = htole32(HS_RESUME | (X ? HS_RESUME_DH : 0));
+	if (cap < n) return -1;
+	memcpy(out,&w,4);
+	memcpy(out + 4,ticket,TICKET_LEN);
+	memcpy(out + 4 + TICKET_LEN,nonce,HS_NONCE_LEN);
+	if (!X) return n;
+	if (mpz_sizeinbase(X,256) > HS_MAX_MPZ) return -1;
+	size_t m = serialize_mpzv(out + n,cap - n,&X,1);
+	return m ? (int)(n + m) : -1;
+}
+
+int hsDecodeResume(const dhGroup* G, const unsigned char* in, size_t len,
+		const unsigned char** ticket, const unsigned char** nonce, mpz_t X,
+		int* dh)
+{
+	const size_t n = 4 + TICKET_LEN + HS_NONCE_LEN;
+	uint32_t w;
+	if (len < 4) return 0;
+	memcpy(&w,in,4);
+	w = le32toh(w);
+	if ((w & ~HS_RESUME_DH) != HS_RESUME) return -1;
+	if (len < n) return 0;
+	*ticket = in + 4;
+	*nonce = in + 4 + TICKET_LEN;
+	*dh = !!(w & HS_RESUME_DH);
+	if (!*dh) return n;
+	mpz_ptr v[1] = {X};
+	ssize_t m = deserialize_mpzv(v,1,in + n,len - n,HS_MAX_MPZ);
+	if (m > 0 && G->check(X) != 0) return -1;
+	return m <= 0 ? m : (int)(n + m);
+}
+
+int hsResumeKeys(const unsigned char* ticket, const unsigned char* secret,
+		const unsigned char* nonce, mpz_t Y, const unsigned char* dh,
+		size_t dhlen, unsigned char* key, size_t keylen)
+{
+	static const char salt[] = "380-chat resume";
+	unsigned char y[4 + HS_MAX_MPZ];
+	mpz_ptr v[1] = {Y};
+	size_t ylen = serialize_mpzv(y,sizeof(y),v,1);
+	if (!ylen) return -1;
+	hkdfPiece ikm[2] = {{secret,HS_SECRET_LEN},{dh,dhlen}};
+	hkdfPiece ctx[3] = {{ticket,TICKET_LEN},{nonce,HS_NONCE_LEN},{y,ylen}};
+	return hkdf(key,keylen,salt,sizeof(salt) - 1,ikm,dh ? 2 : 1,ctx,3);
+}
+
+/* read one integer (serialize_mpz format) onto buf + *len, of which the 4
+ * byte header is there already if have is set */
+static int readMpz(xstream* s, unsigned char* buf, size_t* len, int have)
+{
+	uint32_t nB_le;
+	if (!have && xsRead(s,buf + *len,4) != 0) return -1;
+	memcpy(&nB_le,buf + *len,4);
+	size_t nB = le32toh(nB_le);
+	if (nB > HS_MAX_MPZ || xsRead(s,buf + *len + 4,nB) != 0) return -1;
+	*len += 4 + nB;
+	return 0;
+}
+
+/* read the peer's hello.  Whatever came in behind it (ciphertext, if the
+ * peer was quick) stays in s for the record layer. */
+static int readHello(xstream* s, const dhGroup* G, mpz_t K, mpz_t E)
+{
+	unsigned char buf[HS_MAX_HELLO];
+	size_t len = 0;
+	if (xsRead(s,buf,4) != 0) return -1;
+	if (hsIsResume(buf,4)) {
+		/* we have no ticket keys, so skip it, say no, and wait for the
+		 * full hello that comes next */
+		uint32_t w;
+		memcpy(&w,buf,4);
+		if (le32toh(w) & ~(HS_RESUME | HS_RESUME_DH)) return -1;
+		if (xsRead(s,buf,TICKET_LEN + HS_NONCE_LEN) != 0) return -1;
+		if ((le32toh(w) & HS_RESUME_DH) && readMpz(s,buf,&len,0) != 0)
+			return -1;
+		len = 0;
+		w = htole32(HS_REJECT);
+		if (xsWrite(s,&w,4) != 0 || xsFlush(s) != 0 || xsRead(s,buf,4) != 0)
+			return -1;
+	}
+	if (readMpz(s,buf,&len,1) != 0 || readMpz(s,buf,&len,0) != 0) return -1;
+	int rv = (hsDecode(G,K,E,buf,len) == (int)len) ? 0 : -1;
+	memset(buf,0,len);
+	return rv;
+}
+
+static int genEphemeral(const dhGroup* G, mpz_t x, mpz_t X)
+{
+	return G == &dhGroupFF ? dhGenEphemeral(x,X) : dhGenG(G,x,X);
+}
+
+static int genLongTerm(const dhGroup* G, const dhKey* id, mpz_t a, mpz_t A)
+{
+	if (!id) return dhGenG(G,a,A);
+	mpz_set(a,id->SK);
+	mpz_set(A,id->PK);
+	return 0;
+}
+
+static int sendHello(xstream* s, mpz_t K, mpz_t E)
+{
+	unsigned char hello[HS_MAX_HELLO];
+	int n = hsEncode(hello,sizeof(hello),K,E);
+	return (n < 0 || xsWrite(s,hello,n) != 0 || xsFlush(s) != 0) ? -1 : 0;
+}
+
+int hsRun(xstream* s, const dhGroup* G, const dhKey* id, mpz_ptr peer,
+		hsTicket* t, unsigned char* key, size_t keylen, int* side)
+{
+	NEWZ(a); NEWZ(A); /* ours */
+	NEWZ(x); NEWZ(X);
+	NEWZ(B); NEWZ(Y); /* theirs */
+	unsigned char hello[HS_MAX_HELLO];
+	unsigned char nonce[HS_NONCE_LEN];
+	int rv = -1;
+	int resume = t && t->valid;
+	if (t) t->resumed = 0;
+	/* NOTE: neither hello depends on the other, so both sides send first
+	 * and then read: one write, and usually one read, since the peer's
+	 * hello arrives in a piece.  (A hello is far smaller than a socket
+	 * buffer, so this can't deadlock.) */
+	if (resume) {
+		/* no keys of our own at all, unless t->dh */
+		int n = (randBytes(nonce,sizeof(nonce)) != 0 ||
+				(t->dh && genEphemeral(G,x,X) != 0)) ? -1 :
+			hsEncodeResume(hello,sizeof(hello),t->ticket,nonce,
+					t->dh ? X : NULL);
+		if (n < 0 || xsWrite(s,hello,n) != 0 || xsFlush(s) != 0) goto end;
+	} else if (genLongTerm(G,id,a,A) != 0 || genEphemeral(G,x,X) != 0 ||
+			sendHello(s,A,X) != 0) goto end;
+	/* B and Y are checked (G->check) before any DH with them */
+	if (readHello(s,G,B,Y) != 0) goto end;
+	if (peer) mpz_set(peer,B);
+	if (resume) {
+		uint32_t answer;
+		if (xsRead(s,&answer,4) != 0) goto end;
+		if (le32toh(answer) == HS_ACCEPT) {
+			unsigned char dh[HKDF_LEN];
+			if (!t->dh || dhFinalG(G,x,X,Y,dh,sizeof(dh)) == 0)
+				rv = hsResumeKeys(t->ticket,t->secret,nonce,Y,
+						t->dh ? dh : NULL,t->dh ? sizeof(dh) : 0,key,keylen);
+			memset(dh,0,sizeof(dh));
+			*side = 1; /* the server is 0 */
+			t->resumed = (rv == 0);
+			goto end;
+		}
+		/* turned down (the ticket is stale, say): the full handshake */
+		if (le32toh(answer) != HS_REJECT || genLongTerm(G,id,a,A) != 0 ||
+				(!t->dh && genEphemeral(G,x,X) != 0) ||
+				sendHello(s,A,X) != 0) goto end;
+	}
+	*side = (mpz_cmp(X,Y) < 0);
+	rv = dh3FinalG(G,a,A,x,X,B,Y,key,keylen);
+end:
+	shredZ(a);
+	shredZ(x);
+	mpz_clears(a,A,x,X,B,Y,NULL);
+	return rv;
+}
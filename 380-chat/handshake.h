@@ -0,0 +1,101 @@
+/* The key exchange, on the wire.  Each side sends one hello: its long term
+ * public key followed by its ephemeral public key, each in serialize_mpz's
+ * format (4 byte little endian length, then the bytes, little endian).
+ * Neither hello depends on the other's, so both sides send theirs as soon
+ * as the connection is up (the server, B || Y; a client, A || X) and run
+ * dh3Final once the other one arrives: one round trip at most.
+ *
+ * A client holding a ticket from an earlier session (see ticket.h) may
+ * send a resumption hello instead:
+ *   HS_RESUME [| HS_RESUME_DH] (4 bytes) || ticket || nonce [|| X]
+ * (X, an ephemeral key, is there with HS_RESUME_DH; a full hello's first
+ * word is a length, never that big).  After its own hello the server
+ * answers with a 4 byte HS_ACCEPT or HS_REJECT.  On HS_ACCEPT both sides
+ * key the session from the ticket's secret, the nonce and the server's Y
+ * (see hsResumeKeys): no exponentiation at all, or with HS_RESUME_DH,
+ * one DH between the ephemeral keys, so that the session keys don't
+ * depend on the ticket alone (forward secrecy).  On HS_REJECT the client
+ * sends a full hello and things go on as usual.
+ *
+ * The server issues a ticket after each handshake (resumed or not), in a
+ * control record (see record.h).  It seals the last HS_SECRET_LEN bytes of
+ * the session's key material, which the client must keep to use it. */
+#pragma once
+#include "dh.h"
+#include "util.h"
+#include "ticket.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/** longest integer we accept in a hello (as deserialize_mpz) */
+#define HS_MAX_MPZ 1024
+/** how long to wait (ms) on a quiet peer during hsRun; see xsInit */
+#define HS_TIMEOUT 10000
+/** so a hello is never longer than this */
+#define HS_MAX_HELLO (2*(4 + HS_MAX_MPZ))
+#define HS_RESUME    0x80000000u
+#define HS_RESUME_DH 0x00000001u
+#define HS_ACCEPT    1
+#define HS_REJECT    0
+#define HS_NONCE_LEN 32
+/** resumption secret at the end of the key material */
+#define HS_SECRET_LEN TICKET_SECRET_LEN
+
+/** a client's ticket, and the secret that goes with it */
+typedef struct {
+	unsigned char ticket[TICKET_LEN];
+	unsigned char secret[HS_SECRET_LEN];
+	int valid;              /* there is one to try */
+	int dh;                 /* resume with HS_RESUME_DH */
+	int resumed;            /* set by hsRun: the server took it */
+} hsTicket;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** write the hello K || E to out, which has room for cap bytes.
+ * @return its length, or -1 if it doesn't fit */
+int hsEncode(unsigned char* out, size_t cap, mpz_t K, mpz_t E);
+/** parse a hello from in[0..len), setting K and E (initialized already).
+ * Both must pass G->check.
+ * @return bytes used, 0 if in holds only part of a hello, -1 if it's bad */
+int hsDecode(const dhGroup* G, mpz_t K, mpz_t E, const unsigned char* in,
+		size_t len);
+/** 1 if in[0..len) starts with a resumption hello, 0 if not (or len < 4) */
+int hsIsResume(const unsigned char* in, size_t len);
+/** write a resumption hello to out (cap bytes).  X is NULL for one without
+ * HS_RESUME_DH.  @return its length, or -1 if it doesn't fit */
+int hsEncodeResume(unsigned char* out, size_t cap, const unsigned char* ticket,
+		const unsigned char* nonce, mpz_ptr X);
+/** parse a resumption hello from in[0..len): ticket and nonce are set to
+ * point into in, and X (initialized) is set if *dh is; it must pass
+ * G->check.  @return bytes used, 0 if in holds only part of it, -1 if it's
+ * bad */
+int hsDecodeResume(const dhGroup* G, const unsigned char* in, size_t len,
+		const unsigned char** ticket, const unsigned char** nonce, mpz_t X,
+		int* dh);
+/** key material for a resumed session: HKDF over the ticket's secret (and
+ * dh, dhlen bytes of dhFinalG output, with HS_RESUME_DH), in the context of
+ * the ticket, the client's nonce and the server's ephemeral key Y.
+ * @return 0 on success */
+int hsResumeKeys(const unsigned char* ticket, const unsigned char* secret,
+		const unsigned char* nonce, mpz_t Y, const unsigned char* dh,
+		size_t dhlen, unsigned char* key, size_t keylen);
+/** run the 1:1 handshake over s (a connected socket) and put keylen bytes
+ * of key material in key.  Both sides get the same key whichever end
+ * accepted the connection.  Anything the peer sent after its hello is left
+ * buffered in s, so keep reading from s afterwards.
+ * @param id is our long term key (in group G), or NULL for a fresh one
+ * @param peer, unless NULL, is set to the peer's long term public key, for
+ * checking against a keyStore.  (Anyone else presenting that key can't
+ * derive the same session key, so nothing they send will authenticate.)
+ * @param t, unless NULL, is a ticket to resume with (if t->valid); if the
+ * peer doesn't take it, this is a full handshake after all.  (We don't
+ * issue tickets here, so we turn down any we're offered.)
+ * @param side is set to 0 on one end and 1 on the other (for aeadInit)
+ * @return 0 on success, -1 on failure */
+int hsRun(xstream* s, const dhGroup* G, const dhKey* id, mpz_ptr peer,
+		hsTicket* t, unsigned char* key, size_t keylen, int* side);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE /* O_TMPFILE */
+#include "history.h"
+#include "util.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HIST_HDR 5 /* who, length */
+
+/* an anonymous file in dir, gone once closed */
+static int tmpFile(const char* dir)
+{
+	int fd = open(dir,O_TMPFILE | O_RDWR | O_CLOEXEC,0600);
+	if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) return fd;
+	/* file systems without O_TMPFILE */
+	char path[4096];
+	if (snprintf(path,sizeof(path),"%s/380-chat-XXXXXX",dir) >=
+			(int)sizeof(path))
+		return -1;
+	if ((fd = mkostemp(path,O_CLOEXEC)) >= 0) unlink(path);
+	return fd;
+}
+
+int histOpen(history* h, const char* dir)
+{
+	memset(h,0,sizeof(*h));
+	if (!dir && !(dir = getenv("TMPDIR"))) dir = "/tmp";
+	h->fd = tmpFile(dir);
+	h->ifd = h->fd < 0 ? -1 : tmpFile(dir);
+	if (h->ifd < 0) {
+		if (h->fd >= 0) close(h->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int histFlush(history* h)
+{
+	/* segment first: an index entry never points past what's written */
+	if (h->wlen) {
+		if (xwrite(h->fd,h->wbuf,h->wlen) != 0) return -1;
+		h->wlen = 0;
+	}
+	if (h->ilen) {
+		if (xwrite(h->ifd,h->ibuf,h->ilen*8) != 0) return -1;
+		h->ilen = 0;
+	}
+	return 0;
+}
+
+int histAppend(history* h, int who, const char* text, size_t len)
+{
+	if (len > UINT32_MAX) return -1;
+	if ((h->wlen + HIST_HDR + len > HIST_BUFSIZE || h->ilen == HIST_IDXBUF) &&
+			histFlush(h) != 0)
+		return -1;
+	h->ibuf[h->ilen++] = htole64(h->end);
+	unsigned char hdr[HIST_HDR];
+	uint32_t n = htole32((uint32_t)len);
+	hdr[0] = (unsigned char)who;
+	memcpy(hdr + 1,&n,4);
+	if (HIST_HDR + len > HIST_BUFSIZE) {
+		/* too big to buffer; the buffer is empty now, so in order */
+		if (xwrite(h->fd,hdr,HIST_HDR) != 0 || xwrite(h->fd,text,len) != 0)
+			return -1;
+	} else {
+		memcpy(h->wbuf + h->wlen,hdr,HIST_HDR);
+		memcpy(h->wbuf + h->wlen + HIST_HDR,text,len);
+		h->wlen += HIST_HDR + len;
+	}
+	h->end += HIST_HDR + len;
+	h->n++;
+	return 0;
+}
+
+/* pread all of buf[0..n) from offset off */
+static int preadAll(int fd, void* buf, size_t n, off_t off)
+{
+	unsigned char* p = buf;
+	while (n) {
+		ssize_t r = pread(fd,p,n,off);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		p += r;
+		n -= r;
+		off += r;
+	}
+	return 0;
+}
+
+int histRead(history* h, uint64_t i, uint64_t j, histFn fn, void* arg)
+{
+	if (j > h->n) j = h->n;
+	if (i >= j) return 0;
+	if (histFlush(h) != 0) return -1;
+	/* where i starts, and where j does (or the end) */
+	uint64_t from, to = h->end;
+	if (preadAll(h->ifd,&from,8,i*8) != 0 ||
+			(j < h->n && preadAll(h->ifd,&to,8,j*8) != 0))
+		return -1;
+	from = le64toh(from);
+	if (j < h->n) to = le64toh(to);
+	if (to < from || to > h->end) return -1;
+	unsigned char* buf = malloc(to - from);
+	if (!buf || preadAll(h->fd,buf,to - from,from) != 0) {
+		free(buf);
+		return -1;
+	}
+	int rv = 0;
+	for (size_t off = 0; off < to - from && rv == 0;) {
+		uint32_t n = 0;
+		if (to - from - off >= HIST_HDR) memcpy(&n,buf + off + 1,4);
+		n = le32toh(n);
+		if (to - from - off < HIST_HDR + (uint64_t)n) {
+			rv = -1;
+			break;
+		}
+		rv = fn(arg,buf[off],(const char*)buf + off + HIST_HDR,n);
+		off += HIST_HDR + n;
+	}
+	free(buf);
+	return rv;
+}
+
+void histClose(history* h)
+{
+	if (h->fd >= 0) close(h->fd);
+	if (h->ifd >= 0) close(h->ifd);
+	h->fd = h->ifd = -1;
+}
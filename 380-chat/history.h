@@ -0,0 +1,48 @@
+/* Scrollback that has left the window, on disk.  The GUI keeps only the
+ * most recent messages in its text buffer; every message also goes here,
+ * so older ones can be paged back in when the user scrolls up to them.
+ *
+ * Two files, both unlinked as soon as they are open (so nothing is left
+ * behind, whichever way we exit): the segment, holding each message as
+ * who (1 byte) || length (4 bytes, little endian) || text, and the index,
+ * holding the segment offset of each message as 8 bytes.  Message i is
+ * then two preads away, and nothing is kept in memory per message.
+ * Appends are buffered, and written out when a buffer fills or before a
+ * read. */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIST_BUFSIZE (64 << 10)
+#define HIST_IDXBUF  512
+
+typedef struct {
+	int fd;                 /* segment */
+	int ifd;                /* index */
+	uint64_t n;             /* messages appended */
+	uint64_t end;           /* segment length, buffered bytes included */
+	size_t wlen;            /* in wbuf */
+	size_t ilen;            /* in ibuf */
+	unsigned char wbuf[HIST_BUFSIZE];
+	uint64_t ibuf[HIST_IDXBUF];
+} history;
+
+/** called by histRead for each message */
+typedef int (*histFn)(void* arg, int who, const char* text, size_t len);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** make an empty history with its files in dir (NULL for $TMPDIR, or
+ * /tmp).  They're readable by us alone.  @return 0, or -1 on failure */
+int histOpen(history* h, const char* dir);
+/** add a message (who is up to the caller; 0..255).  @return 0 or -1 */
+int histAppend(history* h, int who, const char* text, size_t len);
+/** call fn for each of messages [i, j), in order, stopping if it returns
+ * nonzero.  They are read with one pread (plus one for the index).
+ * @return 0, fn's nonzero return, or -1 on an error */
+int histRead(history* h, uint64_t i, uint64_t j, histFn fn, void* arg);
+void histClose(history* h);
+#ifdef __cplusplus
+}
+#endif
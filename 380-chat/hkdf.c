@@ -0,0 +1,187 @@
+/* HMAC contexts are expensive to set up from scratch (fetching the digest,
+ * allocating, and hashing the padded key), so each thread keeps:
+ *  - one context keyed with the last salt, for extract.  The salt is
+ *    nearly always the same (hmacsalt), and then EVP_MAC_init with no key
+ *    just restarts from the saved inner/outer states.
+ *  - one spare context for expand, handed to hkdfInit and returned by
+ *    hkdfWipe.  It is rekeyed with each PRK, once per derivation; each
+ *    block after that is a restart as above. */
+#include "hkdf.h"
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/crypto.h>
+#include <pthread.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SALT_MAX 128 /* longer salts are used, but not remembered */
+
+typedef struct {
+	EVP_MAC_CTX* ext;       /* keyed with salt[0..saltlen) if saltKeyed */
+	unsigned char salt[SALT_MAX];
+	size_t saltlen;
+	int saltKeyed;
+	EVP_MAC_CTX* spare;     /* for the next hkdfInit */
+} hkdfThread;
+
+static __thread hkdfThread* ht;
+static pthread_key_t htKey;
+static pthread_once_t htOnce = PTHREAD_ONCE_INIT;
+static EVP_MAC* hmac;
+
+static void freeThread(void* arg)
+{
+	hkdfThread* t = arg;
+	if (!t) return;
+	EVP_MAC_CTX_free(t->ext);
+	EVP_MAC_CTX_free(t->spare);
+	OPENSSL_cleanse(t,sizeof(*t));
+	free(t);
+}
+
+static void initOnce(void)
+{
+	pthread_key_create(&htKey,freeThread);
+	hmac = EVP_MAC_fetch(NULL,"HMAC",NULL);
+}
+
+/* a fresh (unkeyed) HMAC-SHA512 context */
+static EVP_MAC_CTX* newMac(void)
+{
+	if (!hmac) return NULL;
+	EVP_MAC_CTX* m = EVP_MAC_CTX_new(hmac);
+	if (!m) return NULL;
+	OSSL_PARAM params[2] = {
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,"SHA512",0),
+		OSSL_PARAM_construct_end()};
+	if (!EVP_MAC_CTX_set_params(m,params)) {
+		EVP_MAC_CTX_free(m);
+		return NULL;
+	}
+	return m;
+}
+
+static hkdfThread* thread(void)
+{
+	if (ht) return ht;
+	pthread_once(&htOnce,initOnce);
+	hkdfThread* t = calloc(1,sizeof(*t));
+	if (!t) return NULL;
+	if (!(t->ext = newMac())) {
+		free(t);
+		return NULL;
+	}
+	pthread_setspecific(htKey,t);
+	return ht = t;
+}
+
+static int update(EVP_MAC_CTX* m, const hkdfPiece* v, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		if (v[i].len && !EVP_MAC_update(m,v[i].buf,v[i].len)) return -1;
+	return 0;
+}
+
+int hkdfExtract(unsigned char* prk, const void* salt, size_t saltlen,
+		const hkdfPiece* ikm, size_t n)
+{
+	hkdfThread* t = thread();
+	if (!t) return -1;
+	int same = t->saltKeyed && t->saltlen == saltlen &&
+		memcmp(t->salt,salt,saltlen) == 0;
+	if (!EVP_MAC_init(t->ext,same ? NULL : salt,same ? 0 : saltlen,NULL)) {
+		t->saltKeyed = 0;
+		return -1;
+	}
+	if (!same && (t->saltKeyed = (saltlen <= SALT_MAX))) {
+		memcpy(t->salt,salt,saltlen);
+		t->saltlen = saltlen;
+	}
+	size_t outl;
+	if (update(t->ext,ikm,n) != 0 ||
+			!EVP_MAC_final(t->ext,prk,&outl,HKDF_LEN))
+		return -1;
+	return 0;
+}
+
+int hkdfInit(hkdfState* st, const unsigned char* prk, const hkdfPiece* ctx,
+		size_t n)
+{
+	hkdfThread* t = thread();
+	if (!t) return -1;
+	EVP_MAC_CTX* m = t->spare ? t->spare : newMac();
+	if (!m) return -1;
+	t->spare = NULL;
+	if (!EVP_MAC_init(m,prk,HKDF_LEN,NULL)) {
+		EVP_MAC_CTX_free(m);
+		return -1;
+	}
+	st->mac = m;
+	st->ctx = ctx;
+	st->nCtx = n;
+	st->index = 0;
+	memset(st->K,0,HKDF_LEN);
+	st->used = HKDF_LEN; /* nothing left in K */
+	return 0;
+}
+
+/* K = HMAC_{PRK}(K || CTX || index), index++ */
+static int nextBlock(hkdfState* st)
+{
+	EVP_MAC_CTX* m = st->mac;
+	uint64_t indexBE = htobe64(st->index);
+	size_t outl;
+	if (!EVP_MAC_init(m,NULL,0,NULL) ||
+			!EVP_MAC_update(m,st->K,HKDF_LEN) ||
+			update(m,st->ctx,st->nCtx) != 0 ||
+			!EVP_MAC_update(m,(unsigned char*)&indexBE,sizeof(indexBE)) ||
+			!EVP_MAC_final(m,st->K,&outl,HKDF_LEN))
+		return -1;
+	st->index++;
+	st->used = 0;
+	return 0;
+}
+
+int hkdfExpand(hkdfState* st, unsigned char* out, size_t len)
+{
+	while (len) {
+		if (st->used == HKDF_LEN && nextBlock(st) != 0) return -1;
+		size_t n = HKDF_LEN - st->used;
+		if (n > len) n = len;
+		memcpy(out,st->K + st->used,n);
+		st->used += n;
+		out += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void hkdfWipe(hkdfState* st)
+{
+	hkdfThread* t = ht;
+	EVP_MAC_CTX* m = st->mac;
+	if (m) {
+		/* NOTE: m holds PRK's key schedule until the next hkdfInit rekeys
+		 * it (or freeThread frees it). */
+		if (t && !t->spare) t->spare = m;
+		else EVP_MAC_CTX_free(m);
+	}
+	OPENSSL_cleanse(st,sizeof(*st));
+}
+
+int hkdf(unsigned char* out, size_t len, const void* salt, size_t saltlen,
+		const hkdfPiece* ikm, size_t nIkm, const hkdfPiece* ctx, size_t nCtx)
+{
+	unsigned char prk[HKDF_LEN];
+	hkdfState st;
+	int rv = -1;
+	if (hkdfExtract(prk,salt,saltlen,ikm,nIkm) != 0) goto end;
+	if (hkdfInit(&st,prk,ctx,nCtx) != 0) goto end;
+	rv = hkdfExpand(&st,out,len);
+	hkdfWipe(&st);
+end:
+	OPENSSL_cleanse(prk,sizeof(prk));
+	return rv;
+}
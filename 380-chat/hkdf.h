@@ -0,0 +1,55 @@
+/* HKDF with HMAC-SHA512, as used by dhFinal and dh3Final:
+ *   PRK  = HMAC_{salt}(IKM)
+ *   K(0) = HMAC_{PRK}(0^64 || CTX || 0)
+ *   K(i) = HMAC_{PRK}(K(i-1) || CTX || i)   (i as 8 bytes, big endian)
+ * and the output is K(0) || K(1) || ...
+ * IKM and CTX are given as lists of pieces, which are hashed where they are
+ * rather than copied together first.  HMAC contexts are kept per thread and
+ * reused, so after the first call on a thread nothing is allocated. */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/** bytes of output per HMAC (sha512) */
+#define HKDF_LEN 64
+
+/** a piece of IKM or CTX; pieces are concatenated in order */
+typedef struct {
+	const void* buf;
+	size_t len;
+} hkdfPiece;
+
+/** state of one expansion.  Lives wherever the caller likes (the stack,
+ * usually); the pieces of CTX must stay put until hkdfWipe. */
+typedef struct {
+	void* mac;              /* HMAC keyed with PRK (an EVP_MAC_CTX) */
+	const hkdfPiece* ctx;
+	size_t nCtx;
+	uint64_t index;         /* of the next block */
+	unsigned char K[HKDF_LEN]; /* current block (zeros before the first) */
+	size_t used;            /* bytes of K already handed out */
+} hkdfState;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** prk = HMAC_{salt}(ikm[0] || ... || ikm[n-1]).  prk gets HKDF_LEN bytes.
+ * @return 0 on success, -1 on failure */
+int hkdfExtract(unsigned char* prk, const void* salt, size_t saltlen,
+		const hkdfPiece* ikm, size_t n);
+/** start expanding prk (HKDF_LEN bytes) with context ctx[0] || ... ||
+ * ctx[n-1].  @return 0 on success, -1 on failure (nothing to wipe) */
+int hkdfInit(hkdfState* st, const unsigned char* prk, const hkdfPiece* ctx,
+		size_t n);
+/** write the next len bytes of output to out.  Calls may be split anywhere:
+ * two calls for 10 and 90 bytes give the same 100 bytes as one call.
+ * @return 0 on success, -1 on failure */
+int hkdfExpand(hkdfState* st, unsigned char* out, size_t len);
+/** erase st and give its HMAC context back for reuse */
+void hkdfWipe(hkdfState* st);
+/** convenience: extract, then expand len bytes into out */
+int hkdf(unsigned char* out, size_t len, const void* salt, size_t saltlen,
+		const hkdfPiece* ikm, size_t nIkm, const hkdfPiece* ctx, size_t nCtx);
+#ifdef __cplusplus
+}
+#endif
@@ -4,8 +4,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "util.h"
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 
 int initKey(dhKey* k)
 {
@@ -20,24 +25,173 @@ int initKey(dhKey* k)
 int shredKey(dhKey* k)
 {
 	assert(k);
-	size_t nLimbs = mpz_size(k->SK);
-	memset(mpz_limbs_write(k->SK,nLimbs),0,nLimbs*sizeof(mp_limb_t));
+	shredZ(k->SK);
 	mpz_clear(k->SK);
-	nLimbs = mpz_size(k->PK);
-	memset(mpz_limbs_write(k->PK,nLimbs),0,nLimbs*sizeof(mp_limb_t));
+	shredZ(k->PK);
 	mpz_clear(k->PK);
 	memset(k->name,0,MAX_NAME);
 	return 0;
 }
 
-/* straightforward, lazy key format:
+/* Binary key format (every field little endian):
+ *   +---------------------------------------+
+ *   | keyHdr (64 bytes)                     |
+ *   +---------------------------------------+
+ *   | name (nameLen bytes, no \0), padded   |
+ *   | with zeros to a multiple of 8 bytes   |
+ *   +---------------------------------------+
+ *   | PK (nPK 64 bit words)                 |
+ *   | SK (nSK 64 bit words; 0 in .pub)      |
+ *   +---------------------------------------+
+ * The integers are little endian 64 bit limbs, which on x86-64 and the
+ * like is how GMP keeps them, so loading is a copy out of the mapping
+ * rather than a base conversion.  The digest is SHA256 over the header
+ * (with the digest zeroed) and everything after it. */
+#define KEY_MAGIC   "DHKEYBIN"
+#define KEY_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t nameLen;
+	uint32_t nPK, nSK;
+	uint32_t reserved[2];
+	unsigned char digest[32];
+} keyHdr;
+
+#define KEY_PAD(n) (((n) + 7) & ~(size_t)7)
+
+/* the 64 bit little endian words of x, in a fresh buffer of *n words */
+static uint64_t* toWords(mpz_t x, uint32_t* n)
+{
+	*n = (mpz_sizeinbase(x,2) + 63) / 64;
+	if (mpz_sgn(x) == 0) *n = 0;
+	uint64_t* w = calloc(*n ? *n : 1,8);
+	if (w && *n) mpz_export(w,NULL,-1,8,-1,0,x);
+	return w;
+}
+
+static void fromWords(mpz_t x, const uint64_t* w, uint32_t n)
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN && GMP_LIMB_BITS == 64
+	mpz_t ro;
+	mpz_set(x,mpz_roinit_n(ro,(const mp_limb_t*)w,n));
+#else
+	mpz_import(x,n,-1,8,-1,0,w);
+#endif
+}
+
+static void keyDigest(unsigned char* digest, const keyHdr* h,
+		const unsigned char* body, size_t blen)
+{
+	keyHdr z = *h;
+	memset(z.digest,0,sizeof(z.digest));
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx,EVP_sha256(),NULL);
+	EVP_DigestUpdate(ctx,&z,sizeof(z));
+	EVP_DigestUpdate(ctx,body,blen);
+	EVP_DigestFinal_ex(ctx,digest,NULL);
+	EVP_MD_CTX_free(ctx);
+}
+
+/* write k (SK too, if withSK) to fd in the binary format, and close fd */
+static int writeBin(int fd, dhKey* k, int withSK)
+{
+	keyHdr h;
+	uint32_t nPK, nSK = 0;
+	memset(&h,0,sizeof(h));
+	size_t nameLen = strnlen(k->name,MAX_NAME);
+	uint64_t* pk = toWords(k->PK,&nPK);
+	uint64_t* sk = withSK ? toWords(k->SK,&nSK) : NULL;
+	size_t len = sizeof(h) + KEY_PAD(nameLen) + 8*((size_t)nPK + nSK);
+	unsigned char* out = calloc(1,len);
+	int rv = -1;
+	if (pk && (sk || !withSK) && out) {
+		unsigned char* body = out + sizeof(h);
+		memcpy(body,k->name,nameLen);
+		body += KEY_PAD(nameLen);
+		memcpy(body,pk,8*(size_t)nPK);
+		if (nSK) memcpy(body + 8*(size_t)nPK,sk,8*(size_t)nSK);
+		memcpy(h.magic,KEY_MAGIC,sizeof(h.magic));
+		h.version = htole32(KEY_VERSION);
+		h.nameLen = htole32(nameLen);
+		h.nPK = htole32(nPK);
+		h.nSK = htole32(nSK);
+		keyDigest(h.digest,&h,out + sizeof(h),len - sizeof(h));
+		memcpy(out,&h,sizeof(h));
+		rv = xwrite(fd,out,len); /* one write for the lot */
+	}
+	if (close(fd) != 0) rv = -1;
+	if (sk) memset(sk,0,8*(size_t)nSK);
+	if (out) memset(out,0,len);
+	free(sk);
+	free(pk);
+	free(out);
+	return rv;
+}
+
+/* k from a mapped binary key file */
+static int readBin(const unsigned char* m, size_t len, dhKey* k)
+{
+	keyHdr h;
+	if (len < sizeof(h)) return -2;
+	memcpy(&h,m,sizeof(h));
+	if (memcmp(h.magic,KEY_MAGIC,sizeof(h.magic)) != 0 ||
+			le32toh(h.version) != KEY_VERSION) return -2;
+	size_t nameLen = le32toh(h.nameLen);
+	size_t nPK = le32toh(h.nPK), nSK = le32toh(h.nSK);
+	if (nameLen > MAX_NAME || nPK > len / 8 || nSK > len / 8 ||
+			sizeof(h) + KEY_PAD(nameLen) + 8*(nPK + nSK) != len) return -2;
+	const unsigned char* body = m + sizeof(h);
+	unsigned char digest[32];
+	keyDigest(digest,&h,body,len - sizeof(h));
+	if (memcmp(digest,h.digest,sizeof(digest)) != 0) return -2;
+	memcpy(k->name,body,nameLen);
+	k->name[nameLen] = 0;
+	const uint64_t* w = (const uint64_t*)(body + KEY_PAD(nameLen));
+	fromWords(k->PK,w,nPK);
+	fromWords(k->SK,w + nPK,nSK);
+	return 0;
+}
+
+/* text key format (for import/export):
  * name:<name...>
  * pk:<base 10 rep of A>
  * sk:<base 10 rep of a>
  * (where A = g^a)
  * */
 
-int writeDH(char* fname, dhKey* k)
+/* as writeBin, in the text format */
+static int writeText(int fd, dhKey* k, int withSK)
+{
+	FILE* f = fdopen(fd,"wb");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+	fprintf(f, "name:%s\n", k->name);
+	gmp_fprintf(f, "pk:%Zd\n", k->PK);
+	if (withSK) gmp_fprintf(f, "sk:%Zd\n", k->SK);
+	else fprintf(f, "sk:0\n");
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+static int readText(FILE* f, dhKey* k)
+{
+	/* the name is the rest of the line, spaces and all */
+	char line[MAX_NAME + 8];
+	if (!fgets(line,sizeof(line),f) || strncmp(line,"name:",5) != 0)
+		return -2;
+	line[strcspn(line,"\n")] = 0;
+	strncpy(k->name,line + 5,MAX_NAME);
+	k->name[MAX_NAME] = 0; /* make sure it's a c-string */
+	if (gmp_fscanf(f,"pk:%Zd\n",k->PK) != 1) return -2;
+	if (gmp_fscanf(f,"sk:%Zd\n",k->SK) != 1) return -2;
+	return 0;
+}
+
+/* write the key file(s) for k with the given writer (binary or text) */
+static int writeKeys(char* fname, dhKey* k, int (*put)(int,dhKey*,int))
 {
 	assert(k);
 	/* NOTE if fname was already PATH_MAX-3 or longer, the name will be
@@ -52,62 +206,75 @@ int writeDH(char* fname, dhKey* k)
 	strncat(fnamepub,".pub",PATH_MAX);
 	/* when saving secret key, make sure file isn't world-readable */
 	int fd;
-	FILE* f;
 	if (mpz_cmp_ui(k->SK,0)) { /* SK present so write it */
-		fd = open(fname,O_RDWR|O_CREAT|O_TRUNC,0600);
-		f = fdopen(fd,"wb");
-		if (!f) return -1;
-		fprintf(f, "name:%s\n", k->name);
-		gmp_fprintf(f, "pk:%Zd\n", k->PK);
-		gmp_fprintf(f, "sk:%Zd\n", k->SK);
-		fclose(f);
+		fd = open(fname,O_WRONLY|O_CREAT|O_TRUNC,0600);
+		if (fd < 0 || put(fd,k,1) != 0) return -1;
 	}
-	f = fopen(fnamepub,"wb");
-	if (!f) return -1;
-	fprintf(f, "name:%s\n", k->name);
-	gmp_fprintf(f, "pk:%Zd\n", k->PK);
-	fprintf(f, "sk:0\n");
-	fclose(f);
-	return 0;
+	fd = open(fnamepub,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if (fd < 0) return -1;
+	return put(fd,k,0);
+}
+
+int writeDH(char* fname, dhKey* k)
+{
+	return writeKeys(fname,k,writeBin);
+}
+
+int writeDHText(char* fname, dhKey* k)
+{
+	return writeKeys(fname,k,writeText);
 }
 
 int readDH(char* fname, dhKey* k)
 {
 	assert(k);
 	initKey(k);
-	FILE* f = fopen(fname,"rb");
-	if (!f) return -1;
-	int rv = 0;
-	char* name;
-	/* TODO %ms might not be portable?  Also might not read spaces. */
-	if (fscanf(f,"name:%ms\n",&name) != 1) {
-		rv = -2;
-		goto end;
+	int fd = open(fname,O_RDONLY);
+	if (fd < 0) return -1;
+	struct stat st;
+	if (fstat(fd,&st) != 0) {
+		close(fd);
+		return -1;
 	}
-	strncpy(k->name,name,MAX_NAME);
-	k->name[MAX_NAME] = 0; /* make sure it's a c-string */
-	free(name);
-	if (gmp_fscanf(f,"pk:%Zd\n",k->PK) != 1) {
-		rv = -2;
-		goto end;
+	if (st.st_size >= (off_t)sizeof(keyHdr)) {
+		unsigned char* m = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if (m != MAP_FAILED && memcmp(m,KEY_MAGIC,8) == 0) {
+			close(fd);
+			int rv = readBin(m,st.st_size,k);
+			munmap(m,st.st_size);
+			return rv;
+		}
+		if (m != MAP_FAILED) munmap(m,st.st_size);
 	}
-	if (gmp_fscanf(f,"sk:%Zd\n",k->SK) != 1) {
-		rv = -2;
-		goto end;
+	/* not binary, so it's the text format */
+	FILE* f = fdopen(fd,"rb");
+	if (!f) {
+		close(fd);
+		return -1;
 	}
-end:
+	int rv = readText(f,k);
 	fclose(f);
 	return rv;
 }
 
+unsigned char* fingerprintPK(mpz_t PK, unsigned char* fp)
+{
+	unsigned char buf[4096];
+	size_t nB = mpz_sizeinbase(PK,256);
+	unsigned char* b = (nB <= sizeof(buf)) ? buf : malloc(nB);
+	if (!b) return NULL;
+	Z2BYTES(b,&nB,PK); /* nB = 0 for PK == 0, as it always has been */
+	SHA256(b,nB,fp);
+	if (b != buf) free(b);
+	return fp;
+}
+
 char* hashPK(dhKey* k, char* hash)
 {
 	assert(k);
 	const size_t hlen = 32; /* byte len of binary hash */
 	unsigned char H[hlen]; /* buffer for binary hash */
-	size_t nB;
-	unsigned char* buf = Z2BYTES(NULL,&nB,k->PK);
-	SHA256(buf,nB,H);
+	fingerprintPK(k->PK,H);
 	char hc[17] = "0123456789abcdef";
 	if (!hash) hash = malloc(2*hlen);
 	for (size_t i = 0; i < 2*hlen; i++) {
@@ -17,10 +17,15 @@ typedef struct {
 int initKey(dhKey* k);
 /** writes 1 or two files, depending on whether or not the secret key is
  * present in the key struct.  Using the ssh convention, the public key will be
- * in fname.pub, secret key (if available) will be in fname. */
+ * in fname.pub, secret key (if available) will be in fname.  The files are
+ * in the binary format (see keys.c), which loads without base conversion. */
 int writeDH(char* fname, dhKey* k);
+/** as writeDH, but in the old name:/pk:/sk: text format, for export */
+int writeDHText(char* fname, dhKey* k);
 /* this will read either a public or private key, storing result in *k.
- * Public keys will have the SK field set to 0. */
+ * Public keys will have the SK field set to 0.  Either format is accepted
+ * (the binary one is mapped, not read).  @return 0 on success, -1 if the
+ * file can't be opened, -2 if it's malformed or damaged. */
 int readDH(char* fname, dhKey* k);
 /** zero memory for key */
 int shredKey(dhKey* k);
@@ -31,3 +36,6 @@ int shredKey(dhKey* k);
  * @return pointer to a buffer containing the hash.  This will either
  * be the input parameter hash, or a newly allocated buffer if hash==NULL. */
 char* hashPK(dhKey* k, char* hash);
+/** the hash behind hashPK, in binary: 32 bytes at fp.
+ * @return fp, or NULL if out of memory */
+unsigned char* fingerprintPK(mpz_t PK, unsigned char* fp);
@@ -0,0 +1,351 @@
+/* Key store file format:
+ *   +-------------------------------------------------------+
+ *   | "DHKSTORE" | version (4 bytes) | reserved (4 bytes)   |
+ *   +-------------------------------------------------------+
+ *   | record | record | ...                                 |
+ *   +-------------------------------------------------------+
+ * and a record is
+ *   | len (4 bytes) | body (len bytes) | check (4 bytes)   |
+ * where check is FNV-1a over the body (it's there to find a torn append,
+ * not to stop anyone: the keys are public, and who may edit the file is up
+ * to its permissions), and the body is one of
+ *   | '+' | name length (1 byte) | name | PK (serialize_mpz format) |
+ *   | '-' | fingerprint (32 bytes) |
+ * All integers are little endian.  Loading replays the records in order. */
+#include "keystore.h"
+#include "util.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#define KS_MAGIC   "DHKSTORE"
+#define KS_VERSION 1
+#define KS_HDR     16
+#define KS_MAX_PK  1024  /* bytes, as for deserialize_mpz */
+#define KS_MAX_REC (2 + MAX_NAME + 4 + KS_MAX_PK)
+
+static uint32_t fnv1a(const unsigned char* p, size_t n)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+/* table */
+
+/* the fingerprint is a hash already, so its first bytes do for the index */
+static size_t home(const keyStore* ks, const unsigned char* fp)
+{
+	uint64_t h;
+	memcpy(&h,fp,sizeof(h));
+	return h & (ks->nSlots - 1);
+}
+
+/* the slot holding fp, or the empty one where it would go */
+static size_t probe(const keyStore* ks, const unsigned char* fp)
+{
+	size_t i = home(ks,fp);
+	while (ks->slots[i] &&
+			memcmp(ks->entries[ks->slots[i] - 1].fp,fp,KS_FP_LEN) != 0)
+		i = (i + 1) & (ks->nSlots - 1);
+	return i;
+}
+
+static int grow(keyStore* ks)
+{
+	size_t nSlots = ks->nSlots ? 2*ks->nSlots : 64;
+	uint32_t* slots = calloc(nSlots,sizeof(uint32_t));
+	if (!slots) return -1;
+	free(ks->slots);
+	ks->slots = slots;
+	ks->nSlots = nSlots;
+	for (size_t e = 0; e < ks->n; e++)
+		ks->slots[probe(ks,ks->entries[e].fp)] = e + 1;
+	return 0;
+}
+
+/* room for one more entry */
+static int reserve(keyStore* ks)
+{
+	if (2*(ks->n + 1) > ks->nSlots && grow(ks) != 0) return -1;
+	if (ks->n == ks->cap) {
+		size_t cap = ks->cap ? 2*ks->cap : 64;
+		ksEntry* v = realloc(ks->entries,cap*sizeof(ksEntry));
+		if (!v) return -1;
+		ks->entries = v;
+		ks->cap = cap;
+	}
+	return 0;
+}
+
+/* add or rename, in memory.  @return 1 if it was a rename, 0 if new, -1 */
+static int put(keyStore* ks, const unsigned char* fp, const char* name,
+		size_t nameLen, mpz_t PK)
+{
+	if (reserve(ks) != 0) return -1;
+	size_t i = probe(ks,fp);
+	ksEntry* e = ks->slots[i] ? &ks->entries[ks->slots[i] - 1] :
+		&ks->entries[ks->n];
+	memcpy(e->name,name,nameLen);
+	e->name[nameLen] = 0;
+	if (ks->slots[i]) return 1;
+	memcpy(e->fp,fp,KS_FP_LEN);
+	mpz_init_set(e->PK,PK);
+	ks->slots[i] = ++ks->n;
+	return 0;
+}
+
+/* remove, in memory.  @return 0, or -1 if fp isn't there */
+static int drop(keyStore* ks, const unsigned char* fp)
+{
+	if (!ks->nSlots) return -1;
+	size_t i = probe(ks,fp);
+	if (!ks->slots[i]) return -1;
+	size_t e = ks->slots[i] - 1;
+	/* fill the hole in the table by shifting back what probed past it, so
+	 * lookups never need tombstones */
+	size_t mask = ks->nSlots - 1;
+	for (size_t j = (i + 1) & mask; ks->slots[j]; j = (j + 1) & mask) {
+		size_t h = home(ks,ks->entries[ks->slots[j] - 1].fp);
+		/* can slot j's entry move to i?  yes unless h lies in (i,j] */
+		if (((j - h) & mask) >= ((j - i) & mask)) {
+			ks->slots[i] = ks->slots[j];
+			i = j;
+		}
+	}
+	ks->slots[i] = 0;
+	/* and the hole in entries with the last one */
+	mpz_clear(ks->entries[e].PK);
+	if (e != ks->n - 1) {
+		ks->entries[e] = ks->entries[ks->n - 1];
+		ks->slots[probe(ks,ks->entries[e].fp)] = e + 1;
+	}
+	ks->n--;
+	return 0;
+}
+
+const ksEntry* ksFind(const keyStore* ks, const unsigned char* fp)
+{
+	if (!ks->nSlots) return NULL;
+	uint32_t s = ks->slots[probe(ks,fp)];
+	return s ? &ks->entries[s - 1] : NULL;
+}
+
+const ksEntry* ksFindPK(const keyStore* ks, mpz_t PK)
+{
+	unsigned char fp[KS_FP_LEN];
+	if (!fingerprintPK(PK,fp)) return NULL;
+	const ksEntry* e = ksFind(ks,fp);
+	/* fingerprints are SHA256, but a lookup is cheap to make certain of */
+	return (e && mpz_cmp(e->PK,PK) == 0) ? e : NULL;
+}
+
+/* log */
+
+/* record for adding PK under name, at rec.  @return its length, or -1 */
+static int addRecord(unsigned char* rec, const char* name, size_t nameLen,
+		mpz_t PK)
+{
+	unsigned char* body = rec + 4;
+	mpz_ptr v[1] = {PK};
+	if (nameLen > MAX_NAME || mpz_sizeinbase(PK,256) > KS_MAX_PK) return -1;
+	body[0] = '+';
+	body[1] = nameLen;
+	memcpy(body + 2,name,nameLen);
+	size_t len = 2 + nameLen;
+	len += serialize_mpzv(body + len,KS_MAX_REC - len,v,1);
+	LE(len);
+	memcpy(rec,&len_le,4);
+	uint32_t check = htole32(fnv1a(body,len));
+	memcpy(body + len,&check,4);
+	return 4 + len + 4;
+}
+
+/* a store opened without a file (ksOpen(ks,NULL)) has nothing to write;
+ * one that lost its file mustn't pretend it still has one */
+static int append(keyStore* ks, const unsigned char* rec, size_t n)
+{
+	if (ks->fd < 0) return ks->path ? -1 : 0;
+	return xwrite(ks->fd,rec,n);
+}
+
+/* apply the record body[0..len) */
+static int replay(keyStore* ks, const unsigned char* body, size_t len)
+{
+	if (len == 1 + KS_FP_LEN && body[0] == '-') {
+		if (drop(ks,body + 1) != 0) return -1;
+		ks->dead += 2; /* this and the add it undid */
+		return 0;
+	}
+	if (len < 2 || body[0] != '+' || body[1] > MAX_NAME ||
+			len < 2 + (size_t)body[1]) return -1;
+	size_t nameLen = body[1];
+	NEWZ(PK);
+	mpz_ptr v[1] = {PK};
+	unsigned char fp[KS_FP_LEN];
+	int rv = -1;
+	if (deserialize_mpzv(v,1,body + 2 + nameLen,len - 2 - nameLen,KS_MAX_PK)
+			== (ssize_t)(len - 2 - nameLen) && fingerprintPK(PK,fp)) {
+		rv = put(ks,fp,(const char*)body + 2,nameLen,PK);
+		if (rv == 1) ks->dead++; /* the rename makes the old add dead */
+	}
+	mpz_clear(PK);
+	return rv < 0 ? -1 : 0;
+}
+
+/* replay the log in m[0..len).  @return how much of it was good */
+static size_t load(keyStore* ks, const unsigned char* m, size_t len)
+{
+	size_t off = KS_HDR;
+	while (len - off >= 8) {
+		uint32_t n_le, check;
+		memcpy(&n_le,m + off,4);
+		size_t n = le32toh(n_le);
+		if (n > KS_MAX_REC || len - off - 8 < n) break;
+		memcpy(&check,m + off + 4 + n,4);
+		if (le32toh(check) != fnv1a(m + off + 4,n) ||
+				replay(ks,m + off + 4,n) != 0) break;
+		off += 8 + n;
+	}
+	return off;
+}
+
+static int writeHeader(int fd)
+{
+	unsigned char hdr[KS_HDR] = KS_MAGIC;
+	uint32_t v = htole32(KS_VERSION);
+	memcpy(hdr + 8,&v,4);
+	return xwrite(fd,hdr,KS_HDR);
+}
+
+int ksOpen(keyStore* ks, const char* fname)
+{
+	memset(ks,0,sizeof(*ks));
+	ks->fd = -1;
+	if (!fname) return 0;
+	if (!(ks->path = strdup(fname))) return -1;
+	ks->fd = open(fname,O_RDWR|O_CREAT|O_APPEND,0644);
+	struct stat st;
+	if (ks->fd < 0 || fstat(ks->fd,&st) != 0) goto fail;
+	if (st.st_size == 0) {
+		if (writeHeader(ks->fd) != 0) goto fail;
+		return 0;
+	}
+	if (st.st_size < KS_HDR) goto fail;
+	unsigned char* m = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,ks->fd,0);
+	if (m == MAP_FAILED) goto fail;
+	uint32_t v;
+	memcpy(&v,m + 8,4);
+	if (memcmp(m,KS_MAGIC,8) != 0 || le32toh(v) != KS_VERSION) {
+		munmap(m,st.st_size);
+		errno = EINVAL;
+		goto fail;
+	}
+	size_t good = load(ks,m,st.st_size);
+	munmap(m,st.st_size);
+	if (good != (size_t)st.st_size) {
+		fprintf(stderr, "%s: dropping %zu damaged bytes at the end\n",
+				fname,(size_t)st.st_size - good);
+		if (ftruncate(ks->fd,good) != 0) goto fail;
+	}
+	/* a failed compaction leaves the old log in place, which is fine */
+	if (ks->dead > 64 && ks->dead > ks->n && ksCompact(ks) != 0 && ks->fd < 0)
+		goto fail;
+	return 0;
+fail:
+	ksClose(ks);
+	return -1;
+}
+
+int ksAdd(keyStore* ks, const char* name, mpz_t PK)
+{
+	unsigned char rec[4 + KS_MAX_REC + 4];
+	unsigned char fp[KS_FP_LEN];
+	size_t nameLen = strnlen(name,MAX_NAME + 1);
+	if (!fingerprintPK(PK,fp)) return -1;
+	const ksEntry* e = ksFind(ks,fp);
+	if (e && strcmp(e->name,name) == 0) return 0;
+	int n = addRecord(rec,name,nameLen,PK);
+	/* make room first, so that put can't fail once the record is logged */
+	if (n < 0 || reserve(ks) != 0 || append(ks,rec,n) != 0) return -1;
+	if (put(ks,fp,name,nameLen,PK) == 1) ks->dead++;
+	return 0;
+}
+
+int ksRemove(keyStore* ks, const unsigned char* fp)
+{
+	unsigned char rec[4 + 1 + KS_FP_LEN + 4];
+	if (!ksFind(ks,fp)) return -1;
+	uint32_t len = htole32(1 + KS_FP_LEN);
+	memcpy(rec,&len,4);
+	rec[4] = '-';
+	memcpy(rec + 5,fp,KS_FP_LEN);
+	uint32_t check = htole32(fnv1a(rec + 4,1 + KS_FP_LEN));
+	memcpy(rec + 5 + KS_FP_LEN,&check,4);
+	if (append(ks,rec,sizeof(rec)) != 0) return -1;
+	drop(ks,fp);
+	ks->dead += 2;
+	return 0;
+}
+
+int ksSync(keyStore* ks)
+{
+	if (ks->fd < 0) return ks->path ? -1 : 0;
+	return fdatasync(ks->fd);
+}
+
+int ksCompact(keyStore* ks)
+{
+	if (ks->fd < 0) return ks->path ? -1 : 0;
+	char tmp[PATH_MAX];
+	if (snprintf(tmp,sizeof(tmp),"%s.tmp",ks->path) >= (int)sizeof(tmp))
+		return -1;
+	/* opened for appending, as it will be once it's the log; this fd
+	 * becomes ks->fd, so there's no reopening (that could fail) after the
+	 * rename */
+	int fd = open(tmp,O_RDWR|O_CREAT|O_TRUNC|O_APPEND,0644);
+	if (fd < 0) return -1;
+	/* one write per 64K or so */
+	xstream* out = malloc(sizeof(xstream));
+	int rv = out ? writeHeader(fd) : -1;
+	if (out) xsInit(out,fd,-1);
+	for (size_t i = 0; i < ks->n && rv == 0; i++) {
+		unsigned char rec[4 + KS_MAX_REC + 4];
+		const ksEntry* e = &ks->entries[i];
+		int n = addRecord(rec,e->name,strlen(e->name),(mpz_ptr)e->PK);
+		rv = (n < 0) ? -1 : xsWrite(out,rec,n);
+	}
+	if (rv == 0) rv = xsFlush(out);
+	free(out);
+	if (rv == 0) rv = fsync(fd);
+	if (rv == 0) rv = rename(tmp,ks->path);
+	if (rv != 0) {
+		/* the old log is untouched, and still ks->fd */
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	/* the old fd is for the file we just replaced */
+	close(ks->fd);
+	ks->fd = fd;
+	ks->dead = 0;
+	return 0;
+}
+
+void ksClose(keyStore* ks)
+{
+	for (size_t i = 0; i < ks->n; i++) mpz_clear(ks->entries[i].PK);
+	free(ks->entries);
+	free(ks->slots);
+	free(ks->path);
+	if (ks->fd >= 0) close(ks->fd);
+	memset(ks,0,sizeof(*ks));
+	ks->fd = -1;
+}
@@ -0,0 +1,57 @@
+/* A store of peers' long term public keys, indexed by fingerprint (the
+ * binary form of hashPK), for checking who is on the other end of a
+ * handshake.  Lookups are a probe of an open addressing table held in
+ * memory, with the keys already parsed; the file behind the store is a log
+ * that each change appends one record to, so adding a peer doesn't rewrite
+ * the others. */
+#pragma once
+#include "keys.h"
+#include <gmp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KS_FP_LEN 32
+
+typedef struct {
+	unsigned char fp[KS_FP_LEN];
+	char name[MAX_NAME+1];
+	mpz_t PK;
+} ksEntry;
+
+typedef struct {
+	ksEntry* entries;       /* in no particular order */
+	size_t n, cap;
+	uint32_t* slots;        /* index into entries + 1, or 0 if empty */
+	size_t nSlots;          /* a power of 2, at least twice n */
+	int fd;                 /* the log, or -1 if the store is memory only */
+	char* path;
+	size_t dead;            /* records in the log that have been undone */
+} keyStore;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** load the store in fname, creating it if need be (NULL: keep it in
+ * memory only).  A damaged tail (from a crash mid-append, say) is cut off.
+ * @return 0, or -1 if the file can't be opened or isn't a key store */
+int ksOpen(keyStore* ks, const char* fname);
+/** the entry with fingerprint fp, or NULL */
+const ksEntry* ksFind(const keyStore* ks, const unsigned char* fp);
+/** the entry for public key PK, or NULL */
+const ksEntry* ksFindPK(const keyStore* ks, mpz_t PK);
+/** add PK under name (replacing the name if PK is there already).
+ * @return 0, or -1 on an error (the store is unchanged) */
+int ksAdd(keyStore* ks, const char* name, mpz_t PK);
+/** drop the key with fingerprint fp.  @return 0, or -1 if there's no such
+ * key or the log can't be written */
+int ksRemove(keyStore* ks, const unsigned char* fp);
+/** make the changes so far durable.  @return 0 on success */
+int ksSync(keyStore* ks);
+/** rewrite the log with one record per key.  ksOpen does this when most of
+ * the log is dead.  @return 0 on success; on failure the old log is left
+ * as it was, and still backs the store */
+int ksCompact(keyStore* ks);
+void ksClose(keyStore* ks);
+#ifdef __cplusplus
+}
+#endif
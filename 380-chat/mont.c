@@ -0,0 +1,624 @@
+/* Montgomery multiplication and exponentiation for the fixed DH modulus.
+ *
+ * Two kernels:
+ *  - scalar: radix 2^64, R = 2^(64n) for an n limb modulus.  Products come
+ *    from mpn_mul_n/mpn_sqr and are reduced with word-by-word REDC, giving
+ *    fully reduced results in [0,m).
+ *  - avx512ifma: radix 2^52, 80 digits held in ten zmm registers, so it is
+ *    only built for 4096-bit class moduli (4033..4158 bits) and only when
+ *    the compiler targets AVX-512 IFMA (e.g. -march=native on a CPU that has
+ *    it).  This is "almost Montgomery" multiplication: with R = 2^4160 > 4m,
+ *    inputs < 2m give outputs < 2m, and we only fully reduce in montToZ.
+ * Which one is used is decided at montSetup, and can be changed (for
+ * benchmarking) with montUseSimd.
+ *
+ * With the avx512ifma kernel, montPowmN also has a lane-parallel version
+ * for batches: eight independent exponentiations, each in its own 64-bit
+ * lane, with elements stored transposed (vector j holds digit j of all
+ * eight).  That needs no shuffles between lanes, and a multiplication
+ * does about as many IFMAs as the single kernel, but for eight products. */
+#include "mont.h"
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "util.h"
+#if defined(__AVX512F__) && defined(__AVX512IFMA__)
+#include <immintrin.h>
+#define HAVE_IFMA 1
+/* keep the ten accumulators in registers */
+#define UNROLL _Pragma("GCC unroll 10")
+#endif
+
+#define MASK52 ((1ULL << 52) - 1)
+#define IFMA_DIGITS 80 /* 52-bit digits per element */
+#define IFMA_VECS (IFMA_DIGITS / 8)
+#define LANES 8 /* exponentiations per batch in montPowmN */
+#define POWM_W 5 /* window size for montPowm */
+
+static struct {
+	int ready;
+	int simd;                  /* using the IFMA kernel? */
+	unsigned epoch;
+	size_t n;                  /* limbs of m */
+	size_t words;              /* words per element for the current kernel */
+	int haveM;                 /* has m been initialized? */
+	mpz_t m;
+	mp_limb_t mLimbs[MONT_MAX_WORDS];
+	mp_limb_t minvN[MONT_MAX_WORDS]; /* -m^-1 mod R */
+	uint64_t r2[MONT_MAX_WORDS]; /* R^2 mod m, in the current kernel's layout */
+	uint64_t one[MONT_MAX_WORDS]; /* R mod m */
+#ifdef HAVE_IFMA
+	uint64_t m52[IFMA_DIGITS]; /* m in radix 2^52 */
+	uint64_t k52;              /* -m^-1 mod 2^52 */
+#endif
+} mc;
+
+/* -x^-1 mod 2^64 for odd x (Newton iteration; each step doubles the
+ * number of correct bits, starting from 3 correct bits) */
+static uint64_t negInv64(uint64_t x)
+{
+	uint64_t y = x;
+	for (int i = 0; i < 5; i++) y *= 2 - x*y;
+	return -y;
+}
+
+/* {{{ scalar kernel */
+/* r = t/R mod m, for t < m*R given as 2n limbs (t is clobbered).
+ * Done with two more n limb products rather than n addmul_1 passes, so the
+ * reduction gets GMP's subquadratic multiplication too:
+ * q = t*(-m^-1) mod R, and t + q*m is divisible by R. */
+static void redc(uint64_t* r, mp_limb_t* t)
+{
+	const size_t n = mc.n;
+	mp_limb_t q[2*MONT_MAX_WORDS], qm[2*MONT_MAX_WORDS];
+	mpn_mul_n(q,t,mc.minvN,n);
+	mpn_mul_n(qm,q,mc.mLimbs,n);
+	/* the low halves sum to 0 mod R; there is a carry out unless both are 0 */
+	mp_limb_t cy = mpn_add_n(r,t+n,qm+n,n);
+	cy += mpn_add_1(r,r,n,!mpn_zero_p(t,n));
+	if (cy || mpn_cmp(r,mc.mLimbs,n) >= 0)
+		mpn_sub_n(r,r,mc.mLimbs,n);
+}
+
+static void scalarMul(uint64_t* r, const uint64_t* a, const uint64_t* b)
+{
+	mp_limb_t t[2*MONT_MAX_WORDS];
+	if (a == b) mpn_sqr(t,a,mc.n);
+	else mpn_mul_n(t,a,b,mc.n);
+	redc(r,t);
+}
+
+static void scalarSqr(uint64_t* r, const uint64_t* a)
+{
+	mp_limb_t t[2*MONT_MAX_WORDS];
+	mpn_sqr(t,a,mc.n);
+	redc(r,t);
+}
+
+/* limbs of x (< m), zero padded to n */
+static void scalarLimbs(uint64_t* r, mpz_srcptr x)
+{
+	size_t k = mpz_size(x);
+	memcpy(r,mpz_limbs_read(x),k*sizeof(mp_limb_t));
+	memset(r+k,0,(mc.n-k)*sizeof(mp_limb_t));
+}
+
+static void scalarToZ(mpz_ptr r, const uint64_t* a)
+{
+	mp_limb_t t[2*MONT_MAX_WORDS];
+	memcpy(t,a,mc.n*sizeof(mp_limb_t));
+	memset(t+mc.n,0,mc.n*sizeof(mp_limb_t));
+	mp_limb_t* rp = mpz_limbs_write(r,mc.n);
+	redc(rp,t);
+	mpz_limbs_finish(r,mc.n);
+}
+/* }}} */
+
+#ifdef HAVE_IFMA
+/* {{{ avx512ifma kernel */
+/* r = a*b/R mod m (almost: r < 2m), for a,b < 2m with normalized digits */
+static void ifmaMul(uint64_t* r, const uint64_t* a, const uint64_t* b)
+{
+	__m512i A[IFMA_VECS], M[IFMA_VECS], T[IFMA_VECS];
+	const __m512i zero = _mm512_setzero_si512();
+	UNROLL
+	for (size_t j = 0; j < IFMA_VECS; j++) {
+		A[j] = _mm512_loadu_si512(a + 8*j);
+		M[j] = _mm512_loadu_si512(mc.m52 + 8*j);
+		T[j] = zero;
+	}
+	const uint64_t m0 = mc.m52[0];
+	for (size_t i = 0; i < IFMA_DIGITS; i++) {
+		__m512i bi = _mm512_set1_epi64(b[i]);
+		UNROLL
+		for (size_t j = 0; j < IFMA_VECS; j++)
+			T[j] = _mm512_madd52lo_epu64(T[j],A[j],bi);
+		/* choose y so that the low digit becomes 0 mod 2^52 */
+		uint64_t t0 = _mm_cvtsi128_si64(_mm512_castsi512_si128(T[0]));
+		uint64_t y = (t0 * mc.k52) & MASK52;
+		__m512i yi = _mm512_set1_epi64(y);
+		UNROLL
+		for (size_t j = 0; j < IFMA_VECS; j++)
+			T[j] = _mm512_madd52lo_epu64(T[j],M[j],yi);
+		uint64_t carry = (t0 + ((y * m0) & MASK52)) >> 52;
+		/* drop the low digit: shift everything down one lane */
+		UNROLL
+		for (size_t j = 0; j < IFMA_VECS - 1; j++)
+			T[j] = _mm512_alignr_epi64(T[j+1],T[j],1);
+		T[IFMA_VECS-1] = _mm512_alignr_epi64(zero,T[IFMA_VECS-1],1);
+		T[0] = _mm512_add_epi64(T[0],
+				_mm512_zextsi128_si512(_mm_cvtsi64_si128(carry)));
+		/* high halves belong one digit up, i.e. where we are now */
+		UNROLL
+		for (size_t j = 0; j < IFMA_VECS; j++) {
+			T[j] = _mm512_madd52hi_epu64(T[j],A[j],bi);
+			T[j] = _mm512_madd52hi_epu64(T[j],M[j],yi);
+		}
+	}
+	/* digits are up to ~2^61 now; propagate carries */
+	uint64_t t[IFMA_DIGITS];
+	for (size_t j = 0; j < IFMA_VECS; j++)
+		_mm512_storeu_si512(t + 8*j,T[j]);
+	uint64_t carry = 0;
+	for (size_t j = 0; j < IFMA_DIGITS; j++) {
+		t[j] += carry;
+		carry = t[j] >> 52;
+		r[j] = t[j] & MASK52;
+	}
+	assert(carry == 0); /* r < 2m < R */
+}
+
+static void ifmaSqr(uint64_t* r, const uint64_t* a)
+{
+	ifmaMul(r,a,a);
+}
+
+/* radix 2^52 digits of x (x < 2^(52*80)) */
+static void toDigits52(uint64_t* d, mpz_srcptr x)
+{
+	const mp_limb_t* xp = mpz_limbs_read(x);
+	size_t xn = mpz_size(x);
+	for (size_t j = 0; j < IFMA_DIGITS; j++) {
+		size_t bit = 52*j, w = bit / 64, s = bit % 64;
+		uint64_t v = (w < xn) ? xp[w] >> s : 0;
+		if (s > 12 && w + 1 < xn) v |= xp[w+1] << (64 - s);
+		d[j] = v & MASK52;
+	}
+}
+
+static void fromDigits52(mpz_ptr x, const uint64_t* d)
+{
+	const size_t xn = (52*IFMA_DIGITS + 63) / 64;
+	mp_limb_t* xp = mpz_limbs_write(x,xn);
+	memset(xp,0,xn*sizeof(mp_limb_t));
+	for (size_t j = 0; j < IFMA_DIGITS; j++) {
+		size_t bit = 52*j, w = bit / 64, s = bit % 64;
+		xp[w] |= d[j] << s;
+		if (s > 12) xp[w+1] |= d[j] >> (64 - s);
+	}
+	mpz_limbs_finish(x,xn);
+}
+
+static void ifmaToZ(mpz_ptr r, const uint64_t* a)
+{
+	uint64_t one[IFMA_DIGITS] = {1};
+	uint64_t t[IFMA_DIGITS];
+	ifmaMul(t,a,one); /* < m+1, so at most one subtraction */
+	fromDigits52(r,t);
+	if (mpz_cmp(r,mc.m) >= 0) mpz_sub(r,r,mc.m);
+}
+/* }}} */
+
+/* {{{ lane-parallel avx512ifma kernel */
+/* LANES elements, transposed: d[j][l] is digit j of lane l */
+typedef struct {
+	uint64_t d[IFMA_DIGITS][LANES] __attribute__((aligned(64)));
+} lanesElt;
+
+/* r = a*b/R mod m (almost, as ifmaMul) in each lane, or a*a/R if b is
+ * NULL.  This is product scanning: output column c collects every term
+ * that lands there, i.e. lo(a[i]*b[j]) for i+j == c, hi(a[i]*b[j]) for
+ * i+j == c-1, and the same for y[i]*m[j], where y[c] (for c < 80) is chosen
+ * to clear the column.  Column sums stay in registers, and the four kinds
+ * of term go to separate accumulators so the IFMAs don't wait on each
+ * other.  Squares only compute a[i]*a[j] for i < j, and double it. */
+static void lanesMont(lanesElt* r, const lanesElt* a, const lanesElt* b)
+{
+	const size_t n = IFMA_DIGITS;
+	__m512i Y[IFMA_DIGITS];
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i k = _mm512_set1_epi64(mc.k52);
+	const __m512i mask = _mm512_set1_epi64(MASK52);
+	__m512i carry = zero;
+#define A(j) _mm512_load_si512(a->d[j])
+#define B(j) _mm512_load_si512(b->d[j])
+#define M(j) _mm512_set1_epi64(mc.m52[j])
+	for (size_t c = 0; c < 2*n; c++) {
+		__m512i s0 = zero, s1 = zero, s2 = zero, s3 = zero;
+		__m512i s4 = zero, s5 = zero, s6 = zero, s7 = zero;
+		/* all four kinds of term have i in [lo,hi); the odd ones out
+		 * (lo(a[c]*b[0]) for c < n, the hi terms at i = c-n otherwise) are
+		 * added after */
+		size_t lo = (c < n) ? 0 : c - n + 1, hi = (c < n) ? c : n;
+		if (b) {
+			size_t i = lo;
+			for (; i + 1 < hi; i += 2) {
+				s0 = _mm512_madd52lo_epu64(s0,A(i),B(c-i));
+				s1 = _mm512_madd52hi_epu64(s1,A(i),B(c-1-i));
+				s2 = _mm512_madd52lo_epu64(s2,Y[i],M(c-i));
+				s3 = _mm512_madd52hi_epu64(s3,Y[i],M(c-1-i));
+				s4 = _mm512_madd52lo_epu64(s4,A(i+1),B(c-i-1));
+				s5 = _mm512_madd52hi_epu64(s5,A(i+1),B(c-2-i));
+				s6 = _mm512_madd52lo_epu64(s6,Y[i+1],M(c-i-1));
+				s7 = _mm512_madd52hi_epu64(s7,Y[i+1],M(c-2-i));
+			}
+			for (; i < hi; i++) {
+				s0 = _mm512_madd52lo_epu64(s0,A(i),B(c-i));
+				s1 = _mm512_madd52hi_epu64(s1,A(i),B(c-1-i));
+				s2 = _mm512_madd52lo_epu64(s2,Y[i],M(c-i));
+				s3 = _mm512_madd52hi_epu64(s3,Y[i],M(c-1-i));
+			}
+			if (c < n) {
+				s0 = _mm512_madd52lo_epu64(s0,A(c),B(0));
+			} else {
+				s1 = _mm512_madd52hi_epu64(s1,A(c-n),B(n-1));
+				s3 = _mm512_madd52hi_epu64(s3,Y[c-n],M(n-1));
+			}
+		} else {
+			/* i < j for the cross terms, so i only goes half way */
+			size_t i = lo;
+			for (; 2*i + 3 < c; i += 2) {
+				s0 = _mm512_madd52lo_epu64(s0,A(i),A(c-i));
+				s1 = _mm512_madd52hi_epu64(s1,A(i),A(c-1-i));
+				s4 = _mm512_madd52lo_epu64(s4,A(i+1),A(c-i-1));
+				s5 = _mm512_madd52hi_epu64(s5,A(i+1),A(c-2-i));
+			}
+			for (; 2*i + 1 < c; i++) {
+				s0 = _mm512_madd52lo_epu64(s0,A(i),A(c-i));
+				s1 = _mm512_madd52hi_epu64(s1,A(i),A(c-1-i));
+			}
+			/* (fold these in now, as the cross terms get doubled) */
+			s0 = _mm512_add_epi64(s0,s4);
+			s1 = _mm512_add_epi64(s1,s5);
+			s4 = s5 = zero;
+			if (c % 2 == 1 && (c-1)/2 >= lo)
+				s0 = _mm512_madd52lo_epu64(s0,A((c-1)/2),A((c+1)/2));
+			if (c >= n && c < 2*n - 1)
+				s1 = _mm512_madd52hi_epu64(s1,A(c-n),A(n-1));
+			/* diagonal */
+			s0 = _mm512_add_epi64(s0,s0);
+			s1 = _mm512_add_epi64(s1,s1);
+			if (c % 2 == 0)
+				s0 = _mm512_madd52lo_epu64(s0,A(c/2),A(c/2));
+			else
+				s1 = _mm512_madd52hi_epu64(s1,A(c/2),A(c/2));
+			for (i = lo; i + 1 < hi; i += 2) {
+				s2 = _mm512_madd52lo_epu64(s2,Y[i],M(c-i));
+				s3 = _mm512_madd52hi_epu64(s3,Y[i],M(c-1-i));
+				s6 = _mm512_madd52lo_epu64(s6,Y[i+1],M(c-i-1));
+				s7 = _mm512_madd52hi_epu64(s7,Y[i+1],M(c-2-i));
+			}
+			for (; i < hi; i++) {
+				s2 = _mm512_madd52lo_epu64(s2,Y[i],M(c-i));
+				s3 = _mm512_madd52hi_epu64(s3,Y[i],M(c-1-i));
+			}
+			if (c >= n) s3 = _mm512_madd52hi_epu64(s3,Y[c-n],M(n-1));
+		}
+		s0 = _mm512_add_epi64(s0,s4);
+		s1 = _mm512_add_epi64(s1,s5);
+		s2 = _mm512_add_epi64(s2,s6);
+		s3 = _mm512_add_epi64(s3,s7);
+		__m512i t = _mm512_add_epi64(_mm512_add_epi64(s0,s1),
+				_mm512_add_epi64(_mm512_add_epi64(s2,s3),carry));
+		if (c < n) {
+			Y[c] = _mm512_madd52lo_epu64(zero,t,k);
+			t = _mm512_madd52lo_epu64(t,M(0),Y[c]); /* low 52 bits are 0 */
+			carry = _mm512_srli_epi64(t,52);
+		} else {
+			/* digits of the result; normalized below */
+			_mm512_store_si512(r->d[c-n],t);
+			carry = zero;
+		}
+	}
+#undef A
+#undef B
+#undef M
+	for (size_t j = 0; j < n; j++) {
+		__m512i t = _mm512_add_epi64(_mm512_load_si512(r->d[j]),carry);
+		carry = _mm512_srli_epi64(t,52);
+		_mm512_store_si512(r->d[j],_mm512_and_si512(t,mask));
+	}
+}
+
+static void lanesMul(lanesElt* r, const lanesElt* a, const lanesElt* b)
+{
+	lanesMont(r,a,b);
+}
+
+static void lanesSqr(lanesElt* r, const lanesElt* a)
+{
+	lanesMont(r,a,NULL);
+}
+
+/* set lane l of r to the (plain, not Montgomery) digits d */
+static void lanesSet(lanesElt* r, size_t l, const uint64_t* d)
+{
+	for (size_t j = 0; j < IFMA_DIGITS; j++) r->d[j][l] = d[j];
+}
+
+/* every lane of r = d */
+static void lanesBroadcast(lanesElt* r, const uint64_t* d)
+{
+	for (size_t l = 0; l < LANES; l++) lanesSet(r,l,d);
+}
+
+/* r[l] = b[l]^e[l] mod m for l < n <= LANES (the other lanes idle) */
+static void lanesPowm(mpz_ptr* r, mpz_srcptr* b, mpz_srcptr* e, size_t n)
+{
+	const size_t tblSize = 1 << POWM_W;
+	lanesElt* tbl = aligned_alloc(64,(tblSize + 3)*sizeof(lanesElt));
+	if (!tbl) { /* do them one at a time instead */
+		for (size_t l = 0; l < n; l++) montPowm(r[l],b[l],e[l]);
+		return;
+	}
+	lanesElt* acc = tbl + tblSize;
+	lanesElt* x = acc + 1;
+	lanesElt* r2 = x + 1;
+	uint64_t d[IFMA_DIGITS];
+	NEWZ(t);
+	/* tbl[1] = b in Montgomery form, tbl[0] = 1 */
+	memset(x,0,sizeof(*x));
+	for (size_t l = 0; l < n; l++) {
+		mpz_mod(t,b[l],mc.m);
+		toDigits52(d,t);
+		lanesSet(x,l,d);
+	}
+	lanesBroadcast(r2,mc.r2);
+	lanesMul(&tbl[1],x,r2);
+	lanesBroadcast(&tbl[0],mc.one);
+	for (size_t i = 2; i < tblSize; i++)
+		lanesMul(&tbl[i],&tbl[i-1],&tbl[1]);
+	size_t bits = 1;
+	for (size_t l = 0; l < n; l++)
+		if (mpz_sizeinbase(e[l],2) > bits) bits = mpz_sizeinbase(e[l],2);
+	size_t nWin = (bits + POWM_W - 1) / POWM_W;
+	*acc = tbl[0];
+	for (size_t i = nWin; i-- > 0;) {
+		if (i + 1 < nWin)
+			for (size_t k = 0; k < POWM_W; k++) lanesSqr(acc,acc);
+		/* x = tbl[window of e[l]] in each lane l */
+		uint64_t idx[LANES];
+		for (size_t l = 0; l < LANES; l++) {
+			unsigned w = 0;
+			for (size_t k = 0; l < n && k < POWM_W; k++)
+				w |= mpz_tstbit(e[l],i*POWM_W + k) << k;
+			idx[l] = w*IFMA_DIGITS*LANES + l;
+		}
+		__m512i vi = _mm512_loadu_si512(idx);
+		const __m512i step = _mm512_set1_epi64(LANES);
+		for (size_t j = 0; j < IFMA_DIGITS; j++) {
+			_mm512_store_si512(x->d[j],
+					_mm512_i64gather_epi64(vi,(const void*)tbl,8));
+			vi = _mm512_add_epi64(vi,step);
+		}
+		lanesMul(acc,acc,x);
+	}
+	/* out of Montgomery form (< m+1, as in ifmaToZ) */
+	memset(d,0,sizeof(d));
+	d[0] = 1;
+	lanesBroadcast(x,d);
+	lanesMul(acc,acc,x);
+	for (size_t l = 0; l < n; l++) {
+		for (size_t j = 0; j < IFMA_DIGITS; j++) d[j] = acc->d[j][l];
+		fromDigits52(r[l],d);
+		if (mpz_cmp(r[l],mc.m) >= 0) mpz_sub(r[l],r[l],mc.m);
+	}
+	shredZ(t);
+	mpz_clear(t);
+	memset(d,0,sizeof(d));
+	memset(tbl,0,(tblSize + 3)*sizeof(lanesElt));
+	free(tbl);
+}
+/* }}} */
+#endif
+
+static void (*kMul)(uint64_t*, const uint64_t*, const uint64_t*) = scalarMul;
+static void (*kSqr)(uint64_t*, const uint64_t*) = scalarSqr;
+
+/* set up r2 and one for the current kernel */
+static void initKernel(void)
+{
+	NEWZ(t);
+#ifdef HAVE_IFMA
+	if (mc.simd) {
+		mc.words = IFMA_DIGITS;
+		kMul = ifmaMul;
+		kSqr = ifmaSqr;
+		mpz_setbit(t,2*52*IFMA_DIGITS);
+		mpz_mod(t,t,mc.m);
+		toDigits52(mc.r2,t);
+		mpz_set_ui(t,0);
+		mpz_setbit(t,52*IFMA_DIGITS);
+		mpz_mod(t,t,mc.m);
+		toDigits52(mc.one,t);
+		mpz_clear(t);
+		mc.epoch++;
+		return;
+	}
+#endif
+	mc.words = mc.n;
+	kMul = scalarMul;
+	kSqr = scalarSqr;
+	mpz_setbit(t,2*64*mc.n);
+	mpz_mod(t,t,mc.m);
+	scalarLimbs(mc.r2,t);
+	mpz_set_ui(t,0);
+	mpz_setbit(t,64*mc.n);
+	mpz_mod(t,t,mc.m);
+	scalarLimbs(mc.one,t);
+	mpz_clear(t);
+	mc.epoch++;
+}
+
+/* can the SIMD kernel handle the current modulus? */
+static int simdFits(void)
+{
+#ifdef HAVE_IFMA
+	size_t bits = mpz_sizeinbase(mc.m,2);
+	/* need R = 2^(52*80) > 4m, and enough bits that ten vectors aren't a
+	 * waste over the scalar kernel */
+	return bits + 2 <= 52*IFMA_DIGITS && bits > 52*(IFMA_DIGITS - 8);
+#else
+	return 0;
+#endif
+}
+
+int montSetup(mpz_srcptr m)
+{
+	if (mpz_cmp_ui(m,1) <= 0 || mpz_even_p(m) || mpz_size(m) > MONT_MAX_WORDS) {
+		mc.ready = 0; /* don't keep using the old modulus */
+		return -1;
+	}
+	if (!mc.haveM) mpz_init(mc.m);
+	mc.haveM = 1;
+	mpz_set(mc.m,m);
+	mc.n = mpz_size(m);
+	memcpy(mc.mLimbs,mpz_limbs_read(m),mc.n*sizeof(mp_limb_t));
+	NEWZ(R);
+	NEWZ(inv);
+	mpz_setbit(R,64*mc.n);
+	mpz_invert(inv,m,R);
+	mpz_sub(inv,R,inv);
+	scalarLimbs(mc.minvN,inv);
+	mpz_clear(inv);
+	mpz_clear(R);
+#ifdef HAVE_IFMA
+	if (simdFits()) {
+		toDigits52(mc.m52,m);
+		mc.k52 = negInv64(mc.m52[0]) & MASK52;
+	}
+#endif
+	mc.simd = simdFits();
+	initKernel();
+	mc.ready = 1;
+	return 0;
+}
+
+int montReady(void)
+{
+	return mc.ready;
+}
+
+unsigned montEpoch(void)
+{
+	return mc.epoch;
+}
+
+size_t montWords(void)
+{
+	return mc.words;
+}
+
+const char* montKernel(void)
+{
+	return mc.simd ? "avx512ifma" : "scalar";
+}
+
+int montUseSimd(int on)
+{
+	int simd = on && simdFits();
+	if (mc.ready && simd != mc.simd) {
+		mc.simd = simd;
+		initKernel();
+	}
+	return mc.simd;
+}
+
+void montFromZ(uint64_t* r, mpz_srcptr x)
+{
+	uint64_t t[MONT_MAX_WORDS];
+	NEWZ(xr);
+	mpz_mod(xr,x,mc.m);
+#ifdef HAVE_IFMA
+	if (mc.simd) toDigits52(t,xr);
+	else
+#endif
+	scalarLimbs(t,xr);
+	mpz_clear(xr);
+	kMul(r,t,mc.r2);
+}
+
+void montToZ(mpz_ptr r, const uint64_t* a)
+{
+#ifdef HAVE_IFMA
+	if (mc.simd) {
+		ifmaToZ(r,a);
+		return;
+	}
+#endif
+	scalarToZ(r,a);
+}
+
+void montOne(uint64_t* r)
+{
+	memcpy(r,mc.one,mc.words*sizeof(uint64_t));
+}
+
+void montMul(uint64_t* r, const uint64_t* a, const uint64_t* b)
+{
+	kMul(r,a,b);
+}
+
+void montSqr(uint64_t* r, const uint64_t* a)
+{
+	kSqr(r,a);
+}
+
+/* fixed 5-bit windows; the sequence of operations only depends on the
+ * length of e, not its bits (table lookups aside) */
+void montPowm(mpz_ptr r, mpz_srcptr b, mpz_srcptr e)
+{
+	const size_t w = mc.words;
+	uint64_t tbl[1 << POWM_W][MONT_MAX_WORDS];
+	uint64_t acc[MONT_MAX_WORDS];
+	montOne(tbl[0]);
+	montFromZ(tbl[1],b);
+	for (size_t i = 2; i < (1 << POWM_W); i++)
+		kMul(tbl[i],tbl[i-1],tbl[1]);
+	size_t nWin = (mpz_sizeinbase(e,2) + POWM_W - 1) / POWM_W;
+	montOne(acc);
+	for (size_t i = nWin; i-- > 0;) {
+		if (i + 1 < nWin)
+			for (size_t k = 0; k < POWM_W; k++) kSqr(acc,acc);
+		unsigned d = 0;
+		for (size_t k = 0; k < POWM_W; k++)
+			d |= mpz_tstbit(e,i*POWM_W + k) << k;
+		kMul(acc,acc,tbl[d]);
+	}
+	montToZ(r,acc);
+	/* the table is as sensitive as b, and acc as the result */
+	memset(tbl,0,sizeof(tbl));
+	memset(acc,0,w*sizeof(uint64_t));
+}
+
+size_t montLanes(void)
+{
+#ifdef HAVE_IFMA
+	if (mc.simd) return LANES;
+#endif
+	return 1;
+}
+
+void montPowmN(mpz_ptr* r, mpz_srcptr* b, mpz_srcptr* e, size_t n)
+{
+#ifdef HAVE_IFMA
+	if (mc.simd) {
+		for (size_t i = 0; i < n; i += LANES)
+			lanesPowm(r+i,b+i,e+i,(n - i < LANES) ? n - i : LANES);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < n; i++) montPowm(r[i],b[i],e[i]);
+}
+
+/* vim:foldmethod=marker:foldmarker={{{,}}} */
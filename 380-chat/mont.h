@@ -0,0 +1,50 @@
+/* Montgomery arithmetic modulo a fixed odd modulus (the DH prime p).
+ * Elements are arrays of montWords() 64-bit words, in whatever layout the
+ * active kernel uses; only pass them to the functions below. */
+#pragma once
+#include <gmp.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/** largest element size we support, in words (enough for ~6000 bit moduli) */
+#define MONT_MAX_WORDS 128
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** precompute the Montgomery constants for modulus m (odd, m > 1).
+ * @return 0 on success, -1 if m is unsuitable (even, or too large) */
+int montSetup(mpz_srcptr m);
+/** 1 once montSetup has succeeded */
+int montReady(void);
+/** changes whenever the modulus or kernel changes, which invalidates any
+ * elements computed before.  Lets callers know when to rebuild tables. */
+unsigned montEpoch(void);
+/** words per element with the current kernel */
+size_t montWords(void);
+/** name of the current kernel ("avx512ifma" or "scalar") */
+const char* montKernel(void);
+/** use the SIMD kernel if on != 0 and this build/CPU has one, otherwise the
+ * portable one.  @return 1 if the SIMD kernel is now in use */
+int montUseSimd(int on);
+/** r = Montgomery form of x (any nonnegative x; reduced mod m first) */
+void montFromZ(uint64_t* r, mpz_srcptr x);
+/** r = the integer (in [0,m)) that a represents */
+void montToZ(mpz_ptr r, const uint64_t* a);
+/** r = Montgomery form of 1 */
+void montOne(uint64_t* r);
+/** r = a*b (all in Montgomery form).  r may alias a or b. */
+void montMul(uint64_t* r, const uint64_t* a, const uint64_t* b);
+/** r = a^2 */
+void montSqr(uint64_t* r, const uint64_t* a);
+/** r = b^e mod m, like mpz_powm (e >= 0) */
+void montPowm(mpz_ptr r, mpz_srcptr b, mpz_srcptr e);
+/** how many exponentiations montPowmN runs side by side (1 if the current
+ * kernel has no lane-parallel version) */
+size_t montLanes(void);
+/** r[i] = b[i]^e[i] mod m for i < n; the same as n calls to montPowm, but
+ * done montLanes() at a time.  The r[i] must be distinct from the b[i], e[i]. */
+void montPowmN(mpz_ptr* r, mpz_srcptr* b, mpz_srcptr* e, size_t n);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,429 @@
+#define _GNU_SOURCE /* memmem */
+#include "msglog.h"
+#include "util.h"
+#include "hkdf.h"
+#include "rng.h"
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <endian.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* segment header: magic, version, reserved, then the log key sealed under
+ * the vault key (nonce || ciphertext || tag), with the first 16 bytes as
+ * associated data */
+#define SEG_MAGIC   "DHMLOG\0\0"
+#define IDX_MAGIC   "DHMLIDX\0"
+#define MLOG_VER    1
+#define WRAP_OFF    16
+#define SEG_HDR     (WRAP_OFF + 12 + MLOG_KEY_LEN + MLOG_TAG_LEN)
+#define IDX_HDR     16
+
+/* an AES-256-GCM context keyed once; the nonce is set per message */
+static void* keyCtx(const unsigned char* key, int enc)
+{
+	EVP_CIPHER_CTX* c = EVP_CIPHER_CTX_new();
+	if (c && EVP_CipherInit_ex(c,EVP_aes_256_gcm(),NULL,key,NULL,enc)) return c;
+	EVP_CIPHER_CTX_free(c);
+	return NULL;
+}
+
+static int seal(void* c, const unsigned char* nonce, const void* aad,
+		size_t alen, const void* pt, size_t n, unsigned char* ct)
+{
+	int len, fin;
+	return (EVP_EncryptInit_ex(c,NULL,NULL,NULL,nonce) &&
+			EVP_EncryptUpdate(c,NULL,&len,aad,alen) &&
+			EVP_EncryptUpdate(c,ct,&len,pt,n) &&
+			EVP_EncryptFinal_ex(c,ct + len,&fin) &&
+			EVP_CIPHER_CTX_ctrl(c,EVP_CTRL_GCM_GET_TAG,MLOG_TAG_LEN,
+				ct + n)) ? 0 : -1;
+}
+
+/* ct is n bytes of ciphertext and then the tag */
+static int unseal(void* c, const unsigned char* nonce, const void* aad,
+		size_t alen, const unsigned char* ct, size_t n, void* pt)
+{
+	int len, fin;
+	return (EVP_DecryptInit_ex(c,NULL,NULL,NULL,nonce) &&
+			EVP_DecryptUpdate(c,NULL,&len,aad,alen) &&
+			EVP_DecryptUpdate(c,pt,&len,ct,n) &&
+			EVP_CIPHER_CTX_ctrl(c,EVP_CTRL_GCM_SET_TAG,MLOG_TAG_LEN,
+				(void*)(ct + n)) &&
+			EVP_DecryptFinal_ex(c,(unsigned char*)pt + len,&fin) > 0) ? 0 : -1;
+}
+
+/* message i's nonce: its number, big endian, which never repeats under a
+ * log key */
+static void msgNonce(unsigned char* nonce, uint64_t i)
+{
+	uint64_t be = htobe64(i);
+	memset(nonce,0,4);
+	memcpy(nonce + 4,&be,8);
+}
+
+/* e as it is on disk (little endian), which is also the AAD */
+static void entryLE(mlogEntry* out, const mlogEntry* e)
+{
+	out->time = htole64(e->time);
+	out->off = htole64(e->off);
+	out->len = htole32(e->len);
+	out->sender = htole32(e->sender);
+}
+
+int mlogVaultKey(unsigned char* vault, mpz_t SK)
+{
+	static const char salt[] = "380-chat log vault";
+	unsigned char buf[4 + 1024];
+	mpz_ptr v[1] = {SK};
+	size_t n = serialize_mpzv(buf,sizeof(buf),v,1);
+	hkdfPiece ikm = {buf,n};
+	int rv = n ? hkdf(vault,MLOG_KEY_LEN,salt,sizeof(salt) - 1,&ikm,1,NULL,0)
+		: -1;
+	OPENSSL_cleanse(buf,sizeof(buf));
+	return rv;
+}
+
+/* the writer: take whatever is pending, write it, sync, repeat */
+static void* writer(void* arg)
+{
+	msgLog* l = arg;
+	unsigned char* buf = NULL;
+	size_t cap = 0;
+	mlogEntry* ents = NULL;
+	size_t capEnts = 0;
+	pthread_mutex_lock(&l->lock);
+	for (;;) {
+		while (!l->stop && l->nEnts == 0)
+			pthread_cond_wait(&l->wake,&l->lock);
+		/* a group is whatever comes in during the next MLOG_GROUP_MS */
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME,&until);
+		until.tv_sec += MLOG_GROUP_MS / 1000;
+		until.tv_nsec += (MLOG_GROUP_MS % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		while (!l->stop && l->len < MLOG_GROUP_BYTES &&
+				pthread_cond_timedwait(&l->wake,&l->lock,&until) != ETIMEDOUT)
+			;
+		if (l->nEnts == 0 && l->stop) break;
+		/* swap buffers, so appends go on while we write */
+		size_t len = l->len, nEnts = l->nEnts;
+		unsigned char* b = l->buf;
+		mlogEntry* e = l->ents;
+		size_t c = l->cap, ce = l->capEnts;
+		l->buf = buf;
+		l->cap = cap;
+		l->ents = ents;
+		l->capEnts = capEnts;
+		l->len = l->nEnts = 0;
+		buf = b;
+		cap = c;
+		ents = e;
+		capEnts = ce;
+		pthread_mutex_unlock(&l->lock);
+		/* segment before index, so an entry that made it to disk has
+		 * its message there (a reader checks, too) */
+		int rv = (xwrite(l->fd,buf,len) == 0 &&
+				xwrite(l->ifd,ents,nEnts*sizeof(mlogEntry)) == 0 &&
+				fdatasync(l->fd) == 0 && fdatasync(l->ifd) == 0) ? 0 : -1;
+		OPENSSL_cleanse(buf,len);
+		pthread_mutex_lock(&l->lock);
+		if (rv != 0) l->err = 1;
+	}
+	pthread_mutex_unlock(&l->lock);
+	free(buf);
+	free(ents);
+	return NULL;
+}
+
+/* open dir/name + ext for a new log */
+static int createFile(const char* dir, const char* name, const char* ext)
+{
+	char path[4096];
+	if (snprintf(path,sizeof(path),"%s/%s%s",dir,name,ext) >= (int)sizeof(path))
+		return -1;
+	return open(path,O_WRONLY|O_CREAT|O_EXCL|O_APPEND|O_CLOEXEC,0600);
+}
+
+int mlogCreate(msgLog* l, const char* dir, const unsigned char* key,
+		const unsigned char* vault)
+{
+	memset(l,0,sizeof(*l));
+	l->fd = l->ifd = -1;
+	/* named for when it started, so the files sort by time */
+	char name[MLOG_NAME_MAX];
+	uint32_t r;
+	time_t now = time(NULL);
+	struct tm tm;
+	if (randBytes(&r,sizeof(r)) != 0) return -1;
+	strftime(name,sizeof(name),"%Y%m%d-%H%M%S",gmtime_r(&now,&tm));
+	snprintf(name + strlen(name),sizeof(name) - strlen(name),"-%08x",r);
+
+	unsigned char seg[SEG_HDR] = SEG_MAGIC;
+	unsigned char idx[IDX_HDR] = IDX_MAGIC;
+	uint32_t ver = htole32(MLOG_VER);
+	memcpy(seg + 8,&ver,4);
+	memcpy(idx + 8,&ver,4);
+	void* wrap = keyCtx(vault,1);
+	int rv = (wrap && randBytes(seg + WRAP_OFF,12) == 0 &&
+			seal(wrap,seg + WRAP_OFF,seg,WRAP_OFF,key,MLOG_KEY_LEN,
+				seg + WRAP_OFF + 12) == 0) ? 0 : -1;
+	EVP_CIPHER_CTX_free(wrap);
+	if (rv != 0) return -1;
+	if ((l->fd = createFile(dir,name,".seg")) < 0 ||
+			(l->ifd = createFile(dir,name,".idx")) < 0 ||
+			xwrite(l->fd,seg,SEG_HDR) != 0 || xwrite(l->ifd,idx,IDX_HDR) != 0 ||
+			!(l->ctx = keyCtx(key,1)))
+		goto fail;
+	l->end = SEG_HDR;
+	pthread_mutex_init(&l->lock,NULL);
+	pthread_cond_init(&l->wake,NULL);
+	if (pthread_create(&l->writer,NULL,writer,l) != 0) {
+		pthread_mutex_destroy(&l->lock);
+		pthread_cond_destroy(&l->wake);
+		goto fail;
+	}
+	return 0;
+fail:
+	EVP_CIPHER_CTX_free(l->ctx);
+	if (l->fd >= 0) close(l->fd);
+	if (l->ifd >= 0) close(l->ifd);
+	l->fd = l->ifd = -1;
+	return -1;
+}
+
+int mlogAppend(msgLog* l, uint32_t sender, const char* text, size_t len)
+{
+	if (len > UINT32_MAX - MLOG_TAG_LEN) return -1;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	uint64_t t = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+	pthread_mutex_lock(&l->lock);
+	int rv = -1;
+	if (l->err) goto end;
+	if (l->len + len + MLOG_TAG_LEN > l->cap) {
+		size_t cap = l->cap ? l->cap : 4096;
+		while (cap < l->len + len + MLOG_TAG_LEN) cap *= 2;
+		unsigned char* buf = realloc(l->buf,cap);
+		if (!buf) goto end;
+		l->buf = buf;
+		l->cap = cap;
+	}
+	if (l->nEnts == l->capEnts) {
+		size_t cap = l->capEnts ? 2*l->capEnts : 64;
+		mlogEntry* ents = realloc(l->ents,cap*sizeof(mlogEntry));
+		if (!ents) goto end;
+		l->ents = ents;
+		l->capEnts = cap;
+	}
+	/* times never go backwards within a log, whatever the clock does */
+	if (t < l->last) t = l->last;
+	mlogEntry e = {t,l->end,(uint32_t)len,sender};
+	unsigned char nonce[12];
+	msgNonce(nonce,l->n);
+	entryLE(&l->ents[l->nEnts],&e);
+	if (seal(l->ctx,nonce,&l->ents[l->nEnts],sizeof(mlogEntry),text,len,
+				l->buf + l->len) != 0)
+		goto end;
+	/* the writer sleeps while there's nothing; wake it for the first
+	 * message of a group, or once the group is big enough */
+	if (l->nEnts == 0 || l->len + len + MLOG_TAG_LEN >= MLOG_GROUP_BYTES)
+		pthread_cond_signal(&l->wake);
+	l->nEnts++;
+	l->len += len + MLOG_TAG_LEN;
+	l->end += len + MLOG_TAG_LEN;
+	l->last = t;
+	l->n++;
+	rv = 0;
+end:
+	pthread_mutex_unlock(&l->lock);
+	return rv;
+}
+
+int mlogClose(msgLog* l)
+{
+	if (l->fd < 0) return -1;
+	pthread_mutex_lock(&l->lock);
+	l->stop = 1;
+	pthread_cond_signal(&l->wake);
+	pthread_mutex_unlock(&l->lock);
+	pthread_join(l->writer,NULL);
+	int rv = l->err ? -1 : 0;
+	if (close(l->fd) != 0 || close(l->ifd) != 0) rv = -1;
+	EVP_CIPHER_CTX_free(l->ctx);
+	pthread_mutex_destroy(&l->lock);
+	pthread_cond_destroy(&l->wake);
+	free(l->buf);
+	free(l->ents);
+	memset(l,0,sizeof(*l));
+	l->fd = l->ifd = -1;
+	return rv;
+}
+
+static int openFile(const char* dir, const char* name, const char* ext)
+{
+	char path[4096];
+	if (snprintf(path,sizeof(path),"%s/%s%s",dir,name,ext) >= (int)sizeof(path))
+		return -1;
+	return open(path,O_RDONLY|O_CLOEXEC);
+}
+
+int mlogOpen(mlogReader* r, const char* dir, const char* name,
+		const unsigned char* vault)
+{
+	memset(r,0,sizeof(*r));
+	unsigned char seg[SEG_HDR], idx[IDX_HDR], key[MLOG_KEY_LEN];
+	uint32_t ver = htole32(MLOG_VER);
+	struct stat st;
+	int ifd = -1, rv = -1;
+	if ((r->fd = openFile(dir,name,".seg")) < 0) return -1;
+	if (xread(r->fd,seg,SEG_HDR) != 0 || memcmp(seg,SEG_MAGIC,8) != 0 ||
+			memcmp(seg + 8,&ver,4) != 0)
+		goto end;
+	void* wrap = keyCtx(vault,0);
+	int ok = wrap && unseal(wrap,seg + WRAP_OFF,seg,WRAP_OFF,
+			seg + WRAP_OFF + 12,MLOG_KEY_LEN,key) == 0;
+	EVP_CIPHER_CTX_free(wrap);
+	if (!ok) {
+		rv = -2;
+		goto end;
+	}
+	r->ctx = keyCtx(key,0);
+	OPENSSL_cleanse(key,sizeof(key));
+	if (!r->ctx || (ifd = openFile(dir,name,".idx")) < 0 ||
+			xread(ifd,idx,IDX_HDR) != 0 || memcmp(idx,IDX_MAGIC,8) != 0 ||
+			memcmp(idx + 8,&ver,4) != 0 || fstat(ifd,&st) != 0)
+		goto end;
+	size_t n = (st.st_size - IDX_HDR) / sizeof(mlogEntry);
+	if (n) {
+		r->mapLen = st.st_size;
+		r->map = mmap(NULL,r->mapLen,PROT_READ,MAP_SHARED,ifd,0);
+		if (r->map == MAP_FAILED) {
+			r->map = NULL;
+			goto end;
+		}
+		r->ents = (const mlogEntry*)((const unsigned char*)r->map + IDX_HDR);
+	}
+	/* after a crash, the index may run ahead of the segment: keep the
+	 * entries whose message is all there (offsets only go up) */
+	if (fstat(r->fd,&st) != 0) goto end;
+	size_t lo = 0, hi = n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		uint64_t endOff = le64toh(r->ents[mid].off) +
+			le32toh(r->ents[mid].len) + MLOG_TAG_LEN;
+		if (endOff <= (uint64_t)st.st_size) lo = mid + 1;
+		else hi = mid;
+	}
+	r->n = lo;
+	rv = 0;
+end:
+	if (ifd >= 0) close(ifd);
+	if (rv != 0) mlogCloseReader(r);
+	return rv;
+}
+
+size_t mlogFind(const mlogReader* r, uint64_t t)
+{
+	size_t lo = 0, hi = r->n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (le64toh(r->ents[mid].time) < t) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+int mlogRead(const mlogReader* r, size_t i, char* out)
+{
+	if (i >= r->n) return -1;
+	const mlogEntry* e = &r->ents[i];
+	size_t n = le32toh(e->len);
+	unsigned char* ct = malloc(n + MLOG_TAG_LEN);
+	unsigned char nonce[12];
+	msgNonce(nonce,i);
+	/* the entry is the AAD, so a doctored index doesn't get far */
+	mlogEntry aad = *e;
+	int rv = (ct && pread(r->fd,ct,n + MLOG_TAG_LEN,le64toh(e->off)) ==
+			(ssize_t)(n + MLOG_TAG_LEN) &&
+			unseal(r->ctx,nonce,&aad,sizeof(aad),ct,n,out) == 0) ? 0 : -1;
+	free(ct);
+	return rv;
+}
+
+void mlogCloseReader(mlogReader* r)
+{
+	if (r->map) munmap(r->map,r->mapLen);
+	if (r->fd >= 0) close(r->fd);
+	EVP_CIPHER_CTX_free(r->ctx);
+	memset(r,0,sizeof(*r));
+	r->fd = -1;
+}
+
+static int isSegment(const struct dirent* d)
+{
+	size_t n = strlen(d->d_name);
+	return n > 4 && n - 4 < MLOG_NAME_MAX &&
+		strcmp(d->d_name + n - 4,".seg") == 0;
+}
+
+/* mlogSearch over one session's log */
+static int searchOne(const mlogReader* r, uint64_t t0, uint64_t t1,
+		uint32_t sender, const char* needle, mlogFn fn, void* arg)
+{
+	size_t nlen = needle ? strlen(needle) : 0;
+	int rv = 0;
+	for (size_t i = mlogFind(r,t0); i < r->n && rv == 0; i++) {
+		mlogEntry e = {le64toh(r->ents[i].time),le64toh(r->ents[i].off),
+			le32toh(r->ents[i].len),le32toh(r->ents[i].sender)};
+		if (e.time >= t1) break;
+		if (sender != MLOG_ANY && e.sender != sender) continue;
+		char* text = malloc((size_t)e.len + 1);
+		if (!text || mlogRead(r,i,text) != 0) {
+			free(text);
+			return -1;
+		}
+		text[e.len] = 0;
+		if (!nlen || memmem(text,e.len,needle,nlen)) rv = fn(arg,&e,text);
+		OPENSSL_cleanse(text,e.len);
+		free(text);
+	}
+	return rv;
+}
+
+int mlogSearch(const char* dir, const unsigned char* vault, uint64_t t0,
+		uint64_t t1, uint32_t sender, const char* needle, mlogFn fn,
+		void* arg)
+{
+	struct dirent** list;
+	int n = scandir(dir,&list,isSegment,alphasort);
+	if (n < 0) return -1;
+	int rv = 0;
+	for (int i = 0; i < n; i++) {
+		char name[MLOG_NAME_MAX];
+		mlogReader r;
+		size_t len = strlen(list[i]->d_name) - 4;
+		memcpy(name,list[i]->d_name,len);
+		name[len] = 0;
+		free(list[i]);
+		if (rv != 0) continue;
+		/* logs under some other identity's vault aren't ours to read */
+		int o = mlogOpen(&r,dir,name,vault);
+		if (o == -2) continue;
+		rv = (o == 0) ? searchOne(&r,t0,t1,sender,needle,fn,arg) : -1;
+		if (o == 0) mlogCloseReader(&r);
+	}
+	free(list);
+	return rv;
+}
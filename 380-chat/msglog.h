@@ -0,0 +1,112 @@
+/* The message log: what was said in each session, kept encrypted on disk
+ * so it can be searched after the fact.  Each session gets two files in
+ * the log directory, named after the time it started:
+ *
+ *  - NAME.seg, the segment: a header holding the session's log key (sealed
+ *    under the vault key; see mlogVaultKey), then each message as an
+ *    AES-256-GCM ciphertext and tag.  The log key comes from the session's
+ *    key material, so it is new for every session.
+ *  - NAME.idx, the index: a header, then an mlogEntry per message, in
+ *    order.  Entries are fixed size and their times never decrease, so a
+ *    reader maps the file and finds a time range by binary search, and
+ *    filters by sender, without decrypting anything.  (Each entry is bound
+ *    to its message as the AEAD's associated data, so an index that has
+ *    been tampered with just makes those messages fail to open.)
+ *
+ * Both files are only ever appended to.  Appends are buffered in memory
+ * and a thread of the log's own writes them out and fdatasyncs both files
+ * every MLOG_GROUP_MS, or sooner once MLOG_GROUP_BYTES are waiting: one
+ * sync for a whole group of messages, off the caller's thread.  A crash
+ * loses at most the last group; readers ignore index entries whose
+ * message didn't make it to the segment. */
+#pragma once
+#include <gmp.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MLOG_KEY_LEN     32
+#define MLOG_TAG_LEN     16
+#define MLOG_GROUP_MS    1000
+#define MLOG_GROUP_BYTES (256 << 10)
+#define MLOG_NAME_MAX    64
+/** for mlogSearch: any sender */
+#define MLOG_ANY         UINT32_MAX
+
+/** an index entry */
+typedef struct {
+	uint64_t time;          /* ns since the epoch */
+	uint64_t off;           /* of the message in the segment */
+	uint32_t len;           /* of the plaintext */
+	uint32_t sender;        /* up to the caller; chat uses WHO_... */
+} mlogEntry;
+
+typedef struct {
+	int fd, ifd;            /* segment, index */
+	void* ctx;              /* EVP_CIPHER_CTX with the log key */
+	uint64_t n;             /* messages appended */
+	uint64_t end;           /* segment length, pending bytes included */
+	uint64_t last;          /* latest time used */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t writer;
+	unsigned char* buf;     /* sealed messages waiting for the writer */
+	size_t len, cap;
+	mlogEntry* ents;        /* and their index entries */
+	size_t nEnts, capEnts;
+	int stop;
+	int err;                /* the writer failed; appends do too */
+} msgLog;
+
+typedef struct {
+	int fd;                 /* segment */
+	void* ctx;              /* EVP_CIPHER_CTX with the log key */
+	void* map;              /* the index file */
+	size_t mapLen;
+	const mlogEntry* ents;  /* into map */
+	size_t n;               /* entries whose message is in the segment */
+} mlogReader;
+
+/** called by mlogSearch for each match */
+typedef int (*mlogFn)(void* arg, const mlogEntry* e, const char* text);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** the key that seals log keys, from our long term secret key SK
+ * (MLOG_KEY_LEN bytes).  @return 0, or -1 on failure */
+int mlogVaultKey(unsigned char* vault, mpz_t SK);
+/** start a log for a new session in dir, keyed with key (MLOG_KEY_LEN bytes
+ * of the session's key material), and start its writer.
+ * @return 0, or -1 on failure */
+int mlogCreate(msgLog* l, const char* dir, const unsigned char* key,
+		const unsigned char* vault);
+/** log text[0..len) from sender.  Thread safe; doesn't block on I/O.
+ * @return 0, or -1 on an error (now or in an earlier write) */
+int mlogAppend(msgLog* l, uint32_t sender, const char* text, size_t len);
+/** write out and sync whatever is pending, stop the writer and close.
+ * @return 0, or -1 if anything failed to make it to disk */
+int mlogClose(msgLog* l);
+
+/** open the session log dir/name (without .seg or .idx) for reading.
+ * @return 0, -1 on failure, or -2 if vault isn't the key it was made with
+ * (or the header has been tampered with) */
+int mlogOpen(mlogReader* r, const char* dir, const char* name,
+		const unsigned char* vault);
+/** index of the first entry at or after time t (r->n if none) */
+size_t mlogFind(const mlogReader* r, uint64_t t);
+/** decrypt entry i's message into out (room for r->ents[i].len bytes).
+ * @return 0, or -1 if it can't be read or isn't authentic */
+int mlogRead(const mlogReader* r, size_t i, char* out);
+void mlogCloseReader(mlogReader* r);
+/** call fn for each message in every session log in dir (oldest first)
+ * with a time in [t0, t1), from sender (or MLOG_ANY), containing needle
+ * (or any, if it's NULL or empty).  text is NUL terminated.  Stops if fn
+ * returns nonzero.  @return 0, fn's return, or -1 on an error */
+int mlogSearch(const char* dir, const unsigned char* vault, uint64_t t0,
+		uint64_t t1, uint32_t sender, const char* needle, mlogFn fn,
+		void* arg);
+#ifdef __cplusplus
+}
+#endif
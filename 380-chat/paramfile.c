@@ -0,0 +1,261 @@
+/* Binary parameter files, and a cache of parameters we have validated.
+ *
+ * Binary format (header fields in the writer's byte order; see order):
+ *   +--------------------------------+
+ *   | paramsHdr (64 bytes)           |
+ *   +--------------------------------+
+ *   | limbs of q (nLimbs[0] limbs)   |
+ *   | limbs of p (nLimbs[1] limbs)   |
+ *   | limbs of g (nLimbs[2] limbs)   |
+ *   +--------------------------------+
+ *   | table for g (optional)         |
+ *   +--------------------------------+
+ * Limbs are stored exactly as GMP keeps them in memory, so loading is a
+ * memcpy; in exchange, the file is only readable on machines with the same
+ * limb size and byte order (checked via limbBytes and order).  The text
+ * format remains the portable one.  The digest in the header covers the
+ * values and the table, and is what we look up in the trusted cache. */
+#include "paramfile.h"
+#include <openssl/evp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <endian.h>
+#include "util.h"
+
+#define PARAMS_MAGIC   "DHPARAMS"
+#define PARAMS_VERSION 1
+#define PARAMS_ORDER   0x01020304u
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t limbBytes;     /* sizeof(mp_limb_t) of the writer */
+	uint32_t order;         /* PARAMS_ORDER, in the writer's byte order */
+	uint32_t nLimbs[3];     /* q, p, g */
+	uint32_t tab[4];        /* h, v, b, entryLimbs; all 0 if no table */
+	unsigned char digest[PARAMS_DIGEST_LEN];
+} paramsHdr;
+
+static size_t tableLimbs(const uint32_t* tab)
+{
+	return (size_t)tab[1] * ((size_t)1 << tab[0]) * tab[3];
+}
+
+/* digest of the whole file: value digest, then table shape and contents */
+static void fileDigest(unsigned char* digest, const unsigned char* valDigest,
+		const uint32_t* tab, const mp_limb_t* limbs)
+{
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx,EVP_sha256(),NULL);
+	EVP_DigestUpdate(ctx,valDigest,PARAMS_DIGEST_LEN);
+	EVP_DigestUpdate(ctx,tab,4*sizeof(uint32_t));
+	if (limbs) EVP_DigestUpdate(ctx,limbs,tableLimbs(tab)*sizeof(mp_limb_t));
+	EVP_DigestFinal_ex(ctx,digest,NULL);
+	EVP_MD_CTX_free(ctx);
+}
+
+int paramsIsBin(const char* fname)
+{
+	char magic[8];
+	int fd = open(fname,O_RDONLY);
+	if (fd < 0) return 0;
+	ssize_t n = read(fd,magic,sizeof(magic));
+	close(fd);
+	return n == sizeof(magic) && memcmp(magic,PARAMS_MAGIC,sizeof(magic)) == 0;
+}
+
+int paramsReadBin(const char* fname, mpz_t q, mpz_t p, mpz_t g,
+		paramsTable* tab, unsigned char* digest)
+{
+	if (tab) tab->limbs = NULL;
+	int fd = open(fname,O_RDONLY);
+	if (fd < 0) return -1;
+	struct stat st;
+	if (fstat(fd,&st) != 0 || (size_t)st.st_size < sizeof(paramsHdr)) {
+		close(fd);
+		return -1;
+	}
+	unsigned char* m = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if (m == MAP_FAILED) return -1;
+	int rv = -1;
+	paramsHdr h;
+	memcpy(&h,m,sizeof(h));
+	if (memcmp(h.magic,PARAMS_MAGIC,sizeof(h.magic)) != 0 ||
+			h.version != PARAMS_VERSION) goto end;
+	if (h.limbBytes != sizeof(mp_limb_t) || h.order != PARAMS_ORDER) {
+		fprintf(stderr, "%s was written on a different architecture\n",fname);
+		goto end;
+	}
+	size_t total = 0;
+	for (int i = 0; i < 3; i++) {
+		if (h.nLimbs[i] == 0 || h.nLimbs[i] > INT_MAX) goto end;
+		total += h.nLimbs[i];
+	}
+	int hasTable = h.tab[3] != 0;
+	if (hasTable && (h.tab[0] > 16 || h.tab[1] > 16 || h.tab[3] > INT_MAX))
+		goto end;
+	if (sizeof(h) + (total + tableLimbs(h.tab))*sizeof(mp_limb_t)
+			!= (size_t)st.st_size) goto end;
+	const mp_limb_t* limbs = (const mp_limb_t*)(m + sizeof(h));
+	mpz_ptr dst[3] = {q,p,g};
+	for (int i = 0; i < 3; i++) {
+		mpz_t ro;
+		mpz_set(dst[i],mpz_roinit_n(ro,limbs,h.nLimbs[i]));
+		limbs += h.nLimbs[i];
+	}
+	/* make sure the file wasn't damaged: */
+	unsigned char valDigest[PARAMS_DIGEST_LEN];
+	paramsDigest(valDigest,q,p,g);
+	fileDigest(digest,valDigest,h.tab,hasTable ? limbs : NULL);
+	if (memcmp(digest,h.digest,PARAMS_DIGEST_LEN) != 0) {
+		fprintf(stderr, "%s: digest mismatch\n",fname);
+		goto end;
+	}
+	rv = 0;
+	if (tab && hasTable) {
+		tab->h = h.tab[0];
+		tab->v = h.tab[1];
+		tab->b = h.tab[2];
+		tab->entryLimbs = h.tab[3];
+		tab->limbs = limbs;
+		return 0; /* keep the mapping */
+	}
+end:
+	munmap(m,st.st_size);
+	return rv;
+}
+
+int paramsWriteBin(const char* fname, mpz_t q, mpz_t p, mpz_t g,
+		const paramsTable* tab)
+{
+	paramsHdr h;
+	memset(&h,0,sizeof(h));
+	memcpy(h.magic,PARAMS_MAGIC,sizeof(h.magic));
+	h.version = PARAMS_VERSION;
+	h.limbBytes = sizeof(mp_limb_t);
+	h.order = PARAMS_ORDER;
+	mpz_ptr src[3] = {q,p,g};
+	for (int i = 0; i < 3; i++) h.nLimbs[i] = mpz_size(src[i]);
+	if (tab) {
+		h.tab[0] = tab->h;
+		h.tab[1] = tab->v;
+		h.tab[2] = tab->b;
+		h.tab[3] = tab->entryLimbs;
+	}
+	unsigned char valDigest[PARAMS_DIGEST_LEN];
+	paramsDigest(valDigest,q,p,g);
+	fileDigest(h.digest,valDigest,h.tab,tab ? tab->limbs : NULL);
+	FILE* f = fopen(fname,"wb");
+	if (!f) return -1;
+	int rv = fwrite(&h,sizeof(h),1,f) == 1 ? 0 : -1;
+	for (int i = 0; i < 3 && rv == 0; i++) {
+		size_t n = mpz_size(src[i]);
+		if (fwrite(mpz_limbs_read(src[i]),sizeof(mp_limb_t),n,f) != n) rv = -1;
+	}
+	if (tab && rv == 0) {
+		size_t n = tableLimbs(h.tab);
+		if (fwrite(tab->limbs,sizeof(mp_limb_t),n,f) != n) rv = -1;
+	}
+	if (fclose(f) != 0) rv = -1;
+	return rv;
+}
+
+void paramsDigest(unsigned char* digest, mpz_t q, mpz_t p, mpz_t g)
+{
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx,EVP_sha256(),NULL);
+	mpz_ptr v[3] = {q,p,g};
+	for (int i = 0; i < 3; i++) {
+		size_t nB;
+		unsigned char* buf = Z2BYTES(NULL,&nB,v[i]);
+		LE(nB);
+		EVP_DigestUpdate(ctx,&nB_le,4);
+		EVP_DigestUpdate(ctx,buf,nB);
+		free(buf);
+	}
+	EVP_DigestFinal_ex(ctx,digest,NULL);
+	EVP_MD_CTX_free(ctx);
+}
+
+/* The trusted cache is a list of hex digests, one per line, in
+ * $DH_PARAMS_CACHE if set (empty disables the cache), otherwise in
+ * $XDG_CACHE_HOME/380-chat/trusted-params or ~/.cache/380-chat/... */
+static int paramsCachePath(char* path, int mkdirs)
+{
+	const char* env = getenv("DH_PARAMS_CACHE");
+	if (env) {
+		if (!*env || strlen(env) >= PATH_MAX) return -1;
+		strcpy(path,env);
+		return 0;
+	}
+	char dir[PATH_MAX];
+	const char* base = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	int n;
+	if (base && *base) n = snprintf(dir,PATH_MAX,"%s/380-chat",base);
+	else if (home && *home) n = snprintf(dir,PATH_MAX,"%s/.cache/380-chat",home);
+	else return -1;
+	if (n < 0 || n >= PATH_MAX - 20) return -1;
+	if (mkdirs) {
+		/* the parent might not exist either; mkdir failures will show up
+		 * when we try to open the file. */
+		*strrchr(dir,'/') = 0;
+		mkdir(dir,0700);
+		dir[strlen(dir)] = '/';
+		mkdir(dir,0700);
+	}
+	snprintf(path,PATH_MAX,"%s/trusted-params",dir);
+	return 0;
+}
+
+static void hexDigest(char* hex, const unsigned char* digest)
+{
+	for (size_t i = 0; i < PARAMS_DIGEST_LEN; i++)
+		sprintf(hex+2*i,"%02x",digest[i]);
+}
+
+int paramsTrusted(const unsigned char* digest)
+{
+	char path[PATH_MAX];
+	if (paramsCachePath(path,0) != 0) return 0;
+	int fd = open(path,O_RDONLY);
+	if (fd < 0) return 0;
+	FILE* f = fdopen(fd,"rb");
+	struct stat st;
+	/* only believe a cache that nobody else could have written to */
+	if (!f || fstat(fd,&st) != 0 || st.st_uid != getuid() ||
+			(st.st_mode & (S_IWGRP|S_IWOTH))) {
+		if (f) fclose(f); else close(fd);
+		return 0;
+	}
+	char want[2*PARAMS_DIGEST_LEN+1];
+	char line[2*PARAMS_DIGEST_LEN+2];
+	hexDigest(want,digest);
+	int found = 0;
+	while (!found && fgets(line,sizeof(line),f))
+		found = strncmp(line,want,2*PARAMS_DIGEST_LEN) == 0;
+	fclose(f);
+	return found;
+}
+
+int paramsTrust(const unsigned char* digest)
+{
+	char path[PATH_MAX];
+	if (paramsCachePath(path,1) != 0) return -1;
+	int fd = open(path,O_WRONLY|O_CREAT|O_APPEND,0600);
+	if (fd < 0) return -1;
+	char line[2*PARAMS_DIGEST_LEN+1];
+	hexDigest(line,digest);
+	line[2*PARAMS_DIGEST_LEN] = '\n';
+	int rv = write(fd,line,sizeof(line)) == sizeof(line) ? 0 : -1;
+	close(fd);
+	return rv;
+}
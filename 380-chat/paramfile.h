@@ -0,0 +1,47 @@
+/* Binary parameter files, and a cache of parameters we have validated. */
+#pragma once
+#include <gmp.h>
+#include <stdint.h>
+
+#define PARAMS_DIGEST_LEN 32 /* SHA256 */
+
+/** optional precomputed table for g stored after q,p,g (see initComb in
+ * dh.c).  Entries are laid out [k][s], each padded to entryLimbs limbs. */
+typedef struct {
+	uint32_t h, v, b;
+	uint32_t entryLimbs;
+	const mp_limb_t* limbs;
+} paramsTable;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** 1 if fname starts with the binary params magic, 0 otherwise */
+int paramsIsBin(const char* fname);
+/** map a binary params file and load q,p,g (which must be initialized).
+ * The stored digest (of paramsDigest's value digest, then the table) is
+ * checked against the contents and copied to digest.
+ * If tab is not NULL and the file has a table, tab->limbs will point into
+ * the mapping, which then stays in place for the life of the process.
+ * Otherwise tab->limbs is set to NULL.
+ * @return 0 on success */
+int paramsReadBin(const char* fname, mpz_t q, mpz_t p, mpz_t g,
+		paramsTable* tab, unsigned char* digest);
+/** write q,p,g (and tab, unless NULL) in the binary format.
+ * @return 0 on success */
+int paramsWriteBin(const char* fname, mpz_t q, mpz_t p, mpz_t g,
+		const paramsTable* tab);
+/** SHA256 over a length-prefixed, little endian encoding of q,p,g (it
+ * doesn't depend on limb size).  init uses it as the trusted cache entry for
+ * text params files.  Binary files are trusted by their own digest (see
+ * paramsReadBin), which also covers the table, so trusting a file in one
+ * format doesn't carry over to the other. */
+void paramsDigest(unsigned char* digest, mpz_t q, mpz_t p, mpz_t g);
+/** 1 if digest is listed in the trusted cache, i.e. we've fully validated
+ * these parameters before.  See paramsCachePath for the location. */
+int paramsTrusted(const unsigned char* digest);
+/** record digest in the trusted cache (after a full validation!) */
+int paramsTrust(const unsigned char* digest);
+#ifdef __cplusplus
+}
+#endif
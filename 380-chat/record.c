@@ -0,0 +1,25 @@
+#include "record.h"
+#include <endian.h>
+#include <string.h>
+
+void recHeader(unsigned char* hdr, size_t len, unsigned flags)
+{
+	uint32_t h = htole32((uint32_t)len | (flags & (REC_MORE | REC_CTRL)));
+	memcpy(hdr,&h,REC_HDR);
+}
+
+int recParse(const unsigned char* in, size_t len, const unsigned char** body,
+		size_t* blen, unsigned* flags)
+{
+	uint32_t h;
+	if (len < REC_HDR) return 0;
+	memcpy(&h,in,REC_HDR);
+	h = le32toh(h);
+	size_t n = h & ~(REC_MORE | REC_CTRL);
+	if (n == 0 || n > REC_MAX) return -1;
+	if (len - REC_HDR < n) return 0;
+	*body = in + REC_HDR;
+	*blen = n;
+	*flags = h & (REC_MORE | REC_CTRL);
+	return REC_HDR + n;
+}
@@ -0,0 +1,47 @@
+/* Record framing for the encrypted channel.  Every record is
+ *
+ *   +--------------------------------------+-------------------------+
+ *   | hdr (little endian, 4 bytes)         | body (len bytes)        |
+ *   +--------------------------------------+-------------------------+
+ *   hdr = len | REC_MORE if another record of the same message follows
+ *             | REC_CTRL if it's a control record (see below)
+ *
+ * and the body is one ciphertext.  A message longer than REC_MAX_PLAIN is
+ * sent as several records, each encrypted on its own, so the sender
+ * needs no buffer bigger than one record.  The server puts the message
+ * back together before passing it on (so that messages from different
+ * senders don't interleave; see relay in server.c), and so does the final
+ * reader.
+ *
+ * A control record is for the endpoints rather than the person reading:
+ * its plaintext is a REC_CTRL_... type byte and then the payload.  The
+ * server sends them (a resumption ticket, say) and doesn't relay any. */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define REC_HDR       4
+/** most plaintext bytes in one record */
+#define REC_MAX_PLAIN (1 << 14)
+/** most body bytes in one record (room for padding or a tag) */
+#define REC_MAX       (REC_MAX_PLAIN + 64)
+#define REC_MORE      0x80000000u
+#define REC_CTRL      0x40000000u
+/** control record types */
+#define REC_CTRL_TICKET 1 /* a session ticket (see handshake.h) */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** write the header for a body of len bytes to hdr.  flags are REC_MORE
+ * and/or REC_CTRL, or 0 */
+void recHeader(unsigned char* hdr, size_t len, unsigned flags);
+/** look for a whole record at the start of in[0..len).
+ * @param body, blen, flags are set to the record's body and flags
+ * @return size of the record (header included), 0 if in holds only part of
+ * one, or -1 if the header is bad */
+int recParse(const unsigned char* in, size_t len, const unsigned char** body,
+		size_t* blen, unsigned* flags);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,149 @@
+/* Per-thread DRBG: ChaCha20 keyed from getrandom(), with "fast key erasure":
+ * each refill of the output pool also produces the next key, and the old
+ * key is discarded, so a later state compromise can't recover past output.
+ *
+ *            one refill (ChaCha20 keystream under key k_i)
+ *  +-------------+------------------------------------------+
+ *  | k_(i+1) 32B |         output pool (RNG_POOL bytes)     |
+ *  +-------------+------------------------------------------+
+ *
+ * Bytes are served from the pool and wiped as they go.  We reseed from the
+ * kernel after RNG_RESEED bytes, and in a child after fork() (detected via
+ * a generation counter bumped by a pthread_atfork handler, so the common
+ * path makes no system calls at all). */
+#include "rng.h"
+#include <openssl/evp.h>
+#include <sys/random.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RNG_KEYLEN 32
+#define RNG_POOL   4096
+#define RNG_RESEED (1UL << 24) /* bytes of output between kernel reseeds */
+
+typedef struct {
+	EVP_CIPHER_CTX* ctx;
+	unsigned char key[RNG_KEYLEN];
+	unsigned char buf[RNG_KEYLEN + RNG_POOL];
+	size_t avail;      /* unread bytes at the end of buf */
+	size_t sinceSeed;  /* output since last reseed */
+	unsigned long gen; /* forkGen when we were seeded */
+	int seeded;
+} rngState;
+
+static __thread rngState* rs;
+static pthread_key_t rsKey;
+static pthread_once_t rsOnce = PTHREAD_ONCE_INIT;
+static volatile unsigned long forkGen = 0;
+
+static void afterFork(void)
+{
+	forkGen++;
+}
+
+static void freeState(void* arg)
+{
+	rngState* s = arg;
+	if (!s) return;
+	EVP_CIPHER_CTX_free(s->ctx);
+	/* memset could be elided for memory we're about to free: */
+	OPENSSL_cleanse(s,sizeof(*s));
+	free(s);
+}
+
+static void initOnce(void)
+{
+	pthread_key_create(&rsKey,freeState);
+	pthread_atfork(NULL,NULL,afterFork);
+}
+
+/* fill buf from the kernel, retrying on EINTR and short reads */
+static int osRandom(unsigned char* buf, size_t len)
+{
+	while (len) {
+		ssize_t n = getrandom(buf,len,0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int reseed(rngState* s)
+{
+	unsigned char seed[RNG_KEYLEN];
+	if (osRandom(seed,RNG_KEYLEN) != 0) return -1;
+	/* mix into (rather than replace) the old key, in case this is a
+	 * freshly forked child that also inherited it: */
+	for (size_t i = 0; i < RNG_KEYLEN; i++) s->key[i] ^= seed[i];
+	OPENSSL_cleanse(seed,RNG_KEYLEN);
+	OPENSSL_cleanse(s->buf,sizeof(s->buf));
+	s->avail = 0;
+	s->sinceSeed = 0;
+	s->gen = forkGen;
+	s->seeded = 1;
+	return 0;
+}
+
+static int refill(rngState* s)
+{
+	/* key changes every time, so an all-zero nonce is fine */
+	static const unsigned char iv[16] = {0};
+	int len;
+	memset(s->buf,0,sizeof(s->buf));
+	if (EVP_EncryptInit_ex(s->ctx,EVP_chacha20(),NULL,s->key,iv) != 1 ||
+			EVP_EncryptUpdate(s->ctx,s->buf,&len,s->buf,sizeof(s->buf)) != 1)
+		return -1;
+	memcpy(s->key,s->buf,RNG_KEYLEN);
+	OPENSSL_cleanse(s->buf,RNG_KEYLEN);
+	s->avail = RNG_POOL;
+	return 0;
+}
+
+static rngState* getState(void)
+{
+	if (rs) return rs;
+	pthread_once(&rsOnce,initOnce);
+	rngState* s = calloc(1,sizeof(rngState));
+	if (!s) return NULL;
+	if (!(s->ctx = EVP_CIPHER_CTX_new())) {
+		free(s);
+		return NULL;
+	}
+	pthread_setspecific(rsKey,s);
+	return rs = s;
+}
+
+int randBytes(void* out, size_t len)
+{
+	rngState* s = getState();
+	if (!s) return -1;
+	unsigned char* o = out;
+	while (len) {
+		if (!s->seeded || s->gen != forkGen || s->sinceSeed >= RNG_RESEED) {
+			if (reseed(s) != 0) return -1;
+		}
+		if (!s->avail && refill(s) != 0) return -1;
+		size_t n = (len < s->avail) ? len : s->avail;
+		unsigned char* src = s->buf + sizeof(s->buf) - s->avail;
+		memcpy(o,src,n);
+		memset(src,0,n); /* never hand out the same bytes twice */
+		s->avail -= n;
+		s->sinceSeed += n;
+		o += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void randWipe(void)
+{
+	if (!rs) return;
+	pthread_setspecific(rsKey,NULL);
+	freeState(rs);
+	rs = NULL;
+}
@@ -0,0 +1,17 @@
+/* Buffered, per-thread CSPRNG.  Seeded from getrandom(), reseeded after
+ * fork() and periodically thereafter. */
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** fill buf with len cryptographically secure random bytes.
+ * @return 0 on success, -1 if the kernel couldn't give us a seed. */
+int randBytes(void* buf, size_t len);
+/** wipe the calling thread's generator state.  The next call to randBytes
+ * on this thread will reseed.  (Done automatically at thread exit.) */
+void randWipe(void);
+#ifdef __cplusplus
+}
+#endif
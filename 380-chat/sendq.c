@@ -0,0 +1,242 @@
+#include "sendq.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+struct sqSeg {
+	sqSeg* next;
+	const unsigned char* p;
+	size_t len;
+	unsigned char* own;     /* == p if the queue owns the bytes, else NULL */
+	size_t cap;             /* of own */
+	uint32_t zcId;          /* last zerocopy send that read from p */
+	int zcUsed;             /* there was one */
+};
+
+void sqInit(sendq* q, int fd)
+{
+	int one = 1;
+	memset(q,0,sizeof(*q));
+	q->zc = (setsockopt(fd,SOL_SOCKET,SO_ZEROCOPY,&one,sizeof(one)) == 0);
+}
+
+static void push(sqSeg** head, sqSeg** tail, sqSeg* s)
+{
+	s->next = NULL;
+	if (*tail) (*tail)->next = s;
+	else *head = s;
+	*tail = s;
+}
+
+unsigned char* sqReserve(sendq* q, size_t n)
+{
+	sqSeg* t = q->tail;
+	if (t && t->own && t->cap - t->len >= n) return t->own + t->len;
+	size_t cap = n > SQ_CHUNK ? n : SQ_CHUNK;
+	sqSeg* s = malloc(sizeof(sqSeg) + cap);
+	if (!s) return NULL;
+	memset(s,0,sizeof(*s));
+	s->own = (unsigned char*)(s + 1);
+	s->p = s->own;
+	s->cap = cap;
+	push(&q->head,&q->tail,s);
+	return s->own;
+}
+
+void sqCommit(sendq* q, size_t n)
+{
+	q->tail->len += n;
+	q->len += n;
+}
+
+int sqAppend(sendq* q, const void* p, size_t n)
+{
+	unsigned char* dst = sqReserve(q,n);
+	if (!dst) return -1;
+	memcpy(dst,p,n);
+	sqCommit(q,n);
+	return 0;
+}
+
+int sqRef(sendq* q, const void* p, size_t n)
+{
+	if (n == 0) return 0;
+	sqSeg* s = calloc(1,sizeof(sqSeg));
+	if (!s) return -1;
+	s->p = p;
+	s->len = n;
+	push(&q->head,&q->tail,s);
+	q->len += n;
+	return 0;
+}
+
+/* has zerocopy send id completed? */
+static int completed(const sendq* q, uint32_t id)
+{
+	return (int32_t)(id - q->zcTail) < 0;
+}
+
+/* head has been sent in full */
+static void retire(sendq* q)
+{
+	sqSeg* s = q->head;
+	if (!(q->head = s->next)) q->tail = NULL;
+	q->off = 0;
+	if (s->zcUsed && !completed(q,s->zcId))
+		push(&q->wait,&q->waitTail,s); /* the kernel may still read it */
+	else
+		free(s);
+}
+
+int sqPrepare(const sendq* q, struct iovec* iov, int max)
+{
+	int n = 0;
+	size_t off = q->off;
+	for (sqSeg* s = q->head; s && n < max; s = s->next) {
+		iov[n].iov_base = (void*)(s->p + off);
+		iov[n].iov_len = s->len - off;
+		off = 0;
+		n++;
+	}
+	return n;
+}
+
+void sqSent(sendq* q, size_t n, int zc)
+{
+	/* NOTE: the kernel numbers each zerocopy sendmsg that sent anything,
+	 * starting from 0, as we do here. */
+	uint32_t id = zc ? q->zcNext++ : 0;
+	q->len -= n;
+	while (n) {
+		sqSeg* s = q->head;
+		size_t k = s->len - q->off;
+		if (zc) {
+			s->zcUsed = 1;
+			s->zcId = id;
+		}
+		if (n < k) {
+			q->off += n;
+			break;
+		}
+		n -= k;
+		retire(q);
+	}
+}
+
+int sqFlush(sendq* q, int fd)
+{
+	int noZc = 0;
+	while (q->head) {
+		struct iovec iov[SQ_IOV];
+		int n = sqPrepare(q,iov,SQ_IOV);
+		int zc = q->zc && !noZc && q->len >= SQ_ZC_MIN &&
+			q->zcNext - q->zcTail < SQ_ZC_RING;
+		struct msghdr m = {.msg_iov = iov, .msg_iovlen = n};
+		ssize_t r = sendmsg(fd,&m,MSG_NOSIGNAL | MSG_DONTWAIT |
+				(zc ? MSG_ZEROCOPY : 0));
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if (r < 0 && errno == ENOBUFS && zc) {
+			noZc = 1; /* out of option memory for notifications; copy */
+			continue;
+		}
+		if (r < 0) return -1;
+		sqSent(q,r,zc);
+	}
+	return 0;
+}
+
+int sqReap(sendq* q, int fd)
+{
+	for (;;) {
+		char ctl[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+		struct msghdr m = {.msg_control = ctl, .msg_controllen = sizeof(ctl)};
+		if (recvmsg(fd,&m,MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		for (struct cmsghdr* c = CMSG_FIRSTHDR(&m); c; c = CMSG_NXTHDR(&m,c)) {
+			if (!(c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) &&
+					!(c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR))
+				continue;
+			struct sock_extended_err* e = (void*)CMSG_DATA(c);
+			if (e->ee_origin != SO_EE_ORIGIN_ZEROCOPY || e->ee_errno) continue;
+			/* ids ee_info..ee_data (inclusive) are done */
+			uint32_t id = e->ee_info;
+			do {
+				if (id - q->zcTail < q->zcNext - q->zcTail)
+					q->zcDone[id % SQ_ZC_RING] = 1;
+			} while (id++ != e->ee_data);
+		}
+	}
+	while (q->zcTail != q->zcNext && q->zcDone[q->zcTail % SQ_ZC_RING]) {
+		q->zcDone[q->zcTail % SQ_ZC_RING] = 0;
+		q->zcTail++;
+	}
+	/* the wait list is in send order, so it's a prefix that's done */
+	while (q->wait && completed(q,q->wait->zcId)) {
+		sqSeg* s = q->wait;
+		if (!(q->wait = s->next)) q->waitTail = NULL;
+		free(s);
+	}
+	return 0;
+}
+
+int sqIdle(const sendq* q)
+{
+	return !q->head && !q->wait;
+}
+
+int sqDrain(sendq* q, int fd, int timeout)
+{
+	while (!sqIdle(q)) {
+		if (sqFlush(q,fd) != 0) return -1;
+		if (sqIdle(q)) break;
+		/* POLLERR is how completions (on the error queue) show up */
+		struct pollfd p = {.fd = fd, .events = q->head ? POLLOUT : 0};
+		int r = poll(&p,1,timeout);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		if ((p.revents & POLLERR) && sqReap(q,fd) != 0) return -1;
+		if ((p.revents & (POLLHUP | POLLNVAL)) && !(p.revents & POLLERR))
+			return -1;
+	}
+	return 0;
+}
+
+void sqFree(sendq* q, int fd)
+{
+	if (q->wait && fd >= 0) {
+		/* reset rather than linger, which drops whatever still points at
+		 * the segments we're about to free */
+		struct linger l = {.l_onoff = 1, .l_linger = 0};
+		setsockopt(fd,SOL_SOCKET,SO_LINGER,&l,sizeof(l));
+	}
+	for (sqSeg* s = q->head; s;) {
+		sqSeg* t = s->next;
+		free(s);
+		s = t;
+	}
+	for (sqSeg* s = q->wait; s;) {
+		sqSeg* t = s->next;
+		free(s);
+		s = t;
+	}
+	memset(q,0,sizeof(*q));
+}
@@ -0,0 +1,80 @@
+/* Output queue for a socket, sent with sendmsg straight from where the
+ * data is: a list of segments, each either a chunk the queue owns (records
+ * are sealed directly into these; see sqReserve) or a piece of the
+ * caller's memory (sqRef), so a header, a ciphertext and a tag can go out
+ * in one call without being copied together first.
+ *
+ * When at least SQ_ZC_MIN bytes are ready, they are sent with MSG_ZEROCOPY
+ * (if the socket allows it).  The kernel then reads the pages after
+ * sendmsg returns, so segments stay allocated (and external ones must stay
+ * put) until the completion for the last call that sent from them has
+ * been read off the socket's error queue by sqReap. */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/** payloads smaller than this aren't worth pinning pages for */
+#define SQ_ZC_MIN   (32 << 10)
+/** size of the chunks the queue allocates for itself */
+#define SQ_CHUNK    (64 << 10)
+/** zerocopy calls in flight at once, at most */
+#define SQ_ZC_RING  256
+/** segments per sendmsg */
+#define SQ_IOV      64
+
+struct iovec;
+
+typedef struct sqSeg sqSeg;
+
+typedef struct {
+	sqSeg* head;            /* unsent, oldest first */
+	sqSeg* tail;
+	size_t off;             /* bytes of head already sent */
+	size_t len;             /* unsent bytes */
+	sqSeg* wait;            /* sent with MSG_ZEROCOPY, not yet completed */
+	sqSeg* waitTail;
+	int zc;                 /* SO_ZEROCOPY is on for the socket */
+	uint32_t zcNext;        /* id of the next zerocopy send */
+	uint32_t zcTail;        /* every id before this has completed */
+	unsigned char zcDone[SQ_ZC_RING]; /* for ids in [zcTail,zcNext) */
+} sendq;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** set up q for socket fd, turning on SO_ZEROCOPY if we can */
+void sqInit(sendq* q, int fd);
+/** n bytes of space at the end of the queue, to be filled and then added
+ * with sqCommit.  @return NULL if out of memory */
+unsigned char* sqReserve(sendq* q, size_t n);
+/** add the first n bytes of the last sqReserve to the queue */
+void sqCommit(sendq* q, size_t n);
+/** copy p[0..n) to the end of the queue.  @return 0, or -1 if out of memory */
+int sqAppend(sendq* q, const void* p, size_t n);
+/** queue p[0..n) without copying it.  p must not change or go away until
+ * sqIdle(q).  @return 0, or -1 if out of memory */
+int sqRef(sendq* q, const void* p, size_t n);
+/** send what the socket will take without blocking.
+ * @return 0, or -1 on an error (the connection is no good) */
+int sqFlush(sendq* q, int fd);
+/** for sending some other way (io_uring, say): describe the unsent data
+ * in at most max iovecs.  They stay valid until sqSent, even if more is
+ * queued meanwhile.  @return how many iovecs were used */
+int sqPrepare(const sendq* q, struct iovec* iov, int max);
+/** n bytes of what sqPrepare described were sent (with MSG_ZEROCOPY if zc) */
+void sqSent(sendq* q, size_t n, int zc);
+/** read zerocopy completions and free what they release.  Call when the
+ * socket polls POLLERR (EPOLLERR).  @return 0, or -1 on a real error */
+int sqReap(sendq* q, int fd);
+/** 1 if nothing is queued or in flight */
+int sqIdle(const sendq* q);
+/** block until q is idle.  timeout is how many ms to wait for the socket
+ * each time it isn't ready (-1: no limit).
+ * @return 0 once idle, -1 on an error or timeout */
+int sqDrain(sendq* q, int fd, int timeout);
+/** free everything.  If zerocopy sends are still in flight and fd >= 0,
+ * the connection is set to reset on close so the kernel lets go of them. */
+void sqFree(sendq* q, int fd);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,786 @@
+/* The server is a single epoll loop over non-blocking sockets (or, built
+ * with `make uring=1`, a single io_uring loop; see the end of the file):
+ *
+ *  - accept: make a session, pick its ephemeral key (from the pool) and
+ *    queue our hello, B || Y, right away.  It doesn't depend on anything
+ *    the client says, so the handshake costs one round trip.
+ *  - readable: append to the session's input buffer.  Before the handshake
+ *    that is the client's hello, A || X (serialize_mpz framing); once it is
+ *    complete the session waits for the end of this loop iteration, and all
+ *    the sessions that got that far are keyed together by dh3FinalBatchG.
+ *    A client may instead hand back a ticket from an earlier session
+ *    (handshake.h); if it's good, the session is keyed from it on the spot
+ *    and we answer HS_ACCEPT, else HS_REJECT and we wait for a full hello.
+ *    Either way, a fresh ticket follows as the session's first record.
+ *    After the handshake, input is a stream of records (record.h) to relay.
+ *  - writable: flush the output queue (sendq.h), and stop asking for
+ *    EPOLLOUT once it is empty.
+ *
+ * Nothing blocks, so one slow or malicious client can't stall the others;
+ * a client that doesn't read its output is dropped once it has
+ * SERVER_MAX_BACKLOG bytes queued.  Messages are relayed whole (see relay),
+ * so none can be longer than SERVER_MAX_MESSAGE. */
+#define _GNU_SOURCE /* accept4 */
+#include "server.h"
+#include "util.h"
+#include "handshake.h"
+#include "record.h"
+#include "aead.h"
+#include "sendq.h"
+#include "ticket.h"
+#include "hkdf.h"
+#ifdef SERVER_URING
+#include "uring.h"
+#include <sys/uio.h>
+#else
+#include <sys/epoll.h>
+#endif
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SERVER_MAX_EVENTS  256
+#define SERVER_READ_CHUNK  4096
+#define SERVER_MAX_BACKLOG (8 << 20) /* output we'll queue for one client */
+
+/* growable byte buffer; data lives in buf[0..len) */
+typedef struct {
+	unsigned char* buf;
+	size_t len;
+	size_t cap;
+} sbuf;
+
+typedef struct {
+	int fd;
+	int open;        /* handshake finished */
+	mpz_t y, Y;      /* our ephemeral key for this session */
+	mpz_t A, X;      /* the client's keys, once received */
+	unsigned char fp[KS_FP_LEN]; /* A's fingerprint, for its tickets */
+	aeadChan ch;     /* once open */
+	sbuf in;
+	sbuf part;       /* a long message from the client, until its end */
+	sendq out;
+	int waiting;     /* in srv.pending */
+	size_t idx;      /* position in srv.open, if open */
+#ifdef SERVER_URING
+	int ops;         /* requests in flight */
+	int sending;     /* one of them is a sendmsg from iov */
+	int dead;        /* closed; freed once ops is 0 */
+	struct iovec iov[SQ_IOV];
+	struct msghdr msg;
+#else
+	int wantOut;     /* registered for EPOLLOUT */
+#endif
+} session;
+
+static struct {
+	const dhGroup* G;
+	int aead;              /* cipher for the sessions (AEAD_...) */
+	mpz_t b, B;            /* long term key */
+	const keyStore* peers; /* clients we accept, or NULL for anyone */
+	ticketKeys tickets;
+#ifdef SERVER_URING
+	uring ring;
+	uringBufs bufs;        /* for receives */
+	size_t nDead;          /* closed sessions not yet freed */
+#else
+	int epfd;
+#endif
+	int lsock;
+	session** byFd;        /* sessions indexed by fd */
+	size_t nByFd;
+	session** open;        /* sessions that can receive messages */
+	size_t nOpen, capOpen;
+	session** pending;     /* hello received, waiting for the batch */
+	size_t nPending, capPending;
+} srv;
+
+static volatile sig_atomic_t stopping = 0;
+
+void serverStop(void)
+{
+	stopping = 1;
+}
+
+static int sbufAppend(sbuf* s, const void* p, size_t n)
+{
+	if (s->len + n > s->cap) {
+		size_t cap = s->cap ? s->cap : 256;
+		while (cap < s->len + n) cap *= 2;
+		unsigned char* buf = realloc(s->buf,cap);
+		if (!buf) return -1;
+		s->buf = buf;
+		s->cap = cap;
+	}
+	memcpy(s->buf + s->len,p,n);
+	s->len += n;
+	return 0;
+}
+
+static void sbufConsume(sbuf* s, size_t n)
+{
+	memmove(s->buf,s->buf + n,s->len - n);
+	s->len -= n;
+}
+
+static void sbufFree(sbuf* s)
+{
+	if (s->buf) memset(s->buf,0,s->cap);
+	free(s->buf);
+	memset(s,0,sizeof(*s));
+}
+
+/* add p to one of the pointer arrays above */
+static int push(session*** v, size_t* n, size_t* cap, session* p)
+{
+	if (*n == *cap) {
+		size_t c = *cap ? 2 * *cap : 64;
+		session** w = realloc(*v,c*sizeof(session*));
+		if (!w) return -1;
+		*v = w;
+		*cap = c;
+	}
+	(*v)[(*n)++] = p;
+	return 0;
+}
+
+static void freeSession(session* s)
+{
+	sqFree(&s->out,-1);
+	if (s->open) aeadFree(&s->ch);
+	shredZ(s->y);
+	mpz_clears(s->y,s->Y,s->A,s->X,NULL);
+	sbufFree(&s->in);
+	sbufFree(&s->part);
+	free(s);
+}
+
+static void closeSession(session* s)
+{
+	if (s->open) {
+		/* swap-remove from srv.open */
+		session* last = srv.open[--srv.nOpen];
+		srv.open[s->idx] = last;
+		last->idx = s->idx;
+	}
+	if (s->waiting)
+		for (size_t i = 0; i < srv.nPending; i++)
+			if (srv.pending[i] == s) srv.pending[i] = NULL;
+	srv.byFd[s->fd] = NULL;
+#ifdef SERVER_URING
+	/* ends the receive and any send in flight; their completions are
+	 * what finally let us free s */
+	shutdown(s->fd,SHUT_RDWR);
+	close(s->fd);
+	s->dead = 1;
+	if (s->ops) srv.nDead++;
+	else freeSession(s);
+#else
+	epoll_ctl(srv.epfd,EPOLL_CTL_DEL,s->fd,NULL);
+	if (s->out.wait) sqFree(&s->out,s->fd); /* before close; see sqFree */
+	close(s->fd);
+	freeSession(s);
+#endif
+}
+
+#ifdef SERVER_URING
+static int armSend(session* s);
+
+/* send s->out.  @return -1 if s had to be closed */
+static int flush(session* s)
+{
+	if (s->out.len > SERVER_MAX_BACKLOG ||
+			(!s->sending && s->out.head && armSend(s) != 0)) {
+		closeSession(s);
+		return -1;
+	}
+	return 0;
+}
+#else
+static void watch(session* s, int out)
+{
+	if (s->wantOut == out) return;
+	struct epoll_event ev = {.events = EPOLLIN | (out ? EPOLLOUT : 0),
+		.data.fd = s->fd};
+	epoll_ctl(srv.epfd,EPOLL_CTL_MOD,s->fd,&ev);
+	s->wantOut = out;
+}
+
+/* write what we can of s->out.  @return -1 if s had to be closed */
+static int flush(session* s)
+{
+	if (sqFlush(&s->out,s->fd) != 0 || s->out.len > SERVER_MAX_BACKLOG) {
+		closeSession(s);
+		return -1;
+	}
+	watch(s,s->out.head != NULL);
+	return 0;
+}
+#endif
+
+/* seal msg[0..len) into t's queue, as records of at most REC_MAX_PLAIN
+ * bytes.  @return -1 if t had to be closed */
+static int relayTo(session* t, const unsigned char* msg, size_t len)
+{
+	size_t nrec = len ? (len + REC_MAX_PLAIN - 1) / REC_MAX_PLAIN : 1;
+	/* don't let a client that isn't reading run us out of memory */
+	if (t->out.len + len + nrec*(REC_HDR + AEAD_TAG_LEN) > SERVER_MAX_BACKLOG) {
+		closeSession(t);
+		return -1;
+	}
+	size_t off = 0;
+	for (size_t i = 0; i < nrec; i++) {
+		size_t n = len - off;
+		if (n > REC_MAX_PLAIN) n = REC_MAX_PLAIN;
+		/* sealed straight into t's queue, and sent from there */
+		unsigned char* rec = sqReserve(&t->out,REC_HDR + n + AEAD_TAG_LEN);
+		int m = rec ? aeadSeal(&t->ch,rec,msg + off,n,
+				off + n < len ? REC_MORE : 0) : -1;
+		if (m < 0) {
+			closeSession(t);
+			return -1;
+		}
+		sqCommit(&t->out,m);
+		off += n;
+	}
+	return flush(t);
+}
+
+/* a record arrived on s: send it to everyone else.  The records of a long
+ * message (REC_MORE) are held in s->part until the last one is in, and then
+ * the whole message goes to each of the others in one go.  Passing them on
+ * one at a time would interleave the records of two clients sending at
+ * once (which the recipients would join into one garbled message), and
+ * hand a session that opened midway the tail of a message without its
+ * head. */
+static void relay(session* s, const unsigned char* ct, size_t len,
+		unsigned flags)
+{
+	unsigned char pt[REC_MAX];
+	/* control records are ours to send, not the clients' */
+	int n = (flags & REC_CTRL) ? -1 : aeadOpen(&s->ch,pt,ct,len,flags);
+	if (n < 0 || n > REC_MAX_PLAIN ||
+			s->part.len + n > SERVER_MAX_MESSAGE) {
+		closeSession(s);
+		return;
+	}
+	const unsigned char* msg = pt;
+	size_t mlen = n;
+	if (s->part.len || (flags & REC_MORE)) {
+		int rv = sbufAppend(&s->part,pt,n);
+		memset(pt,0,n);
+		if (rv != 0) {
+			closeSession(s);
+			return;
+		}
+		if (flags & REC_MORE) return;
+		msg = s->part.buf;
+		mlen = s->part.len;
+	}
+	/* NOTE: relayTo may close (and swap-remove) a session, so go backwards */
+	for (size_t i = srv.nOpen; i-- > 0;)
+		if (srv.open[i] != s) relayTo(srv.open[i],msg,mlen);
+	memset(pt,0,sizeof(pt));
+	if (s->part.len) {
+		memset(s->part.buf,0,s->part.len);
+		s->part.len = 0;
+	}
+}
+
+#ifdef SERVER_URING
+static int armRecv(session* s);
+#endif
+
+/* a client connected on fd: say hello */
+static void newSession(int fd)
+{
+	if ((size_t)fd >= srv.nByFd) {
+		size_t n = srv.nByFd ? srv.nByFd : 1024;
+		while (n <= (size_t)fd) n *= 2;
+		session** v = realloc(srv.byFd,n*sizeof(session*));
+		if (!v) {
+			close(fd);
+			return;
+		}
+		memset(v + srv.nByFd,0,(n - srv.nByFd)*sizeof(session*));
+		srv.byFd = v;
+		srv.nByFd = n;
+	}
+	session* s = calloc(1,sizeof(session));
+	if (!s) {
+		close(fd);
+		return;
+	}
+	s->fd = fd;
+	sqInit(&s->out,fd);
+	mpz_inits(s->y,s->Y,s->A,s->X,NULL);
+	srv.byFd[fd] = s;
+#ifdef SERVER_URING
+	int rv = armRecv(s);
+#else
+	struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+	int rv = epoll_ctl(srv.epfd,EPOLL_CTL_ADD,fd,&ev);
+#endif
+	/* our hello: B || Y */
+	unsigned char hello[HS_MAX_HELLO];
+	if (srv.G == &dhGroupFF) rv |= dhGenEphemeral(s->y,s->Y);
+	else rv |= dhGenG(srv.G,s->y,s->Y);
+	int n = rv ? -1 : hsEncode(hello,sizeof(hello),srv.B,s->Y);
+	if (n < 0 || sqAppend(&s->out,hello,n) != 0) {
+		closeSession(s);
+		return;
+	}
+	flush(s);
+}
+
+/* give s a ticket for next time, sealing secret (HS_SECRET_LEN bytes),
+ * in a control record.  @return -1 if s had to be closed */
+static int issueTicket(session* s, const unsigned char* secret)
+{
+	unsigned char pt[1 + TICKET_LEN];
+	pt[0] = REC_CTRL_TICKET;
+	if (tkIssue(&srv.tickets,pt + 1,secret,s->fp) != 0)
+		return 0; /* no ticket this time; the session is fine */
+	unsigned char* rec = sqReserve(&s->out,
+			REC_HDR + sizeof(pt) + AEAD_TAG_LEN);
+	int m = rec ? aeadSeal(&s->ch,rec,pt,sizeof(pt),REC_CTRL) : -1;
+	if (m < 0) {
+		closeSession(s);
+		return -1;
+	}
+	sqCommit(&s->out,m);
+	return flush(s);
+}
+
+static void handleInput(session* s);
+
+/* the handshake on s is done, and km (AEAD_KM_LEN + HS_SECRET_LEN bytes)
+ * is the outcome: start relaying */
+static void openSession(session* s, const unsigned char* km, int side)
+{
+	if (aeadInit(&s->ch,srv.aead,km,side) != 0) {
+		closeSession(s);
+		return;
+	}
+	if (push(&srv.open,&srv.nOpen,&srv.capOpen,s) != 0) {
+		aeadFree(&s->ch);
+		closeSession(s);
+		return;
+	}
+	s->open = 1;
+	s->waiting = 0;
+	s->idx = srv.nOpen - 1;
+	shredZ(s->y); /* only needed for the handshake */
+	if (issueTicket(s,km + AEAD_KM_LEN) != 0) return;
+	/* anything that came in behind the hello */
+	if (s->in.len) handleInput(s);
+}
+
+/* s->in starts with a resumption hello */
+static void resume(session* s)
+{
+	const unsigned char* ticket;
+	const unsigned char* nonce;
+	unsigned char secret[HS_SECRET_LEN];
+	unsigned char km[AEAD_KM_LEN + HS_SECRET_LEN];
+	unsigned char dh[HKDF_LEN];
+	int withDH;
+	int r = hsDecodeResume(srv.G,s->in.buf,s->in.len,&ticket,&nonce,s->X,&withDH);
+	if (r < 0) {
+		closeSession(s);
+		return;
+	}
+	if (r == 0) return;
+	/* the ticket says who the client is, so peers is checked here too.
+	 * NOTE: the one dhFinal (with HS_RESUME_DH) isn't batched; it's still
+	 * a third of the work of a full handshake. */
+	int ok = tkOpen(&srv.tickets,ticket,secret,s->fp) == 0 &&
+		(!srv.peers || ksFind(srv.peers,s->fp)) &&
+		(!withDH || dhFinalG(srv.G,s->y,s->Y,s->X,dh,sizeof(dh)) == 0) &&
+		hsResumeKeys(ticket,secret,nonce,s->Y,withDH ? dh : NULL,
+				withDH ? sizeof(dh) : 0,km,sizeof(km)) == 0;
+	memset(secret,0,sizeof(secret));
+	memset(dh,0,sizeof(dh));
+	sbufConsume(&s->in,r);
+	uint32_t answer = htole32(ok ? HS_ACCEPT : HS_REJECT);
+	if (sqAppend(&s->out,&answer,4) != 0) closeSession(s);
+	else if (ok) openSession(s,km,0); /* the client is 1 */
+	else if (flush(s) == 0 && s->in.len) handleInput(s);
+	memset(km,0,sizeof(km));
+}
+
+/* everything in s->in is either hello or ciphertext */
+static void handleInput(session* s)
+{
+	if (s->open) {
+		const int fd = s->fd;
+		size_t off = 0;
+		const unsigned char* body;
+		size_t blen;
+		unsigned flags;
+		int r;
+		while ((r = recParse(s->in.buf + off,s->in.len - off,&body,&blen,
+						&flags)) > 0) {
+			relay(s,body,blen,flags);
+			if (srv.byFd[fd] != s) return; /* closed */
+			off += r;
+		}
+		if (r < 0) closeSession(s);
+		else sbufConsume(&s->in,off);
+		return;
+	}
+	if (hsIsResume(s->in.buf,s->in.len)) {
+		resume(s);
+		return;
+	}
+	/* A and X are checked (G->check) here, before we use our keys on them */
+	int r = hsDecode(srv.G,s->A,s->X,s->in.buf,s->in.len);
+	if (r < 0) {
+		closeSession(s);
+	} else if (r > 0) {
+		sbufConsume(&s->in,r);
+		/* turn away strangers before spending a dh3Final on them */
+		if (srv.peers && !ksFindPK(srv.peers,s->A))
+			closeSession(s);
+		else if (push(&srv.pending,&srv.nPending,&srv.capPending,s) != 0)
+			closeSession(s);
+		else
+			s->waiting = 1;
+	}
+}
+
+/* n bytes came in on s.  @return 0, or -1 if s was closed */
+static int received(session* s, const unsigned char* buf, size_t n)
+{
+	const int fd = s->fd;
+	/* before the handshake is done, there shouldn't be more than a
+	 * hello's worth of input, and perhaps a record sent right after it */
+	if ((!s->open && s->in.len + n > HS_MAX_HELLO + REC_HDR + REC_MAX) ||
+			sbufAppend(&s->in,buf,n) != 0) {
+		closeSession(s);
+		return -1;
+	}
+	if (!s->waiting) handleInput(s); /* else the rest waits for its key */
+	return srv.byFd[fd] == s ? 0 : -1;
+}
+
+/* key material per session: the AEAD keys, then the ticket's secret */
+#define KM_LEN (AEAD_KM_LEN + HS_SECRET_LEN)
+
+/* key every session whose hello came in during this iteration */
+static void finishHandshakes(void)
+{
+	size_t n = 0;
+	dh3Session hs[srv.nPending ? srv.nPending : 1];
+	unsigned char keys[srv.nPending ? srv.nPending : 1][KM_LEN];
+	for (size_t i = 0; i < srv.nPending; i++) {
+		session* s = srv.pending[i];
+		if (!s) continue; /* closed meanwhile */
+		srv.pending[n] = s;
+		hs[n] = (dh3Session){srv.b,srv.B,s->y,s->Y,s->A,s->X,keys[n],
+			KM_LEN};
+		n++;
+	}
+	srv.nPending = 0;
+	if (n == 0) return;
+	dh3FinalBatchG(srv.G,hs,n); /* failed sessions get a zero key */
+	for (size_t i = 0; i < n; i++) {
+		session* s = srv.pending[i];
+		int ok = 0;
+		for (size_t j = 0; j < AEAD_KM_LEN; j++) ok |= keys[i][j];
+		if (!ok) {
+			closeSession(s);
+			continue;
+		}
+		fingerprintPK(s->A,s->fp);
+		openSession(s,keys[i],mpz_cmp(s->Y,s->X) < 0);
+	}
+	memset(keys,0,sizeof(keys));
+}
+
+static int listenOn(int port)
+{
+	int reuse = 1;
+	struct sockaddr_in addr = {.sin_family = AF_INET,
+		.sin_addr.s_addr = INADDR_ANY, .sin_port = htons(port)};
+	srv.lsock = socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+	if (srv.lsock < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(srv.lsock,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(reuse));
+	if (bind(srv.lsock,(struct sockaddr*)&addr,sizeof(addr)) < 0 ||
+			listen(srv.lsock,SOMAXCONN) < 0) {
+		perror("bind/listen");
+		close(srv.lsock);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef SERVER_URING
+/* The io_uring loop.  Each session always has a multishot receive in
+ * flight, which takes buffers from srv.bufs as data arrives, and at most
+ * one sendmsg of its output queue; a multishot accept makes the sessions.
+ * Requests made while handling completions are submitted together, and we
+ * wait for more in the same system call, so a busy server makes one call
+ * per loop iteration however many clients are talking. */
+#define URING_ENTRIES 4096
+#define URING_BUFS    4096     /* receive buffers; a power of 2 */
+#define URING_BUFSIZE SERVER_READ_CHUNK
+#define URING_BGID    0
+
+/* user_data is the session pointer, with the operation in the low bits */
+enum { OP_ACCEPT, OP_RECV, OP_SEND };
+#define UDATA(s,op) ((uint64_t)(uintptr_t)(s) | (op))
+
+static int armAccept(void)
+{
+	struct io_uring_sqe* sqe = uringSqe(&srv.ring);
+	if (!sqe) return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = srv.lsock;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = UDATA(NULL,OP_ACCEPT);
+	return 0;
+}
+
+static int armRecv(session* s)
+{
+	struct io_uring_sqe* sqe = uringSqe(&srv.ring);
+	if (!sqe) return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = s->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = UDATA(s,OP_RECV);
+	s->ops++;
+	return 0;
+}
+
+static int armSend(session* s)
+{
+	struct io_uring_sqe* sqe = uringSqe(&srv.ring);
+	if (!sqe) return -1;
+	s->msg = (struct msghdr){.msg_iov = s->iov,
+		.msg_iovlen = sqPrepare(&s->out,s->iov,SQ_IOV)};
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = s->fd;
+	sqe->addr = (uintptr_t)&s->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = UDATA(s,OP_SEND);
+	s->ops++;
+	s->sending = 1;
+	return 0;
+}
+
+static void completion(const struct io_uring_cqe* cqe)
+{
+	int op = cqe->user_data & 3;
+	session* s = (session*)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+	int more = cqe->flags & IORING_CQE_F_MORE; /* still armed */
+	if (op == OP_ACCEPT) {
+		if (cqe->res >= 0 && stopping) close(cqe->res);
+		else if (cqe->res >= 0) newSession(cqe->res);
+		if (!more && !stopping) armAccept();
+		return;
+	}
+	/* NOTE: this request still counts in s->ops while we handle it, so
+	 * closeSession below can't free s out from under us */
+	if (op == OP_RECV) {
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (!s->dead && cqe->res > 0)
+				received(s,uringBuf(&srv.bufs,bid),cqe->res);
+			uringBufPut(&srv.bufs,bid);
+		} else if (!s->dead && cqe->res != -ENOBUFS) {
+			closeSession(s); /* closed by the client, or an error */
+		}
+		/* out of buffers (ENOBUFS) and the like end a multishot
+		 * receive; start another */
+		if (!more && !s->dead && armRecv(s) != 0) closeSession(s);
+	} else {
+		s->sending = 0;
+		if (!s->dead) {
+			if (cqe->res < 0) {
+				closeSession(s);
+			} else {
+				sqSent(&s->out,cqe->res,0);
+				flush(s);
+			}
+		}
+	}
+	if (!more && --s->ops == 0 && s->dead) {
+		srv.nDead--;
+		freeSession(s);
+	}
+}
+
+static int loopInit(void)
+{
+	if (uringInit(&srv.ring,URING_ENTRIES) != 0) {
+		perror("io_uring_setup");
+		return -1;
+	}
+	if (uringBufsInit(&srv.ring,&srv.bufs,URING_BGID,URING_BUFS,
+				URING_BUFSIZE) != 0 || armAccept() != 0) {
+		perror("io_uring");
+		uringFree(&srv.ring);
+		return -1;
+	}
+	return 0;
+}
+
+static int loopOnce(void)
+{
+	if (uringSubmit(&srv.ring,1) != 0 && errno != EINTR) {
+		perror("io_uring_enter");
+		return -1;
+	}
+	struct io_uring_cqe* cqe;
+	while ((cqe = uringPeek(&srv.ring))) {
+		struct io_uring_cqe c = *cqe;
+		uringSeen(&srv.ring);
+		completion(&c);
+	}
+	return 0;
+}
+
+static void loopFree(void)
+{
+	/* the kernel may still be using closed sessions' buffers until their
+	 * requests complete, which the shutdowns in closeSession make quick */
+	while (srv.nDead && loopOnce() == 0)
+		;
+	uringBufsFree(&srv.ring,&srv.bufs);
+	uringFree(&srv.ring);
+}
+#else
+static void acceptAll(void)
+{
+	for (;;) {
+		int fd = accept4(srv.lsock,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd >= 0) {
+			newSession(fd);
+			continue;
+		}
+		if (errno == EINTR) continue;
+		/* EAGAIN: that's all of them.  Other errors (EMFILE, say)
+		 * we'll see again next time; nothing to do now. */
+		return;
+	}
+}
+
+static void readable(session* s)
+{
+	unsigned char buf[SERVER_READ_CHUNK];
+	for (;;) {
+		ssize_t n = recv(s->fd,buf,sizeof(buf),0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		if (n <= 0) { /* closed, or an error */
+			closeSession(s);
+			return;
+		}
+		if (received(s,buf,n) != 0 || s->waiting) return;
+	}
+}
+
+static int loopInit(void)
+{
+	srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = {.events = EPOLLIN, .data.fd = -1};
+	if (srv.epfd < 0 || epoll_ctl(srv.epfd,EPOLL_CTL_ADD,srv.lsock,&ev) < 0) {
+		perror("epoll");
+		return -1;
+	}
+	return 0;
+}
+
+static int loopOnce(void)
+{
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	int n = epoll_wait(srv.epfd,events,SERVER_MAX_EVENTS,-1);
+	if (n < 0 && errno == EINTR) return 0;
+	if (n < 0) {
+		perror("epoll_wait");
+		return -1;
+	}
+	for (int i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+		if (fd < 0) {
+			acceptAll();
+			continue;
+		}
+		session* s = srv.byFd[fd];
+		if (!s) continue; /* closed earlier in this batch */
+		/* EPOLLERR is also how zerocopy completions show up */
+		if ((events[i].events & EPOLLERR) && sqReap(&s->out,fd) != 0) {
+			closeSession(s);
+			continue;
+		}
+		if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			readable(s);
+		if ((s = srv.byFd[fd]) && (events[i].events & EPOLLOUT))
+			flush(s);
+	}
+	return 0;
+}
+
+static void loopFree(void)
+{
+	close(srv.epfd);
+}
+#endif
+
+int serverRun(int port, const dhGroup* G, int aead, const dhKey* id,
+		const keyStore* peers)
+{
+	memset(&srv,0,sizeof(srv));
+	srv.G = G;
+	srv.aead = aead;
+	srv.peers = peers;
+	mpz_inits(srv.b,srv.B,NULL);
+	if (id) {
+		mpz_set(srv.b,id->SK);
+		mpz_set(srv.B,id->PK);
+	} else if (dhGenG(G,srv.b,srv.B) != 0) return -1;
+	if (tkInit(&srv.tickets,TICKET_LIFETIME) != 0 || listenOn(port) != 0) {
+		tkFree(&srv.tickets);
+		return -1;
+	}
+	if (loopInit() != 0) {
+		tkFree(&srv.tickets);
+		close(srv.lsock);
+		return -1;
+	}
+	if (G == &dhGroupFF) dhPoolStart(64); /* ephemeral keys for new clients */
+	fprintf(stderr, "serving on port %i...\n",port);
+	stopping = 0;
+	while (!stopping) {
+		if (loopOnce() != 0) break;
+		finishHandshakes();
+	}
+	for (size_t fd = 0; fd < srv.nByFd; fd++)
+		if (srv.byFd[fd]) closeSession(srv.byFd[fd]);
+	close(srv.lsock);
+	loopFree();
+	if (G == &dhGroupFF) dhPoolStop();
+	free(srv.byFd);
+	free(srv.open);
+	free(srv.pending);
+	tkFree(&srv.tickets);
+	shredZ(srv.b);
+	mpz_clears(srv.b,srv.B,NULL);
+	return 0;
+}
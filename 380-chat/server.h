@@ -0,0 +1,28 @@
+/* Multi-client chat server: one thread, non-blocking sockets, epoll.
+ * Every client gets its own session (keys from its own 3DH handshake, and
+ * its own AEAD contexts); a message from one client is decrypted and
+ * re-encrypted for each of the others. */
+#pragma once
+#include "dh.h"
+#include "keystore.h"
+
+/** longest message (in bytes) the server relays.  A client that sends a
+ * longer one is dropped, so clients should refuse to send them. */
+#define SERVER_MAX_MESSAGE (4 << 20)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** serve on port until serverStop is called (from a signal handler, say).
+ * G is the key exchange group and aead the record cipher (AEAD_... from
+ * aead.h); clients must use the same ones.  id is the server's long term
+ * key (NULL for a fresh one), and if peers isn't NULL, only clients whose
+ * long term key is in it are let in.
+ * @return 0 after serverStop, -1 if we couldn't start */
+int serverRun(int port, const dhGroup* G, int aead, const dhKey* id,
+		const keyStore* peers);
+/** make serverRun return.  Async signal safe. */
+void serverStop(void);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,115 @@
+#include "ticket.h"
+#include "rng.h"
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <endian.h>
+#include <string.h>
+
+static void keyFree(ticketKey* k)
+{
+	EVP_CIPHER_CTX_free(k->enc);
+	EVP_CIPHER_CTX_free(k->dec);
+	memset(k,0,sizeof(*k));
+}
+
+/* a fresh random key; the key schedule is done once, here */
+static int keyNew(ticketKey* k, uint32_t id)
+{
+	unsigned char key[32];
+	memset(k,0,sizeof(*k));
+	k->enc = EVP_CIPHER_CTX_new();
+	k->dec = EVP_CIPHER_CTX_new();
+	int rv = (k->enc && k->dec && randBytes(key,sizeof(key)) == 0 &&
+			EVP_EncryptInit_ex(k->enc,EVP_aes_256_gcm(),NULL,key,NULL) &&
+			EVP_DecryptInit_ex(k->dec,EVP_aes_256_gcm(),NULL,key,NULL)) ? 0 : -1;
+	OPENSSL_cleanse(key,sizeof(key));
+	if (rv != 0) {
+		keyFree(k);
+		return -1;
+	}
+	k->id = id;
+	k->born = time(NULL);
+	return 0;
+}
+
+int tkInit(ticketKeys* t, unsigned lifetime)
+{
+	uint32_t id;
+	memset(t,0,sizeof(*t));
+	t->lifetime = lifetime;
+	if (randBytes(&id,sizeof(id)) != 0) return -1;
+	return keyNew(&t->cur,id);
+}
+
+int tkIssue(ticketKeys* t, unsigned char* ticket, const unsigned char* secret,
+		const unsigned char* fp)
+{
+	time_t now = time(NULL);
+	if (now - t->cur.born >= (time_t)t->lifetime || t->seq == UINT64_MAX) {
+		/* tickets under prev have all expired by now */
+		ticketKey k;
+		if (keyNew(&k,t->cur.id + 1) != 0) return -1;
+		keyFree(&t->prev);
+		t->prev = t->cur;
+		t->cur = k;
+		t->seq = 0;
+	}
+	unsigned char pt[TICKET_PLAIN];
+	uint64_t born = htole64((uint64_t)now);
+	memcpy(pt,&born,8);
+	memcpy(pt + 8,secret,TICKET_SECRET_LEN);
+	memcpy(pt + 8 + TICKET_SECRET_LEN,fp,TICKET_FP_LEN);
+	uint32_t id = htobe32(t->cur.id);
+	uint64_t seq = htobe64(t->seq++);
+	memcpy(ticket,&id,4);
+	memcpy(ticket + 4,&seq,8);
+	unsigned char* ct = ticket + 12;
+	int len, fin;
+	int rv = (EVP_EncryptInit_ex(t->cur.enc,NULL,NULL,NULL,ticket) &&
+			EVP_EncryptUpdate(t->cur.enc,ct,&len,pt,TICKET_PLAIN) &&
+			EVP_EncryptFinal_ex(t->cur.enc,ct + len,&fin) &&
+			EVP_CIPHER_CTX_ctrl(t->cur.enc,EVP_CTRL_GCM_GET_TAG,16,
+				ct + TICKET_PLAIN)) ? 0 : -1;
+	OPENSSL_cleanse(pt,sizeof(pt));
+	return rv;
+}
+
+int tkOpen(ticketKeys* t, const unsigned char* ticket, unsigned char* secret,
+		unsigned char* fp)
+{
+	uint32_t id;
+	memcpy(&id,ticket,4);
+	id = be32toh(id);
+	ticketKey* k = (id == t->cur.id) ? &t->cur :
+		(t->prev.dec && id == t->prev.id) ? &t->prev : NULL;
+	if (!k) return -1;
+	unsigned char pt[TICKET_PLAIN];
+	const unsigned char* ct = ticket + 12;
+	int len, fin;
+	int rv = -1;
+	if (!EVP_DecryptInit_ex(k->dec,NULL,NULL,NULL,ticket) ||
+			!EVP_DecryptUpdate(k->dec,pt,&len,ct,TICKET_PLAIN) ||
+			!EVP_CIPHER_CTX_ctrl(k->dec,EVP_CTRL_GCM_SET_TAG,16,
+				(void*)(ct + TICKET_PLAIN)) ||
+			EVP_DecryptFinal_ex(k->dec,pt + len,&fin) <= 0)
+		goto end;
+	uint64_t born;
+	memcpy(&born,pt,8);
+	born = le64toh(born);
+	time_t now = time(NULL);
+	if ((time_t)born > now || now - (time_t)born >= (time_t)t->lifetime)
+		goto end;
+	memcpy(secret,pt + 8,TICKET_SECRET_LEN);
+	memcpy(fp,pt + 8 + TICKET_SECRET_LEN,TICKET_FP_LEN);
+	rv = 0;
+end:
+	OPENSSL_cleanse(pt,sizeof(pt));
+	return rv;
+}
+
+void tkFree(ticketKeys* t)
+{
+	keyFree(&t->cur);
+	keyFree(&t->prev);
+	memset(t,0,sizeof(*t));
+}
@@ -0,0 +1,53 @@
+/* Session tickets, the server's side: after a full handshake the server
+ * seals the session's resumption secret (and who the client was) under a
+ * key only it knows, and gives the client the result.  The client hands it
+ * back on reconnect (see hsRun), so the server can resume the session
+ * without keeping anything per client.
+ *
+ * A ticket is nonce (12 bytes) || ciphertext || tag (16 bytes), AES-256-GCM.
+ * The nonce is the key's id followed by a count of tickets issued under it,
+ * so it never repeats.  The ticket key is replaced every lifetime seconds;
+ * the one before it is kept, so every ticket is good for its whole life. */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TICKET_SECRET_LEN 32
+#define TICKET_FP_LEN     32 /* as KS_FP_LEN */
+#define TICKET_PLAIN      (8 + TICKET_SECRET_LEN + TICKET_FP_LEN)
+#define TICKET_LEN        (12 + TICKET_PLAIN + 16)
+/** default lifetime of a ticket (and a ticket key), in seconds */
+#define TICKET_LIFETIME   (24*60*60)
+
+typedef struct {
+	void* enc;              /* EVP_CIPHER_CTXs, keyed */
+	void* dec;
+	uint32_t id;
+	time_t born;
+} ticketKey;
+
+typedef struct {
+	ticketKey cur, prev;
+	uint64_t seq;           /* tickets issued under cur */
+	unsigned lifetime;
+} ticketKeys;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** set up t with a fresh random key.  @return 0, or -1 on failure */
+int tkInit(ticketKeys* t, unsigned lifetime);
+/** seal secret (TICKET_SECRET_LEN bytes) and the client's fingerprint fp
+ * (TICKET_FP_LEN bytes) into a TICKET_LEN byte ticket.  @return 0 or -1 */
+int tkIssue(ticketKeys* t, unsigned char* ticket, const unsigned char* secret,
+		const unsigned char* fp);
+/** open a ticket we issued, if it hasn't expired.
+ * @return 0 (secret and fp are set), or -1 if it's bad, stale or not ours */
+int tkOpen(ticketKeys* t, const unsigned char* ticket, unsigned char* secret,
+		unsigned char* fp);
+/** free t and erase its keys */
+void tkFree(ticketKeys* t);
+#ifdef __cplusplus
+}
+#endif
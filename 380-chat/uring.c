@@ -0,0 +1,157 @@
+/* The ring layout and memory ordering follow io_uring(7): we own the SQ
+ * tail and the CQ head, the kernel owns the others, and each side reads
+ * the other's index with acquire and publishes its own with release. */
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define load(p)    __atomic_load_n(p,__ATOMIC_ACQUIRE)
+#define store(p,v) __atomic_store_n(p,v,__ATOMIC_RELEASE)
+
+int uringInit(uring* r, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p,0,sizeof(p));
+	memset(r,0,sizeof(*r));
+	/* we're the only thread using it, and only look for completions in
+	 * uringSubmit, which lets the kernel put off its work until then */
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	r->fd = syscall(__NR_io_uring_setup,entries,&p);
+	if (r->fd < 0 && errno == EINVAL) { /* before 6.1 */
+		memset(&p,0,sizeof(p));
+		r->fd = syscall(__NR_io_uring_setup,entries,&p);
+	}
+	if (r->fd < 0) return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) { /* before 5.4 */
+		close(r->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	size_t sqSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	size_t cqSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	r->ringSize = sqSize > cqSize ? sqSize : cqSize;
+	r->ring = mmap(NULL,r->ringSize,PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+	r->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL,r->sqesSize,PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE,r->fd,IORING_OFF_SQES);
+	if (r->ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+		int e = errno;
+		uringFree(r);
+		errno = e;
+		return -1;
+	}
+	char* q = r->ring;
+	r->sqHead = (unsigned*)(q + p.sq_off.head);
+	r->sqTail = (unsigned*)(q + p.sq_off.tail);
+	r->sqMask = *(unsigned*)(q + p.sq_off.ring_mask);
+	r->sqArray = (unsigned*)(q + p.sq_off.array);
+	r->cqHead = (unsigned*)(q + p.cq_off.head);
+	r->cqTail = (unsigned*)(q + p.cq_off.tail);
+	r->cqMask = *(unsigned*)(q + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(q + p.cq_off.cqes);
+	r->sqLocal = *r->sqTail;
+	return 0;
+}
+
+struct io_uring_sqe* uringSqe(uring* r)
+{
+	if (r->sqLocal - load(r->sqHead) > r->sqMask &&
+			(uringSubmit(r,0) != 0 || r->sqLocal - load(r->sqHead) > r->sqMask))
+		return NULL;
+	unsigned i = r->sqLocal++ & r->sqMask;
+	struct io_uring_sqe* sqe = &r->sqes[i];
+	memset(sqe,0,sizeof(*sqe));
+	r->sqArray[i] = i;
+	return sqe;
+}
+
+int uringSubmit(uring* r, unsigned waitFor)
+{
+	store(r->sqTail,r->sqLocal);
+	/* NOTE: counted from the kernel's head rather than our last submit, so
+	 * a call cut short by a signal leaves nothing behind */
+	unsigned n = r->sqLocal - load(r->sqHead);
+	int rv = syscall(__NR_io_uring_enter,r->fd,n,waitFor,
+			waitFor ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+	return rv < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe* uringPeek(uring* r)
+{
+	unsigned head = *r->cqHead;
+	if (head == load(r->cqTail)) return NULL;
+	return &r->cqes[head & r->cqMask];
+}
+
+void uringSeen(uring* r)
+{
+	store(r->cqHead,*r->cqHead + 1);
+}
+
+void uringFree(uring* r)
+{
+	if (r->ring && r->ring != MAP_FAILED) munmap(r->ring,r->ringSize);
+	if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes,r->sqesSize);
+	close(r->fd);
+	memset(r,0,sizeof(*r));
+	r->fd = -1;
+}
+
+int uringBufsInit(uring* r, uringBufs* b, uint16_t bgid, unsigned nBufs,
+		unsigned bufSize)
+{
+	memset(b,0,sizeof(*b));
+	size_t ringSize = nBufs*sizeof(struct io_uring_buf);
+	if (posix_memalign((void**)&b->br,4096,ringSize) != 0) return -1;
+	if (!(b->mem = malloc((size_t)nBufs*bufSize))) {
+		free(b->br);
+		return -1;
+	}
+	memset(b->br,0,ringSize);
+	b->nBufs = nBufs;
+	b->bufSize = bufSize;
+	b->bgid = bgid;
+	struct io_uring_buf_reg reg = {.ring_addr = (uintptr_t)b->br,
+		.ring_entries = nBufs, .bgid = bgid};
+	if (syscall(__NR_io_uring_register,r->fd,IORING_REGISTER_PBUF_RING,
+				&reg,1) != 0) {
+		free(b->mem);
+		free(b->br);
+		memset(b,0,sizeof(*b));
+		return -1;
+	}
+	for (unsigned i = 0; i < nBufs; i++) uringBufPut(b,i);
+	return 0;
+}
+
+unsigned char* uringBuf(uringBufs* b, unsigned bid)
+{
+	return b->mem + (size_t)bid*b->bufSize;
+}
+
+void uringBufPut(uringBufs* b, unsigned bid)
+{
+	/* NOTE: the tail lives in the first entry's resv field, and the kernel
+	 * never writes it, so a plain read of our own last store is fine */
+	uint16_t tail = b->br->tail;
+	struct io_uring_buf* e = &b->br->bufs[tail & (b->nBufs - 1)];
+	e->addr = (uintptr_t)uringBuf(b,bid);
+	e->len = b->bufSize;
+	e->bid = bid;
+	store(&b->br->tail,(uint16_t)(tail + 1));
+}
+
+void uringBufsFree(uring* r, uringBufs* b)
+{
+	if (!b->br) return;
+	struct io_uring_buf_reg reg = {.bgid = b->bgid};
+	syscall(__NR_io_uring_register,r->fd,IORING_UNREGISTER_PBUF_RING,&reg,1);
+	free(b->mem);
+	free(b->br);
+	memset(b,0,sizeof(*b));
+}
@@ -0,0 +1,66 @@
+/* A minimal io_uring wrapper on the raw system calls (no liburing): the
+ * submission and completion rings, plus a ring of provided buffers that the
+ * kernel picks receive buffers from.  Only what server.c needs when it is
+ * built with `make uring=1`. */
+#pragma once
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	int fd;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned sqMask;
+	unsigned* sqArray;
+	struct io_uring_sqe* sqes;
+	unsigned sqLocal;       /* our tail: SQEs handed out, not yet published */
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe* cqes;
+	void* ring;             /* the SQ and CQ rings (one mapping) */
+	size_t ringSize;
+	size_t sqesSize;
+} uring;
+
+/** a group of nBufs receive buffers of bufSize bytes each, registered with
+ * the ring under id bgid */
+typedef struct {
+	struct io_uring_buf_ring* br;
+	unsigned char* mem;
+	unsigned nBufs;
+	unsigned bufSize;
+	uint16_t bgid;
+} uringBufs;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** set up r with room for entries SQEs.  @return 0, or -1 (see errno) */
+int uringInit(uring* r, unsigned entries);
+/** an SQE to fill in, zeroed.  If the SQ is full, what's in it is
+ * submitted first.  @return NULL if even that fails */
+struct io_uring_sqe* uringSqe(uring* r);
+/** submit everything handed out by uringSqe, and wait until at least
+ * waitFor completions are ready.  @return 0, or -1 (see errno; EINTR if a
+ * signal came first, in which case just call it again) */
+int uringSubmit(uring* r, unsigned waitFor);
+/** the oldest unseen completion, or NULL if there is none */
+struct io_uring_cqe* uringPeek(uring* r);
+/** done with the completion uringPeek returned */
+void uringSeen(uring* r);
+void uringFree(uring* r);
+
+/** register b: nBufs (a power of 2) buffers of bufSize bytes.
+ * @return 0, or -1 */
+int uringBufsInit(uring* r, uringBufs* b, uint16_t bgid, unsigned nBufs,
+		unsigned bufSize);
+/** buffer number bid (from a completion's flags) */
+unsigned char* uringBuf(uringBufs* b, unsigned bid);
+/** give buffer bid back to the kernel */
+void uringBufPut(uringBufs* b, unsigned bid);
+void uringBufsFree(uring* r, uringBufs* b);
+#ifdef __cplusplus
+}
+#endif
@@ -1,5 +1,7 @@
 #include "util.h"
 #include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,32 +13,266 @@
 /* when reading long integers, never read more than this many bytes: */
 #define MPZ_MAX_LEN 1024
 
-/* Like read(), but retry on EINTR and EWOULDBLOCK,
- * abort on other errors, and don't return early. */
-void xread(int fd, void *buf, size_t nBytes)
+/* wait until fd is ready for events, at most timeout ms.
+ * @return 0, or -1 on an error or timeout (errno ETIMEDOUT) */
+static int waitFor(int fd, short events, int timeout)
 {
-	do {
+	struct pollfd p = {.fd = fd, .events = events};
+	for (;;) {
+		int r = poll(&p,1,timeout);
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0) return -1;
+		if (r == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		/* POLLHUP/POLLERR: let the read or write say what happened */
+		return 0;
+	}
+}
+
+int xread(int fd, void *buf, size_t nBytes)
+{
+	while (nBytes) {
 		ssize_t n = read(fd, buf, nBytes);
 		if (n < 0 && errno == EINTR) continue;
-		if (n < 0 && errno == EWOULDBLOCK) continue;
-		if (n < 0) perror("read"), abort();
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (waitFor(fd,POLLIN,-1) != 0) return -1;
+			continue;
+		}
+		if (n < 0) return -1;
+		if (n == 0) {
+			errno = 0;
+			return -1;
+		}
 		buf = (char *)buf + n;
 		nBytes -= n;
-	} while (nBytes);
+	}
+	return 0;
 }
 
-/* Like write(), but retry on EINTR and EWOULDBLOCK,
- * abort on other errors, and don't return early. */
-void xwrite(int fd, const void *buf, size_t nBytes)
+int xwrite(int fd, const void *buf, size_t nBytes)
 {
-	do {
+	while (nBytes) {
 		ssize_t n = write(fd, buf, nBytes);
 		if (n < 0 && errno == EINTR) continue;
-		if (n < 0 && errno == EWOULDBLOCK) continue;
-		if (n < 0) perror("write"), abort();
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (waitFor(fd,POLLOUT,-1) != 0) return -1;
+			continue;
+		}
+		if (n < 0) return -1;
 		buf = (const char *)buf + n;
 		nBytes -= n;
-	} while (nBytes);
+	}
+	return 0;
+}
+
+void xsInit(xstream* s, int fd, int timeout)
+{
+	s->fd = fd;
+	s->timeout = timeout;
+	s->rpos = s->rlen = s->wlen = 0;
+}
+
+/* NOTE: the stream calls don't block in recv/send, even on a blocking
+ * socket, so that poll (and so the timeout) is what does the waiting */
+static ssize_t xsRecv(int fd, void* buf, size_t n)
+{
+	ssize_t r = recv(fd,buf,n,MSG_DONTWAIT);
+	if (r < 0 && errno == ENOTSOCK) r = read(fd,buf,n);
+	return r;
+}
+
+/* one read into rbuf, which must be empty.
+ * @return bytes read, 0 at end of file, -1 on an error or timeout */
+static ssize_t fill(xstream* s)
+{
+	s->rpos = s->rlen = 0;
+	for (;;) {
+		ssize_t n = xsRecv(s->fd,s->rbuf,XS_BUFSIZE);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (waitFor(s->fd,POLLIN,s->timeout) != 0) return -1;
+			continue;
+		}
+		if (n > 0) s->rlen = n;
+		return n;
+	}
+}
+
+ssize_t xsReadSome(xstream* s, void* buf, size_t n)
+{
+	if (n == 0) return 0;
+	if (s->rpos == s->rlen) {
+		/* big reads skip the buffer */
+		if (n >= XS_BUFSIZE) {
+			for (;;) {
+				ssize_t r = xsRecv(s->fd,buf,n);
+				if (r < 0 && errno == EINTR) continue;
+				if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					if (waitFor(s->fd,POLLIN,s->timeout) != 0) return -1;
+					continue;
+				}
+				return r;
+			}
+		}
+		ssize_t r = fill(s);
+		if (r <= 0) return r;
+	}
+	size_t k = s->rlen - s->rpos;
+	if (k > n) k = n;
+	memcpy(buf,s->rbuf + s->rpos,k);
+	s->rpos += k;
+	return k;
+}
+
+int xsRead(xstream* s, void* buf, size_t n)
+{
+	while (n) {
+		ssize_t r = xsReadSome(s,buf,n);
+		if (r < 0) return -1;
+		if (r == 0) {
+			errno = 0;
+			return -1;
+		}
+		buf = (char*)buf + r;
+		n -= r;
+	}
+	return 0;
+}
+
+int xsFlush(xstream* s)
+{
+	size_t off = 0;
+	while (off < s->wlen) {
+		ssize_t n = send(s->fd,s->wbuf + off,s->wlen - off,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && errno == ENOTSOCK)
+			n = write(s->fd,s->wbuf + off,s->wlen - off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (waitFor(s->fd,POLLOUT,s->timeout) != 0) break;
+			continue;
+		}
+		if (n < 0) break;
+		off += n;
+	}
+	/* keep whatever didn't go, so a retry picks up where this left off */
+	memmove(s->wbuf,s->wbuf + off,s->wlen - off);
+	s->wlen -= off;
+	return s->wlen ? -1 : 0;
+}
+
+int xsWrite(xstream* s, const void* buf, size_t n)
+{
+	while (n) {
+		if (s->wlen == XS_BUFSIZE && xsFlush(s) != 0) return -1;
+		size_t k = XS_BUFSIZE - s->wlen;
+		if (k > n) k = n;
+		memcpy(s->wbuf + s->wlen,buf,k);
+		s->wlen += k;
+		buf = (const char*)buf + k;
+		n -= k;
+	}
+	return 0;
+}
+
+void shredZ(mpz_t x)
+{
+	size_t nLimbs = mpz_size(x);
+	memset(mpz_limbs_write(x,nLimbs),0,nLimbs*sizeof(mp_limb_t));
+	mpz_limbs_finish(x,0);
+}
+
+/* NOTE: on a little endian machine, the limbs of an integer are already
+ * its bytes in serialized order, so we copy them rather than have
+ * mpz_export/mpz_import go a byte at a time. */
+
+/* nB = mpz_sizeinbase(x,256) bytes of |x|, least significant first */
+static void putBytes(unsigned char* out, size_t nB, mpz_srcptr x)
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	if (mpz_size(x)) memcpy(out,mpz_limbs_read(x),nB);
+	else *out = 0;
+#else
+	*out = 0; /* for x == 0, which mpz_export writes nothing for */
+	Z2BYTES(out,NULL,x);
+#endif
+}
+
+static void getBytes(mpz_ptr x, const unsigned char* in, size_t nB)
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	size_t nLimbs = (nB + sizeof(mp_limb_t) - 1) / sizeof(mp_limb_t);
+	mp_limb_t* l = mpz_limbs_write(x,nLimbs ? nLimbs : 1);
+	if (nLimbs) {
+		l[nLimbs-1] = 0; /* the part of the top limb we don't fill */
+		memcpy(l,in,nB);
+	}
+	mpz_limbs_finish(x,nLimbs); /* drops leading zero limbs */
+#else
+	BYTES2Z(x,in,nB);
+#endif
+}
+
+size_t mpzv_size(mpz_ptr* x, size_t n)
+{
+	size_t total = 0;
+	/* NOTE: mpz_sizeinbase will return 1 if x is 0, which is what we write */
+	for (size_t i = 0; i < n; i++) total += 4 + mpz_sizeinbase(x[i],256);
+	return total;
+}
+
+size_t serialize_mpzv(unsigned char* buf, size_t cap, mpz_ptr* x, size_t n)
+{
+	size_t off = 0;
+	for (size_t i = 0; i < n; i++) {
+		size_t nB = mpz_sizeinbase(x[i],256);
+		assert(nB < 1LU << 32); /* make sure it fits in 4 bytes */
+		if (4 + nB > cap - off) return 0;
+		LE(nB);
+		memcpy(buf + off,&nB_le,4);
+		putBytes(buf + off + 4,nB,x[i]);
+		off += 4 + nB;
+	}
+	return off;
+}
+
+ssize_t deserialize_mpzv(mpz_ptr* x, size_t n, const unsigned char* buf,
+		size_t len, size_t maxLen)
+{
+	size_t off = 0;
+	/* check every length before touching x, so a partial buffer (or a bad
+	 * one) leaves x as it was */
+	for (size_t i = 0; i < n; i++) {
+		uint32_t nB_le;
+		if (len - off < 4) return 0;
+		memcpy(&nB_le,buf + off,4);
+		size_t nB = le32toh(nB_le);
+		if (nB > maxLen) return -1;
+		if (len - off - 4 < nB) return 0;
+		off += 4 + nB;
+	}
+	for (size_t i = 0, o = 0; i < n; i++) {
+		uint32_t nB_le;
+		memcpy(&nB_le,buf + o,4);
+		size_t nB = le32toh(nB_le);
+		getBytes(x[i],buf + o + 4,nB);
+		o += 4 + nB;
+	}
+	return off;
+}
+
+size_t serialize_mpzs(int fd, mpz_ptr* x, size_t n)
+{
+	unsigned char arena[4096]; /* enough for a few 4096 bit integers */
+	size_t len = mpzv_size(x,n);
+	unsigned char* buf = (len <= sizeof(arena)) ? arena : malloc(len);
+	if (!buf) return 0;
+	serialize_mpzv(buf,len,x,n);
+	int rv = xwrite(fd,buf,len);
+	if (buf != arena) free(buf);
+	return rv == 0 ? len : 0;
 }
 
 size_t serialize_mpz(int fd, mpz_t x)
@@ -47,34 +283,20 @@ size_t serialize_mpz(int fd, mpz_t x)
 	 * +--------------------------------------------+---------------------------+
 	 * */
 	/* NOTE: for compatibility across different systems, we always write integers
-	 * little endian byte order when serializing.  Note also that mpz_sizeinbase
-	 * will return 1 if x is 0, so nB should always be the correct byte count. */
-	size_t nB;
-	unsigned char* buf = Z2BYTES(NULL,&nB,x);
-	/* above has allocated memory for us, and stored the size in nB.  HOWEVER,
-	 * if x was 0, then no allocation would be done, and buf will be NULL: */
-	if (!buf) {
-		nB = 1;
-		buf = malloc(1);
-		*buf = 0;
-	}
-	assert(nB < 1LU << 32); /* make sure it fits in 4 bytes */
-	LE(nB);
-	xwrite(fd,&nB_le,4);
-	xwrite(fd,buf,nB);
-	free(buf);
-	return nB+4; /* total number of bytes written to fd */
+	 * little endian byte order when serializing. */
+	mpz_ptr v[1] = {x};
+	return serialize_mpzs(fd,v,1); /* total number of bytes written to fd */
 }
 
 int deserialize_mpz(mpz_t x, int fd)
 {
 	/* we assume buffer is formatted as above */
 	uint32_t nB_le;
-	xread(fd,&nB_le,4);
+	unsigned char buf[MPZ_MAX_LEN];
+	if (xread(fd,&nB_le,4) != 0) return -1;
 	size_t nB = le32toh(nB_le);
 	if (nB > MPZ_MAX_LEN) return -1;
-	unsigned char* buf = malloc(nB);
-	xread(fd,buf,nB);
-	BYTES2Z(x,buf,nB);
+	if (xread(fd,buf,nB) != 0) return -1;
+	getBytes(x,buf,nB);
 	return 0;
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <gmp.h>
+#include <sys/types.h>
 /* convenience macros */
 #define ISPRIME(x) mpz_probab_prime_p(x,10)
 #define NEWZ(x) mpz_t x; mpz_init(x)
@@ -11,6 +12,10 @@
 
 /* utility functions */
 
+/** overwrite the limbs of x with zeros, leaving x initialized and == 0.
+ * Use this before reusing or clearing an integer that held a secret. */
+void shredZ(mpz_t x);
+
 /** write an mpz_t as an unambiguous sequence of bytes.
  * @param fd is the file descriptor to write to.  Must be opened for writing.
  * @param x is the integer to serialize and write.
@@ -25,10 +30,60 @@ size_t serialize_mpz(int fd, mpz_t x);
  * @return 0 for success */
 int deserialize_mpz(mpz_t x, int fd);
 
-/** Like read(), but retry on EINTR and EWOULDBLOCK,
- * abort on other errors, and don't return early. */
-void xread(int fd, void *buf, size_t nBytes);
+/** bytes that serialize_mpzv needs for x[0..n) */
+size_t mpzv_size(mpz_ptr* x, size_t n);
+
+/** serialize x[0..n) into the caller's buffer (an arena, say), one after
+ * another in serialize_mpz's format, ready to go out in one write.
+ * @return bytes used, or 0 if they don't fit in cap */
+size_t serialize_mpzv(unsigned char* buf, size_t cap, mpz_ptr* x, size_t n);
+
+/** inverse of serialize_mpzv: set x[0..n) (initialized already) from
+ * buf[0..len).  Any integer longer than maxLen bytes makes the whole lot bad.
+ * @return bytes used, 0 if buf holds only part of them, -1 if they're bad */
+ssize_t deserialize_mpzv(mpz_ptr* x, size_t n, const unsigned char* buf,
+		size_t len, size_t maxLen);
+
+/** serialize x[0..n) and write it to fd with one write.
+ * @return total number of bytes written, or 0 to indicate failure */
+size_t serialize_mpzs(int fd, mpz_ptr* x, size_t n);
+
+/** Like read(), but retry on EINTR, wait (with poll) on EWOULDBLOCK,
+ * and don't return early.
+ * @return 0, or -1 on an error or end of file (errno is 0 for the latter) */
+int xread(int fd, void *buf, size_t nBytes);
+
+/** Like write(), but retry on EINTR, wait (with poll) on EWOULDBLOCK,
+ * and don't return early.  @return 0, or -1 on an error */
+int xwrite(int fd, const void *buf, size_t nBytes);
+
+/* buffered streams */
+
+#define XS_BUFSIZE 8192
+
+/** a file descriptor (blocking or not) with buffering both ways: reads
+ * take as much as the fd has ready (up to XS_BUFSIZE) and serve later
+ * reads from that, and writes collect in a buffer until xsFlush (or until
+ * it fills).  Waiting is done with poll, so a non-blocking fd doesn't spin,
+ * and gives up after timeout ms without progress. */
+typedef struct {
+	int fd;
+	int timeout;            /* ms, or -1 for no limit */
+	size_t rpos, rlen;      /* unread data is rbuf[rpos..rlen) */
+	size_t wlen;            /* unwritten data is wbuf[0..wlen) */
+	unsigned char rbuf[XS_BUFSIZE];
+	unsigned char wbuf[XS_BUFSIZE];
+} xstream;
 
-/** Like write(), but retry on EINTR and EWOULDBLOCK,
- * abort on other errors, and don't return early. */
-void xwrite(int fd, const void *buf, size_t nBytes);
+/** set up s for fd; see xstream for timeout */
+void xsInit(xstream* s, int fd, int timeout);
+/** read exactly n bytes.  @return 0, or -1 on an error, a timeout
+ * (errno ETIMEDOUT) or end of file (errno 0) */
+int xsRead(xstream* s, void* buf, size_t n);
+/** read what's available, at least 1 byte and at most n, waiting if need
+ * be.  @return the count, 0 at end of file, or -1 on an error or timeout */
+ssize_t xsReadSome(xstream* s, void* buf, size_t n);
+/** buffer n bytes for writing.  @return 0, or -1 on an error */
+int xsWrite(xstream* s, const void* buf, size_t n);
+/** write out everything buffered.  @return 0, or -1 on an error or timeout */
+int xsFlush(xstream* s);